@@ -26,19 +26,57 @@ typedef struct {
 struct UObject;
 struct AActor;
 struct UMaterial;
+struct FWorldSnapshot;
 
 AActor *FindActor(const char *fullName);
+AActor* GetActorByName(UObject* _this, const char* name);
+int GetActorsByClass(UObject* _this, const char* className, AActor** actors, int maxActors);
+int GetActorsByTag(UObject* _this, const char* tag, AActor** actors, int maxActors);
+bool IsActorValid(const AActor* actor);
 
 void GetViewportSize(IntSize* r);
 bool CaptureScreenshot(IntSize* size, void* data);
+bool CaptureScreenshotBytes(IntSize* size, void* data, int layout);
+bool CaptureScreenshotNormalized(IntSize* size, void* data, const float* mean, const float* std);
+void SetAsyncScreenshotDepth(int depth);
+bool RequestScreenshotAsync(UObject* _this, const IntSize* size);
+bool PeekScreenshotAsync(bool wait, IntSize* size, int64_t* frameNumber, float* gameTime);
+bool PopScreenshotAsync(void* data, int format);
+int CreateCaptureCamera(UObject* _this, int width, int height, float fov);
+void DestroyCaptureCamera(int id);
+bool GetCaptureCameraSize(int id, IntSize* size);
+bool SetCaptureCameraPose(UObject* _this, int id, bool relative, float x, float y, float z, float pitch, float yaw, float roll);
+bool CaptureCameras(UObject* _this, const int* ids, int n, void** data, int format);
+int CreateEnvironment(UObject* _this, const char* levelName, float x, float y, float z, int width, int height, float fov);
+void DestroyEnvironment(int id);
+bool IsEnvironmentLoaded(int id);
+bool AddEnvironmentCameraActor(int id, AActor* actor);
+int GetEnvironmentInfo(int id, float* x, float* y, float* z);
+int GetEnvironmentActors(int id, AActor** actors, int maxActors);
+bool SetEnvironmentCameraPose(UObject* _this, int id, float x, float y, float z, float pitch, float yaw, float roll);
 bool CaptureSegmentation(UObject* _this, const IntSize* size, void* seg_data, int stride, const AActor** objects, int nObjects, bool verbose);
 bool CaptureMasks(UObject* _this, const IntSize* size, void* seg_data, int stride, const AActor** objects, int nObjects, bool verbose);
+bool CaptureMasksPacked(UObject* _this, const IntSize* size, void* mask_data, int stride, const AActor** objects, int nObjects, bool verbose);
+int CaptureMasksRLE(UObject* _this, const IntSize* size, int stride, const AActor** objects, int nObjects, bool verbose);
+bool GetMaskRuns(int* runs, int n);
+void UnpackMasks(const void* mask_data, int nPixels, int nObjects, void* masks);
+bool DecodeMaskRuns(const int* runs, int n, int nPixels, int nObjects, void* masks);
+bool CaptureBoundingBoxes(UObject* _this, const IntSize* size, const AActor** objects, int nObjects, int samples, float* boxes, float* visibility, bool verbose);
 bool CaptureOpticalFlow(UObject* _this, const IntSize* size, void* flow_data, void* rgb_data, float maxFlow, int stride, bool verbose);
 bool CaptureDepthField(UObject* _this, const IntSize* size, void* data, int stride, bool verbose);
+bool CaptureModalities(UObject* _this, const IntSize* size, int modalities, int stride, const AActor** objects, int nObjects, void* seg_data, void* mask_data, void* depth_data, void* flow_data, void* flow_rgb_data, float maxFlow, bool verbose);
+bool CaptureAdaptive(UObject* _this, const IntSize* size, int baseStride, const AActor** objects, int nObjects, void* seg_data, void* depth_data, float depthTolerance, int* nRays, bool verbose);
+bool CaptureSegmentationIncremental(UObject* _this, const IntSize* size, void* seg_data, void* depth_data, int stride, const AActor** objects, int nObjects, int* nRays, bool verbose);
+void ResetIncrementalCapture();
+int CaptureInstanceSegmentation(UObject* _this, const IntSize* size, void* seg_data, int stride, bool verbose);
+bool GetInstanceName(int id, char* name, int len);
+void ResetInstanceIds();
+void SetParallelCapture(bool enabled, int tileSize);
 
 void PressKey(UObject* _this, const char *key, int ControllerId, int eventType);
 void SetMouse(int x, int y);
 bool SetTickDeltaBounds(UObject* _this, float MinDeltaSeconds, float MaxDeltaSeconds);
+bool SetLockstep(UObject* _this, bool enabled, float dt);
 bool SetResolution(int x, int y);
 void ExecuteConsoleCommand(UObject* _this, char* command);
 
@@ -49,6 +87,12 @@ bool GetActorVelocity(AActor* object, float* x, float* y, float* z);
 bool GetActorAngularVelocity(AActor* object, float* x, float* y, float* z);
 bool GetActorScale3D(AActor* object, float* x, float* y, float* z);
 bool GetActorBounds(AActor* object, float* x, float* y, float* z, float* boxX, float* boxY, float* boxZ);
+int GetActorsState(AActor** objects, int nObjects, int fields, float* data, uint8_t* status);
+int SetActorsState(AActor** objects, int nObjects, int fields, const float* data, uint8_t* status);
+FWorldSnapshot* CreateSnapshot(UObject* _this, AActor** objects, int nObjects);
+int RestoreSnapshot(UObject* _this, FWorldSnapshot* snapshot);
+int GetSnapshotNumActors(const FWorldSnapshot* snapshot);
+void FreeSnapshot(FWorldSnapshot* snapshot);
 
 bool SetActorLocation(AActor* object, float x, float y, float z);
 bool SetActorRotation(AActor* object, float pitch, float yaw, float roll);
@@ -60,6 +104,15 @@ bool SetActorScale3D(AActor* object, float x, float y, float z);
 
 bool SetMaterial(AActor* object, UMaterial* material);
 bool AddForce(AActor* object, float x, float y, float z);
+AActor* SpawnStaticMeshActor(UObject* _this, const char* meshPath, bool relative, float x, float y, float z, float pitch, float yaw, float roll, float scale, bool simulatePhysics);
+bool DestroyActor(AActor* object);
+
+bool StartRecording(const char* path);
+void StopRecording();
+bool StartReplay(UObject* _this, const char* path);
+void StopReplay(UObject* _this);
+bool IsReplaying();
+int TickRecorder(UObject* _this, float dt);
 ]]
 
 local utlib = ffi.C
@@ -116,29 +169,285 @@ end
 -- Tick handler
 --
 -- To register a function f(dt) to be called on every tick, you should call
--- `AddHook(f)`.
+-- `AddTickHook(f)`. Hooks are dispatched by the TorchPluginComponent, and can
+-- run at a lower frequency than the game loop.
 -------------------------------------------------------------------------------
 
-local TickHooks = {}
+-- hooks added before the TorchPluginComponent has bound the native
+-- hook functions, i.e. while the scripts are loading
+local PendingTickHooks = {}
+-- the native ids of the hooks of each function
+local TickHookIds = {}
 
 -- add a tick 'hook' function f called at each game loop tick
 -- tick hooks should take a single argument (dt) and return nothing.
-function uetorch.AddTickHook(f)
-   table.insert(TickHooks, f)
+-- dt is the time elapsed since the hook last ran.
+--
+-- Parameters:
+--     f: the hook function
+--     options: an optional table with
+--        ticks: run the hook every `ticks` ticks
+--        seconds: run the hook every `seconds` seconds of game time
+--           (if both are set, both periods must be elapsed; if neither is
+--           set, the hook runs on every tick)
+--        priority: hooks with a higher priority run first (Default: 0)
+--        needsCapture: the hook captures the screen or scene (Default: false),
+--           see uetorch.IsCaptureTick
+--        name: the name of the hook in the profiler (Default: its source
+--           file and line), see uetorch.GetProfilerStats
+--
+-- Example:
+--     uetorch.AddTickHook(control)                       -- every tick
+--     uetorch.AddTickHook(record, {seconds = 0.2, needsCapture = true}) -- 5 Hz
+function uetorch.AddTickHook(f, options)
+   options = options or {}
+   if not uetorch._AddTickHook then
+      table.insert(PendingTickHooks, {f, options})
+      return
+   end
+   local id = uetorch._AddTickHook(f, options.ticks or 0, options.seconds or 0,
+                                   options.priority or 0, options.needsCapture or false,
+                                   options.name)
+   TickHookIds[f] = TickHookIds[f] or {}
+   table.insert(TickHookIds[f], id)
+end
+
+-- Called by the TorchPluginComponent once the native hook functions are bound
+function uetorch._FlushPendingTickHooks()
+   local pending = PendingTickHooks
+   PendingTickHooks = {}
+   for _, hook in ipairs(pending) do
+      uetorch.AddTickHook(hook[1], hook[2])
+   end
 end
 
 -- remove the function f from the set of tick hooks
 function uetorch.RemoveTickHook(f)
-   for i = #TickHooks, 1, -1 do
-      if TickHooks[i] == f then
-         table.remove(TickHooks, i)
+   for i = #PendingTickHooks, 1, -1 do
+      if PendingTickHooks[i][1] == f then
+         table.remove(PendingTickHooks, i)
       end
    end
+   for _, id in ipairs(TickHookIds[f] or {}) do
+      uetorch._RemoveTickHook(id)
+   end
+   TickHookIds[f] = nil
 end
 
 -- remove all tick hooks
 function uetorch.ClearTickHooks()
-   TickHooks = {}
+   PendingTickHooks = {}
+   TickHookIds = {}
+   if uetorch._ClearTickHooks then
+      uetorch._ClearTickHooks()
+   end
+end
+
+-- uetorch.IsCaptureTick() is bound by the TorchPluginComponent, and returns
+-- true while a hook added with needsCapture = true is running.
+
+-------------------------------------------------------------------------------
+-- Lua memory and garbage collection
+--
+-- The TorchPluginComponent serves small Lua allocations from pooled arenas,
+-- and can run the garbage collector only after the tick hooks, within a time
+-- budget, so that collections don't land in the middle of a capture.
+-------------------------------------------------------------------------------
+
+-- uetorch.SetGCBudget(ms, stepKB) is bound by the TorchPluginComponent.
+-- It stops the automatic garbage collector and runs incremental steps of
+-- stepKB (Default: 0, the smallest step) after each tick, for at most ms
+-- milliseconds. A full cycle is forced if the heap grows past 4 times its
+-- size after the last cycle. ms <= 0 restores the automatic collector.
+--
+-- Example:
+--     uetorch.SetGCBudget(1)  -- 1 ms of GC per tick
+
+-- uetorch.GetMemoryStats() is bound by the TorchPluginComponent, and
+-- returns a table with
+--    heapKB: the size of the Lua heap
+--    arenaKB: the memory reserved by the pooled arenas
+--    allocations, allocatedKB: the number and size of the allocations so far
+--    allocRateKBps: the allocation rate over the last tick, in KB per second
+--    gcSeconds: the time spent in the GC steps after the last tick
+--    gcTotalSeconds, gcCycles: the total GC step time and completed cycles
+--    gcBudgetMs: the current GC budget (0 if the GC is automatic)
+
+-------------------------------------------------------------------------------
+-- Profiler
+--
+-- The TorchPluginComponent times its Tick, each tick hook, the Lua GC steps
+-- and each capture function (including InitCapture and the rendering command
+-- flushes), and counts the rays traced and bytes written by the captures.
+-- The same timers and counters are shown in the engine by `stat UETorch`.
+-------------------------------------------------------------------------------
+
+-- uetorch.EnableProfiler(enabled) is bound by the TorchPluginComponent, and
+-- turns the profiler on (Default) or off. It is off at startup.
+
+-- uetorch.ResetProfiler() is bound by the TorchPluginComponent, and clears
+-- the profiler stats.
+
+-- uetorch.GetProfilerStats() is bound by the TorchPluginComponent, and
+-- returns a table with
+--    ticks: the number of ticks profiled
+--    rays, bytes: the rays traced and bytes written by the captures
+--    scopes: for each scope name (e.g. "Tick", "CaptureSegmentation", or the
+--       name of a tick hook), a table {count, total, mean, max} of timings
+--       in seconds
+
+-- uetorch.StartProfilerTrace(path, ticks) is bound by the TorchPluginComponent.
+-- It enables the profiler and streams the scopes and counters of the next
+-- `ticks` ticks (or of all ticks until uetorch.StopProfilerTrace() if ticks
+-- is 0) to path, as a Chrome trace-event JSON file (see chrome://tracing).
+-- Returns true if the file was opened.
+--
+-- Example:
+--     uetorch.StartProfilerTrace('/tmp/uetorch_trace.json', 1000)
+
+-- uetorch.StopProfilerTrace() is bound by the TorchPluginComponent, and
+-- finishes the current trace file.
+
+-------------------------------------------------------------------------------
+-- Render gate
+--
+-- Scene rendering and the viewport draw are most of the cost of a tick on
+-- headless nodes. With the render gate on, a frame is only rendered if it
+-- will be captured on the next tick: before a tick hook added with
+-- needsCapture = true runs, before the observation of uetorch.Step, or after
+-- uetorch.RequestRender. Trace-based captures (segmentation, depth, masks,
+-- optical flow, ...) and the off-screen cameras don't need a rendered frame;
+-- uetorch.Screen and uetorch.ScreenAsync do.
+-------------------------------------------------------------------------------
+
+-- uetorch.SetRenderGate(enabled) is bound by the TorchPluginComponent, and
+-- turns the render gate on (Default) or off.
+
+-- uetorch.RequestRender(frames) is bound by the TorchPluginComponent, and
+-- renders the next `frames` frames (Default: 1) even if the render gate is on.
+-- Call it on the tick before capturing the screen outside of a needsCapture
+-- hook.
+--
+-- Example:
+--     uetorch.SetRenderGate(true)
+--     uetorch.AddTickHook(record, {ticks = 10, needsCapture = true}) -- renders 1 frame in 10
+
+-------------------------------------------------------------------------------
+-- Lockstep agents
+--
+-- An agent is a function run in its own coroutine by uetorch.RunAgent.
+-- It advances the game with uetorch.Step(n), which returns after exactly n
+-- ticks with an observation, e.g. for RL training:
+--
+--     uetorch.RunAgent(function()
+--        local obs = uetorch.Step(1)
+--        for t = 1, 10000 do
+--           act(policy(obs))
+--           obs = uetorch.Step(4)
+--        end
+--     end, {dt = 1/30, observe = function() return uetorch.ScreenBytes() end})
+-------------------------------------------------------------------------------
+
+local Agent = nil
+
+-- Start an agent, at the next tick
+--
+-- Parameters:
+--     f: the agent function, which calls uetorch.Step
+--     options: an optional table with
+--        dt: run the game in lockstep with this fixed tick length (see
+--           uetorch.SetLockstep) until the agent returns
+--        observe: a function returning the observation that uetorch.Step
+--           returns (Default: none)
+--        done: a function called when the agent returns
+--        render: with the render gate on (see uetorch.SetRenderGate), render
+--           the frame before each observation (Default: true)
+function uetorch.RunAgent(f, options)
+   options = options or {}
+   if options.dt then
+      uetorch.SetLockstep(true, options.dt)
+   end
+   Agent = {
+      co = coroutine.create(f),
+      remaining = 1,
+      observe = options.observe,
+      lockstep = options.dt ~= nil,
+      done = options.done,
+      render = options.render ~= false,
+   }
+end
+
+-- Advance the game by exactly n ticks, then return control to the agent.
+-- Must be called from an agent started with uetorch.RunAgent.
+--
+-- Parameters:
+--     n: the number of ticks (Default: 1)
+--     observe: a function returning the observation for this step
+--        (Default: the `observe` option of uetorch.RunAgent)
+-- Returns:
+--     the observation, taken at the n-th tick before any tick hook runs
+function uetorch.Step(n, observe)
+   assert(Agent and coroutine.running() == Agent.co,
+          "uetorch.Step must be called from an agent started with uetorch.RunAgent")
+   Agent.remaining = math.max(n or 1, 1)
+   Agent.stepObserve = observe
+   return coroutine.yield()
+end
+
+-- Stop the current agent, if any
+function uetorch.StopAgent()
+   if Agent and Agent.lockstep then
+      uetorch.SetLockstep(false)
+   end
+   local done = Agent and Agent.done
+   Agent = nil
+   if done then
+      done()
+   end
+end
+
+-- Counts the ticks of the current step, and resumes the agent at its end
+local function tickAgent()
+   Agent.remaining = Agent.remaining - 1
+   if Agent.remaining > 0 then
+      return
+   end
+   local observe = Agent.stepObserve or Agent.observe
+   Agent.stepObserve = nil
+   local ok, err = coroutine.resume(Agent.co, observe and observe())
+   if not ok then
+      print("ERROR: agent failed: " .. tostring(err))
+   end
+   if not ok or coroutine.status(Agent.co) == 'dead' then
+      uetorch.StopAgent()
+   end
+end
+
+-- Counts the ticks of the current step, and renders the frame that the
+-- observation of the next tick captures
+local function stepAgent()
+   tickAgent()
+   if Agent and Agent.remaining == 1 and Agent.render and uetorch.RequestRender then
+      uetorch.RequestRender(1)
+   end
+end
+
+local Replay = nil
+
+-- Advances the recording or the replay (see uetorch.StartRecording), and
+-- calls the `done` callback of a replay that just ended
+local function tickRecorder(dt)
+   if utlib.TickRecorder(this, dt) >= 0 or not Replay then
+      return
+   end
+   local done, quit = Replay.done, Replay.quit
+   Replay = nil
+   if done then
+      done()
+   end
+   if quit then
+      uetorch.ExecuteConsoleCommand('quit')
+   end
 end
 
 -- top-level tick handler
@@ -146,14 +455,16 @@ end
 -- A TorchPluginComponent calls the Tick function at every tick of the Unreal
 -- game engine loop. dt is the delta time for this tick.
 --
--- This top level handler mostly delegates to tick hooks registered with AddHook().
--- It also manages the REPL and keyboard input.
+-- This top level handler manages the REPL and keyboard input. It returns the
+-- delta time to pass to the tick hooks registered with AddTickHook(), which the
+-- TorchPluginComponent calls right after it.
 --
 -- IMPORTANT:
 -- This function should only be called from TorchPluginComponent::Tick()
 --
 
 function Tick(dt)
+   tickRecorder(dt)
    uetorch._UntapKeys()
    if CountTicks then dt = 1 end
    if TimeRemaining then
@@ -164,10 +475,11 @@ function Tick(dt)
          start_repl()
       end
    end
-
-   for ii, hook in ipairs(TickHooks) do
-      hook(dt)
+   if Agent then
+      stepAgent()
    end
+
+   return dt
 end
 
 -- Set minimum and maximum delta time for each game engine loop 'tick'.
@@ -187,6 +499,19 @@ function uetorch.SetFPS(fps)
   return utlib.SetTickDeltaBounds(this, 1/fps, 1/fps)
 end
 
+-- Run the game in lockstep: each tick advances the game by exactly dt seconds,
+-- and ticks run back to back as fast as the CPU allows, with no frame rate
+-- cap, smoothing or vsync. SetLockstep(false) restores the previous settings.
+--
+-- Parameters:
+--     enabled: true to enable lockstep
+--     dt: the game time per tick, in seconds (Default: 1/30)
+-- Returns:
+--     true if successful
+function uetorch.SetLockstep(enabled, dt)
+   return utlib.SetLockstep(this, enabled, dt or 1/30)
+end
+
 
 -------------------------------------------------------------------------------
 -- Keyboard input
@@ -198,63 +523,738 @@ end
 local IE_PRESSED = 0
 local IE_RELEASED = 1
 
--- press and hold the key with this name
-function uetorch.PressKey(key)
-   utlib.PressKey(this, key, 0, IE_PRESSED)
-end
+-- press and hold the key with this name
+function uetorch.PressKey(key)
+   utlib.PressKey(this, key, 0, IE_PRESSED)
+end
+
+-- release the key with this name
+function uetorch.ReleaseKey(key)
+   utlib.PressKey(this, key, 0, IE_RELEASED)
+end
+
+local _tapped = {}
+function uetorch._UntapKeys()
+   for i,v in ipairs(_tapped) do
+      uetorch.ReleaseKey(v)
+   end
+   _tapped = {}
+end
+
+-- press the key with this name, and release it on the next tick
+function uetorch.TapKey(k)
+   uetorch.PressKey(k)
+   table.insert(_tapped, k)
+end
+
+-------------------------------------------------------------------------------
+--
+-- Torch wrappers for data capture functions.
+-- screenshot, segmentation, optical flow, etc.
+--
+-------------------------------------------------------------------------------
+
+-- Get an FFI pointer to an Unreal Actor object by name.
+-- Needed as input to the segmentation/masks functions.
+-- Actors of the current world are looked up in an index that is built once
+-- per level; other actors fall back to a search by full name. If several
+-- simulation environments have an actor of this name, the actor of the
+-- persistent level is returned if any, and otherwise any one of them.
+--
+-- Parameters:
+--     name: The 'ID name' of the object
+-- Returns:
+--     An FFI pointer to the Actor object,
+--     or nil if no actor with this name exists.
+function uetorch.GetActor(name)
+   local actor = utlib.GetActorByName(this, name)
+   if tonumber(ffi.cast('intptr_t', actor)) ~= 0 then
+      return actor
+   end
+   local level = UE.GetFullName(UE.GetCurrentLevel(this))
+   level = string.sub(level, 7, -1) -- remove "Level"
+   actor = utlib.FindActor(level .. '.' .. name)
+   if tonumber(actor) ~= 0 then
+      return actor
+   else
+      return nil
+   end
+end
+
+-- Calls a registry query function, growing the output array if needed
+local function queryActors(query, key)
+   local maxActors = 256
+   while true do
+      local actors = ffi.new('AActor*[?]', maxActors)
+      local n = query(this, key, actors, maxActors)
+      if n < 0 then
+         return nil
+      end
+      if n <= maxActors then
+         local result = {}
+         for i = 1, n do
+            result[i] = actors[i-1]
+         end
+         return result
+      end
+      maxActors = n
+   end
+end
+
+-- Get all the actors of a class (including subclasses) in the current world.
+--
+-- Parameters:
+--     className: the name of the class, e.g. 'StaticMeshActor', or 'MyBlueprint_C'
+--                for a Blueprint class
+-- Returns:
+--     A list of FFI pointers to the actors, or nil if the class doesn't exist.
+function uetorch.GetActorsByClass(className)
+   return queryActors(utlib.GetActorsByClass, className)
+end
+
+-- Get all the actors with a tag in the current world. Tags are indexed when
+-- the world is loaded or the actor is spawned, so tags changed afterwards are
+-- not taken into account.
+--
+-- Parameters:
+--     tag: the actor tag
+-- Returns:
+--     A list of FFI pointers to the actors.
+function uetorch.GetActorsByTag(tag)
+   return queryActors(utlib.GetActorsByTag, tag)
+end
+
+-- Check that an actor pointer is still valid, i.e. that the actor wasn't destroyed.
+-- Destroyed actors are detected through weak pointers, and removed from the
+-- index lazily; the functions taking lists of actors (uetorch.GetActorsState,
+-- uetorch.CreateSnapshot, ...) skip them.
+uetorch.IsActorValid = utlib.IsActorValid
+
+local SCREENSHOT_CHW = 0
+local SCREENSHOT_HWC = 1
+
+local SCREENSHOT_FLOAT_CHW = 0
+local SCREENSHOT_BYTE_CHW = 1
+local SCREENSHOT_BYTE_HWC = 2
+
+-- Capture a screenshot of the viewport
+--
+-- Parameters:
+--     tensor: an optional FloatTensor or ByteTensor to store the output
+-- Returns:
+--     A tensor of size (3,Y,X) containing the screenshot image.
+--     FloatTensors have values in [0,1], ByteTensors in [0,255].
+function uetorch.Screen(tensor)
+   if tensor and torch.type(tensor) == 'torch.ByteTensor' then
+      return uetorch.ScreenBytes('CHW', tensor)
+   end
+
+   local size = ffi.new('IntSize[?]', 1)
+   utlib.GetViewportSize(size)
+
+   if size[0].X == 0 or size[0].Y == 0 then
+      print("ERROR: Screen not visible")
+      return nil
+   end
+
+   tensor = tensor or torch.FloatTensor()
+   assert(torch.type(tensor) == 'torch.FloatTensor')
+   tensor = tensor:resize(3, size[0].Y, size[0].X):contiguous()
+   if not utlib.CaptureScreenshot(size, tensor:data()) then
+      print("ERROR: Unable to capture screenshot")
+      return nil
+   end
+
+   return tensor
+end
+
+-- Capture a screenshot of the viewport as 8-bit RGB, without any float
+-- conversion.
+--
+-- Parameters:
+--     layout: 'CHW' for a (3,Y,X) tensor or 'HWC' for a (Y,X,3) tensor (Default: 'CHW')
+--     tensor: an optional ByteTensor to store the output
+-- Returns:
+--     A ByteTensor containing the screenshot image
+function uetorch.ScreenBytes(layout, tensor)
+   layout = layout or 'CHW'
+   assert(layout == 'CHW' or layout == 'HWC', "layout must be 'CHW' or 'HWC'")
+   local size = ffi.new('IntSize[?]', 1)
+   utlib.GetViewportSize(size)
+
+   if size[0].X == 0 or size[0].Y == 0 then
+      print("ERROR: Screen not visible")
+      return nil
+   end
+
+   tensor = tensor or torch.ByteTensor()
+   assert(torch.type(tensor) == 'torch.ByteTensor')
+   if layout == 'CHW' then
+      tensor = tensor:resize(3, size[0].Y, size[0].X):contiguous()
+   else
+      tensor = tensor:resize(size[0].Y, size[0].X, 3):contiguous()
+   end
+   local layoutId = layout == 'CHW' and SCREENSHOT_CHW or SCREENSHOT_HWC
+   if not utlib.CaptureScreenshotBytes(size, tensor:data(), layoutId) then
+      print("ERROR: Unable to capture screenshot")
+      return nil
+   end
+
+   return tensor
+end
+
+-- Capture a screenshot of the viewport, normalized per channel as
+-- (value - mean) / std, where value is in [0,1]. This is the usual input
+-- normalization for image models, done during the capture.
+--
+-- Parameters:
+--     mean: a table of 3 per-channel (RGB) means (Default: {0,0,0})
+--     std: a table of 3 per-channel (RGB) standard deviations (Default: {1,1,1})
+--     tensor: an optional FloatTensor to store the output
+-- Returns:
+--     A FloatTensor of size (3,Y,X) containing the normalized screenshot image
+function uetorch.ScreenNormalized(mean, std, tensor)
+   local size = ffi.new('IntSize[?]', 1)
+   utlib.GetViewportSize(size)
+
+   if size[0].X == 0 or size[0].Y == 0 then
+      print("ERROR: Screen not visible")
+      return nil
+   end
+
+   local meanArr = ffi.new('float[3]', mean or {0, 0, 0})
+   local stdArr = ffi.new('float[3]', std or {1, 1, 1})
+   tensor = tensor or torch.FloatTensor()
+   assert(torch.type(tensor) == 'torch.FloatTensor')
+   tensor = tensor:resize(3, size[0].Y, size[0].X):contiguous()
+   if not utlib.CaptureScreenshotNormalized(size, tensor:data(), meanArr, stdArr) then
+      print("ERROR: Unable to capture screenshot")
+      return nil
+   end
+
+   return tensor
+end
+
+-- Set the number of asynchronous screenshots that can be in flight at once
+-- (see uetorch.ScreenAsync). Pending screenshots are discarded.
+--
+-- Parameters:
+--     depth: the number of readback buffers (Default: 2)
+function uetorch.SetAsyncScreenDepth(depth)
+   utlib.SetAsyncScreenshotDepth(depth or 2)
+end
+
+-- Capture a screenshot of the viewport asynchronously.
+-- Each call starts a readback of the current frame on the render thread
+-- without waiting for it, and returns the oldest screenshot that has
+-- finished reading back, if any. With a depth of k (see
+-- uetorch.SetAsyncScreenDepth), the returned screenshot is at most k calls
+-- old; if all k buffers are still in flight, this waits for the oldest one.
+--
+-- Parameters:
+--     tensor: an optional FloatTensor or ByteTensor to store the output
+--     layout: 'CHW' or 'HWC', for ByteTensors only (Default: 'CHW')
+-- Returns:
+--     A tensor of size (3,Y,X) (or (Y,X,3)) containing the screenshot image,
+--     the engine frame number and the game time at which it was requested,
+--     or nil if no screenshot is ready yet.
+function uetorch.ScreenAsync(tensor, layout)
+   local size = ffi.new('IntSize[?]', 1)
+   utlib.GetViewportSize(size)
+
+   if size[0].X == 0 or size[0].Y == 0 then
+      print("ERROR: Screen not visible")
+      return nil
+   end
+
+   local function pop(wait)
+      local outSize = ffi.new('IntSize[?]', 1)
+      local frameNumber = ffi.new('int64_t[1]')
+      local gameTime = ffi.new('float[1]')
+      if not utlib.PeekScreenshotAsync(wait, outSize, frameNumber, gameTime) then
+         return nil
+      end
+      local format
+      if tensor and torch.type(tensor) == 'torch.ByteTensor' then
+         if layout == 'HWC' then
+            tensor = tensor:resize(outSize[0].Y, outSize[0].X, 3):contiguous()
+            format = SCREENSHOT_BYTE_HWC
+         else
+            tensor = tensor:resize(3, outSize[0].Y, outSize[0].X):contiguous()
+            format = SCREENSHOT_BYTE_CHW
+         end
+      else
+         tensor = tensor or torch.FloatTensor()
+         assert(torch.type(tensor) == 'torch.FloatTensor')
+         tensor = tensor:resize(3, outSize[0].Y, outSize[0].X):contiguous()
+         format = SCREENSHOT_FLOAT_CHW
+      end
+      if not utlib.PopScreenshotAsync(tensor:data(), format) then
+         print("ERROR: Unable to capture screenshot")
+         return nil
+      end
+      return tensor, tonumber(frameNumber[0]), gameTime[0]
+   end
+
+   if utlib.RequestScreenshotAsync(this, size) then
+      return pop(false)
+   end
+   -- all readback buffers are in flight: wait for the oldest one
+   local result, frameNumber, gameTime = pop(true)
+   if not utlib.RequestScreenshotAsync(this, size) then
+      print("ERROR: Unable to request screenshot")
+   end
+   return result, frameNumber, gameTime
+end
+
+-- Create an off-screen camera, with its own resolution and pose,
+-- independent of the game viewport.
+--
+-- Parameters:
+--     width: the width of the camera image
+--     height: the height of the camera image
+--     fov: the horizontal field of view in degrees (Default: 90)
+-- Returns:
+--     A camera id, or nil on failure
+function uetorch.CreateCamera(width, height, fov)
+   local id = utlib.CreateCaptureCamera(this, width, height, fov or 90)
+   if id < 0 then
+      print("ERROR: Unable to create camera")
+      return nil
+   end
+   return id
+end
+
+-- Destroy an off-screen camera created by uetorch.CreateCamera.
+function uetorch.DestroyCamera(id)
+   utlib.DestroyCaptureCamera(id)
+end
+
+-- Set the pose of an off-screen camera.
+--
+-- Parameters:
+--     id: the camera id
+--     location: a table {x=x, y=y, z=z}
+--     rotation: a table {pitch=pitch, yaw=yaw, roll=roll}
+--     relative: if true, the pose is relative to the player's camera,
+--               e.g. {y=-3.2} and {y=3.2} for a stereo rig (Default: false)
+-- Returns:
+--     true if successful
+function uetorch.SetCameraPose(id, location, rotation, relative)
+   location = location or {}
+   rotation = rotation or {}
+   return utlib.SetCaptureCameraPose(this, id, relative or false,
+      location.x or 0, location.y or 0, location.z or 0,
+      rotation.pitch or 0, rotation.yaw or 0, rotation.roll or 0)
+end
+
+-- Capture images from a set of off-screen cameras in a single batch.
+--
+-- Parameters:
+--     ids: a list of camera ids
+--     tensors: an optional list of FloatTensors or ByteTensors to store the outputs
+--     layout: 'CHW' or 'HWC', for ByteTensors only (Default: 'CHW')
+-- Returns:
+--     A list of tensors of size (3,Y,X) (or (Y,X,3)), one per camera.
+--     FloatTensors have values in [0,1], ByteTensors in [0,255].
+function uetorch.ScreenCameras(ids, tensors, layout)
+   tensors = tensors or {}
+   local n = #ids
+   local idArr = ffi.new('int[?]', n, ids)
+   local dataArr = ffi.new('void*[?]', n)
+   local size = ffi.new('IntSize[?]', 1)
+   -- all the cameras are captured in the same format, given by the first tensor
+   local tensorType = tensors[1] and torch.type(tensors[1]) or 'torch.FloatTensor'
+   local format = SCREENSHOT_FLOAT_CHW
+   if tensorType == 'torch.ByteTensor' then
+      format = layout == 'HWC' and SCREENSHOT_BYTE_HWC or SCREENSHOT_BYTE_CHW
+   end
+   for i = 1, n do
+      if not utlib.GetCaptureCameraSize(ids[i], size) then
+         print("ERROR: Invalid camera " .. ids[i])
+         return nil
+      end
+      local tensor = tensors[i] or torch.Tensor():type(tensorType)
+      assert(torch.type(tensor) == tensorType, "all tensors must have the same type")
+      if format == SCREENSHOT_BYTE_HWC then
+         tensor = tensor:resize(size[0].Y, size[0].X, 3):contiguous()
+      else
+         tensor = tensor:resize(3, size[0].Y, size[0].X):contiguous()
+      end
+      tensors[i] = tensor
+      dataArr[i-1] = tensor:data()
+   end
+   if not utlib.CaptureCameras(this, idArr, n, dataArr, format) then
+      print("ERROR: Unable to capture cameras")
+      return nil
+   end
+   return tensors
+end
+
+-------------------------------------------------------------------------------
+-- Simulation environments
+--
+-- Several environments can run in one game process: each environment is a copy
+-- of a level loaded at its own origin in the current world, with its own
+-- off-screen camera. The environments share the asset cache, the tick and the
+-- render thread, so an extra environment costs the memory of its actors
+-- rather than a whole process. They also share the physics scene, the player
+-- controller and the global settings (lockstep, render gate, recording):
+-- space them far enough apart not to touch each other, and drive them
+-- through their actors (uetorch.SetActorsState, uetorch.AddForce, ...) rather
+-- than with key presses. The camera of an environment only renders the
+-- actors of its level (see uetorch.AddEnvironmentCameraActor for other
+-- actors), but lights are shared: keep the environments out of each other's
+-- light radius. A TorchPluginComponent in the level of an environment runs
+-- its own Lua context for that environment.
+--
+-- Example:
+--     local ids = uetorch.CreateEnvironments('/Game/Maps/Room', 16,
+--                                            {width = 84, height = 84})
+--     uetorch.RunAgent(function()
+--        while not uetorch.EnvironmentsLoaded(ids) do uetorch.Step(1) end
+--        local obs = uetorch.StepEnvironments(ids, 1) -- a [16,3,84,84] tensor
+--        ...
+--     end, {dt = 1/30})
+-------------------------------------------------------------------------------
+
+-- Load copies of a level in a row, along the X axis
+--
+-- Parameters:
+--     levelName: the package name of the level, e.g. '/Game/Maps/Room'
+--     count: the number of environments
+--     options: an optional table with
+--        origin: a table {x, y, z}, the origin of the first environment
+--           (Default: {x = 0, y = 0, z = 0})
+--        spacing: the distance between two origins, in cm (Default: 100000)
+--        width, height: the camera image size (Default: 84x84)
+--        fov: the horizontal field of view of the cameras (Default: 90)
+-- Returns:
+--     a list of environment ids, or nil on failure
+function uetorch.CreateEnvironments(levelName, count, options)
+   options = options or {}
+   local origin = options.origin or {x = 0, y = 0, z = 0}
+   local spacing = options.spacing or 100000
+   local ids = {}
+   for i = 1, count do
+      local id = utlib.CreateEnvironment(this, levelName, origin.x + (i - 1) * spacing,
+                                      origin.y, origin.z, options.width or 84,
+                                      options.height or 84, options.fov or 90)
+      if id < 0 then
+         print("ERROR: Unable to create environment of " .. levelName)
+         uetorch.DestroyEnvironments(ids)
+         return nil
+      end
+      ids[i] = id
+   end
+   return ids
+end
+
+-- Unload a list of environments created by uetorch.CreateEnvironments
+function uetorch.DestroyEnvironments(ids)
+   for _, id in ipairs(ids) do
+      utlib.DestroyEnvironment(id)
+   end
+end
+
+-- Returns true once all the environments are loaded (levels are streamed in
+-- over several ticks)
+function uetorch.EnvironmentsLoaded(ids)
+   for _, id in ipairs(ids) do
+      if not utlib.IsEnvironmentLoaded(id) then
+         return false
+      end
+   end
+   return true
+end
+
+-- Show an actor that is not part of the level of an environment, e.g. from
+-- uetorch.SpawnStaticMeshActor, to the camera of the environment. Returns true
+-- if successful.
+uetorch.AddEnvironmentCameraActor = utlib.AddEnvironmentCameraActor
+
+-- Returns the origin {x, y, z} and the camera id of an environment, or nil
+function uetorch.GetEnvironmentInfo(id)
+   local x = ffi.new('float[?]', 1)
+   local y = ffi.new('float[?]', 1)
+   local z = ffi.new('float[?]', 1)
+   local camera = utlib.GetEnvironmentInfo(id, x, y, z)
+   if camera < 0 then
+      return nil
+   end
+   return {x = x[0], y = y[0], z = z[0]}, camera
+end
+
+-- Returns the list of ffi Actor* pointers of a loaded environment, or nil.
+-- The actors of all the environments of a level have the same names, so
+-- uetorch.GetActor(name) can't tell them apart: look them up in this list.
+function uetorch.GetEnvironmentActors(id)
+   local n = utlib.GetEnvironmentActors(id, nil, 0)
+   if n < 0 then
+      return nil
+   end
+   local arr = ffi.new('AActor*[?]', math.max(n, 1))
+   n = math.min(utlib.GetEnvironmentActors(id, arr, n), n)
+   local actors = {}
+   for i = 1, n do
+      actors[i] = arr[i-1]
+   end
+   return actors
+end
+
+-- Set the pose of the camera of an environment, relative to its origin
+--
+-- Parameters:
+--     id: the environment id
+--     location: a table {x=x, y=y, z=z}
+--     rotation: a table {pitch=pitch, yaw=yaw, roll=roll}
+-- Returns:
+--     true if successful
+function uetorch.SetEnvironmentCameraPose(id, location, rotation)
+   location = location or {}
+   rotation = rotation or {}
+   return utlib.SetEnvironmentCameraPose(this, id,
+      location.x or 0, location.y or 0, location.z or 0,
+      rotation.pitch or 0, rotation.yaw or 0, rotation.roll or 0)
+end
+
+-- Capture the cameras of a list of environments in a single batch.
+--
+-- Parameters:
+--     ids: a list of environment ids, whose cameras have the same image size
+--     tensor: an optional FloatTensor or ByteTensor to store the output
+--     layout: 'CHW' or 'HWC', for ByteTensors only (Default: 'CHW')
+-- Returns:
+--     A tensor of size (#ids,3,Y,X) (or (#ids,Y,X,3)), or nil on failure
+function uetorch.ScreenEnvironments(ids, tensor, layout)
+   tensor = tensor or torch.FloatTensor()
+   local n = #ids
+   local cameras = {}
+   local size = ffi.new('IntSize[?]', 1)
+   local width, height
+   for i = 1, n do
+      local _, camera = uetorch.GetEnvironmentInfo(ids[i])
+      if not camera or not utlib.GetCaptureCameraSize(camera, size) then
+         print("ERROR: Invalid environment " .. ids[i])
+         return nil
+      end
+      width, height = width or size[0].X, height or size[0].Y
+      assert(size[0].X == width and size[0].Y == height,
+             "all the environment cameras must have the same size")
+      cameras[i] = camera
+   end
+   if torch.type(tensor) == 'torch.ByteTensor' and layout == 'HWC' then
+      tensor:resize(n, size[0].Y, size[0].X, 3)
+   else
+      tensor:resize(n, 3, size[0].Y, size[0].X)
+   end
+   -- each camera writes its slice of the stacked tensor in place
+   local slices = {}
+   for i = 1, n do
+      slices[i] = tensor[i]
+   end
+   if not uetorch.ScreenCameras(cameras, slices, layout) then
+      return nil
+   end
+   return tensor
+end
+
+-- Advance all the environments by exactly n ticks from an agent started with
+-- uetorch.RunAgent, and return their stacked camera images.
+--
+-- Parameters:
+--     ids: a list of environment ids
+--     n: the number of ticks (Default: 1)
+--     tensor, layout: see uetorch.ScreenEnvironments
+-- Returns:
+--     the tensor returned by uetorch.ScreenEnvironments at the n-th tick
+function uetorch.StepEnvironments(ids, n, tensor, layout)
+   return uetorch.Step(n, function()
+      return uetorch.ScreenEnvironments(ids, tensor, layout)
+   end)
+end
+
+-- Capture segmentation masks for a set of objects in the viewport image.
+--
+-- Parameters:
+--     objects: a list of ffi Actor* pointers, for which segmentation masks should
+--              be recorded.
+--     stride: stride in pixels at which to compute the masks. (Default: 1)
+--     verbose: verbose output (Default: false)
+--
+-- Returns:
+--     an IntTensor of size [Y/stride,X/stride].
+--     Each value corresponds to the index in the `objects` list of the foreground
+--     object at this viewport pixel, or 0 if there is no object from the list at
+--     that location in the viewport.
+--
+function uetorch.ObjectSegmentation(objects, stride, verbose)
+   assert(objects, "must specify objects for segmentation")
+   stride = stride or 1
+   verbose = verbose or false
+   local size = ffi.new('IntSize[?]', 1)
+   utlib.GetViewportSize(size)
+
+   if size[0].X == 0 or size[0].Y == 0 then
+      print("ERROR: Screen not visible")
+      return nil
+   end
+
+   local seg = torch.IntTensor(math.ceil(size[0].Y/stride),
+                               math.ceil(size[0].X/stride))
+
+   local objectArr = ffi.new(string.format("AActor*[%d]",#objects), objects)
+
+   if not utlib.CaptureSegmentation(this, size, seg:data(), stride, objectArr, #objects, verbose) then
+      print("ERROR: Unable to capture segmentation")
+      return nil
+   end
+
+   return seg
+end
+
+-- Like uetorch.ObjectMasks, but with the masks packed as bits, 64 objects
+-- per 64-bit word, which is 8x smaller than a ByteTensor per object.
+-- Use uetorch.UnpackMasks to decode them.
+--
+-- Parameters:
+--     objects: a list of ffi Actor* pointers, for which masks should be recorded.
+--     stride: stride in pixels at which to compute the masks. (Default: 1)
+--     verbose: verbose output (Default: false)
+--
+-- Returns:
+--     a LongTensor of size [Y/stride,X/stride,ceil(#objects/64)].
+--     Bit (i-1) % 64 of word (i-1) / 64 is set if objects[i] is at this pixel,
+--     even if occluded.
+--
+function uetorch.ObjectMasksPacked(objects, stride, verbose)
+   assert(objects, "must specify objects for segmentation")
+   stride  = stride or 1
+   verbose = verbose or false
+   local size = ffi.new('IntSize[?]', 1)
+   utlib.GetViewportSize(size)
+
+   if size[0].X == 0 or size[0].Y == 0 then
+      print("ERROR: Screen not visible")
+      return nil
+   end
+
+   local masks = torch.LongTensor(math.ceil(size[0].Y/stride),
+                                  math.ceil(size[0].X/stride),
+                                  math.ceil(#objects/64))
 
--- release the key with this name
-function uetorch.ReleaseKey(key)
-   utlib.PressKey(this, key, 0, IE_RELEASED)
-end
+   local objectArr = ffi.new(string.format("AActor*[%d]",#objects), objects)
 
-local _tapped = {}
-function uetorch._UntapKeys()
-   for i,v in ipairs(_tapped) do
-      uetorch.ReleaseKey(v)
+   if not utlib.CaptureMasksPacked(this, size, masks:data(), stride, objectArr, #objects, verbose) then
+      print("ERROR: Unable to capture segmentation")
+      return nil
    end
-   _tapped = {}
+
+   return masks
 end
 
--- press the key with this name, and release it on the next tick
-function uetorch.TapKey(k)
-   uetorch.PressKey(k)
-   table.insert(_tapped, k)
+-- Decode masks returned by uetorch.ObjectMasksPacked.
+--
+-- Parameters:
+--     packed: the LongTensor returned by uetorch.ObjectMasksPacked
+--     nObjects: the number of objects
+--     masks: an optional ByteTensor to store the output
+--
+-- Returns:
+--     a contiguous ByteTensor of size [#objects,Y/stride,X/stride], the same
+--     masks as uetorch.ObjectMasks
+--
+function uetorch.UnpackMasks(packed, nObjects, masks)
+   assert(packed:isContiguous())
+   masks = masks or torch.ByteTensor()
+   masks:resize(nObjects, packed:size(1), packed:size(2))
+   utlib.UnpackMasks(packed:data(), packed:size(1) * packed:size(2), nObjects, masks:data())
+   return masks
 end
 
--------------------------------------------------------------------------------
+-- Like uetorch.ObjectMasks, but with the mask of each object run-length
+-- encoded, which is compact when objects cover a small part of the image.
+-- Use uetorch.DecodeMaskRuns to decode them.
 --
--- Torch wrappers for data capture functions.
--- screenshot, segmentation, optical flow, etc.
+-- Parameters:
+--     objects: a list of ffi Actor* pointers, for which masks should be recorded.
+--     stride: stride in pixels at which to compute the masks. (Default: 1)
+--     verbose: verbose output (Default: false)
 --
--------------------------------------------------------------------------------
+-- Returns:
+--     an IntTensor with, for each object in order, the number of runs n,
+--     followed by n pairs (first pixel, run length). Pixels are 0-based
+--     indices in [Y/stride,X/stride] order.
+--     The size {Y/stride, X/stride} of the masks.
+--
+function uetorch.ObjectMasksRLE(objects, stride, verbose)
+   assert(objects, "must specify objects for segmentation")
+   stride  = stride or 1
+   verbose = verbose or false
+   local size = ffi.new('IntSize[?]', 1)
+   utlib.GetViewportSize(size)
 
--- Get an FFI pointer to an Unreal Actor object by name.
--- Needed as input to the segmentation/masks functions.
+   if size[0].X == 0 or size[0].Y == 0 then
+      print("ERROR: Screen not visible")
+      return nil
+   end
+
+   local objectArr = ffi.new(string.format("AActor*[%d]",#objects), objects)
+
+   local n = utlib.CaptureMasksRLE(this, size, stride, objectArr, #objects, verbose)
+   if n < 0 then
+      print("ERROR: Unable to capture segmentation")
+      return nil
+   end
+
+   local runs = torch.IntTensor(n)
+   if n > 0 then
+      utlib.GetMaskRuns(runs:data(), n)
+   end
+   return runs, {math.ceil(size[0].Y/stride), math.ceil(size[0].X/stride)}
+end
+
+-- Decode masks returned by uetorch.ObjectMasksRLE.
 --
 -- Parameters:
---     name: The 'ID name' of the object
+--     runs: the IntTensor returned by uetorch.ObjectMasksRLE
+--     maskSize: the size {Y, X} returned by uetorch.ObjectMasksRLE
+--     nObjects: the number of objects
+--     masks: an optional ByteTensor to store the output
+--
 -- Returns:
---     An FFI pointer to the Actor object,
---     or nil if no actor with this name exists.
-function uetorch.GetActor(name)
-   local level = UE.GetFullName(UE.GetCurrentLevel(this))
-   level = string.sub(level, 7, -1) -- remove "Level"
-   local actor = utlib.FindActor(level .. '.' .. name)
-   if tonumber(actor) ~= 0 then
-      return actor
-   else
+--     a contiguous ByteTensor of size [#objects,Y/stride,X/stride], the same
+--     masks as uetorch.ObjectMasks
+--
+function uetorch.DecodeMaskRuns(runs, maskSize, nObjects, masks)
+   assert(runs:isContiguous())
+   masks = masks or torch.ByteTensor()
+   masks:resize(nObjects, maskSize[1], maskSize[2])
+   if not utlib.DecodeMaskRuns(runs:data(), runs:nElement(), maskSize[1] * maskSize[2],
+                               nObjects, masks:data()) then
       return nil
    end
+   return masks
 end
 
--- Capture a screenshot of the viewport
+-- Compute the 2D bounding boxes and visible fraction of a set of objects,
+-- without tracing the whole viewport. Each box encloses the projection of the
+-- object's bounds; the visible fraction is estimated from samples x samples
+-- rays inside the box.
 --
 -- Parameters:
---     tensor: an optional FloatTensor to store the output
+--     objects: a list of ffi Actor* pointers
+--     samples: the number of rays per box is samples * samples (Default: 4)
+--     verbose: verbose output (Default: false)
+--
 -- Returns:
---     A FloatTensor of size (3,Y,X) containing the screenshot image
-function uetorch.Screen(tensor)
+--     a FloatTensor of size [#objects,4] with the (xmin, ymin, xmax, ymax)
+--     box of each object in viewport pixels, and a FloatTensor of size
+--     [#objects] with the visible fraction of each object in [0,1].
+--     Objects that are not on screen have a box and visibility of -1.
+--
+function uetorch.ObjectBoundingBoxes(objects, samples, verbose)
+   assert(objects, "must specify objects")
    local size = ffi.new('IntSize[?]', 1)
    utlib.GetViewportSize(size)
 
@@ -263,32 +1263,37 @@ function uetorch.Screen(tensor)
       return nil
    end
 
-   tensor = tensor or torch.FloatTensor()
-   assert(torch.type(tensor) == 'torch.FloatTensor')
-   tensor = tensor:resize(3, size[0].Y, size[0].X):contiguous()
-   if not utlib.CaptureScreenshot(size, tensor:data()) then
-      print("ERROR: Unable to capture screenshot")
+   local boxes = torch.FloatTensor(#objects, 4)
+   local visibility = torch.FloatTensor(#objects)
+   local objectArr = ffi.new(string.format("AActor*[%d]",#objects), objects)
+
+   if not utlib.CaptureBoundingBoxes(this, size, objectArr, #objects, samples or 4,
+                                     boxes:data(), visibility:data(), verbose or false) then
+      print("ERROR: Unable to capture bounding boxes")
       return nil
    end
 
-   return tensor
+   return boxes, visibility
 end
 
--- Capture segmentation masks for a set of objects in the viewport image.
+-- Like uetorch.ObjectSegmentation, but only re-traces the parts of the viewport
+-- covered by the old and new bounds of the actors that moved since the last
+-- call. The whole viewport is re-traced when the camera moves, or when the
+-- objects, stride or viewport size change.
 --
 -- Parameters:
 --     objects: a list of ffi Actor* pointers, for which segmentation masks should
 --              be recorded.
 --     stride: stride in pixels at which to compute the masks. (Default: 1)
+--     withDepth: also return the depth field (Default: false)
 --     verbose: verbose output (Default: false)
 --
 -- Returns:
---     an IntTensor of size [Y/stride,X/stride].
---     Each value corresponds to the index in the `objects` list of the foreground
---     object at this viewport pixel, or 0 if there is no object from the list at
---     that location in the viewport.
+--     an IntTensor of size [Y/stride,X/stride], like uetorch.ObjectSegmentation,
+--     a FloatTensor of size [Y/stride,X/stride] with the depth field if withDepth is set,
+--     and the number of rays that were traced.
 --
-function uetorch.ObjectSegmentation(objects, stride, verbose)
+function uetorch.ObjectSegmentationIncremental(objects, stride, withDepth, verbose)
    assert(objects, "must specify objects for segmentation")
    stride = stride or 1
    verbose = verbose or false
@@ -300,17 +1305,78 @@ function uetorch.ObjectSegmentation(objects, stride, verbose)
       return nil
    end
 
-   local seg = torch.IntTensor(math.ceil(size[0].Y/stride),
-                               math.ceil(size[0].X/stride))
-
+   local Y = math.ceil(size[0].Y/stride)
+   local X = math.ceil(size[0].X/stride)
+   local seg = torch.IntTensor(Y, X)
+   local depth = withDepth and torch.FloatTensor(Y, X) or nil
    local objectArr = ffi.new(string.format("AActor*[%d]",#objects), objects)
+   local nRays = ffi.new('int[1]')
 
-   if not utlib.CaptureSegmentation(this, size, seg:data(), stride, objectArr, #objects, verbose) then
+   if not utlib.CaptureSegmentationIncremental(this, size, seg:data(), depth and depth:data() or nil,
+                                               stride, objectArr, #objects, nRays, verbose) then
       print("ERROR: Unable to capture segmentation")
       return nil
    end
 
-   return seg
+   return seg, depth, nRays[0]
+end
+
+-- Forget the state of uetorch.ObjectSegmentationIncremental, so that the next
+-- call re-traces the whole viewport.
+function uetorch.ResetIncrementalSegmentation()
+   utlib.ResetIncrementalCapture()
+end
+
+local instanceNames = {}
+
+-- Capture the instance segmentation of the viewport image, labeling every actor
+-- in the scene. Each actor gets a stable instance ID the first time it is seen,
+-- so there is no need to build a list of objects.
+--
+-- Parameters:
+--     stride: stride in pixels at which to compute the segmentation. (Default: 1)
+--     verbose: verbose output (Default: false)
+--
+-- Returns:
+--     seg: an IntTensor of size [Y/stride,X/stride] containing the instance ID
+--          of the foreground actor at each pixel, or 0 if nothing was hit.
+--     names: a table mapping each instance ID to the ID name of its actor,
+--            which can be passed to uetorch.GetActor().
+--
+function uetorch.InstanceSegmentation(stride, verbose)
+   stride = stride or 1
+   verbose = verbose or false
+   local size = ffi.new('IntSize[?]', 1)
+   utlib.GetViewportSize(size)
+
+   if size[0].X == 0 or size[0].Y == 0 then
+      print("ERROR: Screen not visible")
+      return nil
+   end
+
+   local seg = torch.IntTensor(math.ceil(size[0].Y/stride),
+                               math.ceil(size[0].X/stride))
+
+   local nInstances = utlib.CaptureInstanceSegmentation(this, size, seg:data(), stride, verbose)
+   if nInstances < 0 then
+      print("ERROR: Unable to capture instance segmentation")
+      return nil
+   end
+
+   -- only look up the names of new instances
+   local name = ffi.new('char[?]', 1024)
+   for id = #instanceNames + 1, nInstances do
+      utlib.GetInstanceName(id, name, 1024)
+      instanceNames[id] = ffi.string(name)
+   end
+
+   return seg, instanceNames
+end
+
+-- Forget all instance IDs, e.g. after loading a new level.
+function uetorch.ResetInstanceIds()
+   utlib.ResetInstanceIds()
+   instanceNames = {}
 end
 
 -- Capture segmentation masks for a set of objects in the viewport image, including
@@ -354,7 +1420,15 @@ function uetorch.ObjectMasks(objects, stride, verbose)
    return masks
 end
 
--- Capture the optical flow at each pixel in the viewport.
+-- Capture the optical flow at each pixel in the viewport, in pixels per second.
+-- The flow accounts for the motion of the objects and of the camera: the
+-- camera moves with the velocity of the player character (its movement
+-- component), and turns as the view rotation, which is sampled at every tick.
+--
+-- Note: the flow used to be measured in pixels per second divided by the near
+-- clip plane distance (10 by default), and the camera velocity was the
+-- velocity of the player's physics body. Flows are now about 10 times larger,
+-- so scale the maxFlow values of older scripts accordingly.
 --
 -- Parameters:
 --     maxFlow: the scale for computing the RGB flow. A flow of
@@ -429,6 +1503,152 @@ function uetorch.DepthField(stride, verbose)
    return depth
 end
 
+local CAPTURE_SEGMENTATION = 1
+local CAPTURE_MASKS        = 2
+local CAPTURE_DEPTH        = 4
+local CAPTURE_FLOW         = 8
+
+-- Capture the segmentation and/or depth field at full resolution with
+-- adaptive sampling: the viewport is traced on a coarse grid, and only the
+-- cells whose corner labels or depths disagree are refined, down to single
+-- pixels. Uniform cells are filled without tracing, so this is much cheaper
+-- than a stride of 1 on scenes with large uniform regions. Objects smaller
+-- than baseStride may be missed.
+--
+-- Parameters (passed as a table):
+--     segmentation: capture the segmentation (Default: false)
+--     depth: capture the depth field (Default: false)
+--     objects: a list of ffi Actor* pointers, required for segmentation
+--     baseStride: the spacing of the coarse grid in pixels (Default: 16)
+--     tolerance: the maximum relative depth difference across a cell that is
+--                filled without tracing (Default: 0.05)
+--     verbose: verbose output (Default: false)
+-- Returns:
+--     A table with `segmentation` (an IntTensor of size (Y,X)) and/or
+--     `depth` (a FloatTensor of size (Y,X)), and `rays`, the number of rays
+--     that were traced. Returns nil if the capture failed.
+function uetorch.CaptureAdaptive(args)
+   local objects = args.objects or {}
+   assert(#objects > 0 or not args.segmentation, "must specify objects for segmentation")
+   local size = ffi.new('IntSize[?]', 1)
+   utlib.GetViewportSize(size)
+
+   if size[0].X == 0 or size[0].Y == 0 then
+      print("ERROR: Screen not visible")
+      return nil
+   end
+
+   local seg = args.segmentation and torch.IntTensor(size[0].Y, size[0].X) or nil
+   local depth = args.depth and torch.FloatTensor(size[0].Y, size[0].X) or nil
+   local objectArr = ffi.new(string.format("AActor*[%d]",#objects), objects)
+   local nRays = ffi.new('int[1]')
+   local function ptr(t) return t and t:data() or nil end
+
+   if not utlib.CaptureAdaptive(this, size, args.baseStride or 16, objectArr, #objects,
+                                ptr(seg), ptr(depth), args.tolerance or 0.05, nRays,
+                                args.verbose or false) then
+      print("ERROR: Unable to capture")
+      return nil
+   end
+   return {segmentation = seg, depth = depth, rays = nRays[0]}
+end
+
+-- Capture several modalities at once, in a single sweep over the viewport.
+-- Segmentation, depth and optical flow share a single ray per pixel, so this
+-- is much cheaper than calling ObjectSegmentation, DepthField and OpticalFlow
+-- separately for the same frame.
+--
+-- Parameters (passed as a table):
+--     segmentation: capture the segmentation (Default: false)
+--     masks: capture the object masks (Default: false)
+--     depth: capture the depth field (Default: false)
+--     flow: capture the optical flow (Default: false)
+--     objects: a list of ffi Actor* pointers, required for segmentation and masks
+--     maxFlow: the scale for computing the RGB flow, in pixels/s (Default: 1;
+--              see uetorch.OpticalFlow for the change of units)
+--     stride: stride in pixels at which to compute the outputs (Default: 1)
+--     verbose: verbose output (Default: false)
+-- Returns:
+--     A table with an entry for each requested modality, with the same
+--     tensors that ObjectSegmentation, ObjectMasks, DepthField and OpticalFlow
+--     return: `segmentation`, `masks`, `depth`, `flow` and `flowRGB`.
+--     Returns nil if the capture failed.
+--
+-- Example:
+--     local out = uetorch.CaptureModalities{segmentation=true, depth=true, objects=cubes}
+--     local seg, depth = out.segmentation, out.depth
+function uetorch.CaptureModalities(args)
+   local stride = args.stride or 1
+   local verbose = args.verbose or false
+   local objects = args.objects or {}
+   assert(#objects > 0 or not (args.segmentation or args.masks),
+          "must specify objects for segmentation")
+   local size = ffi.new('IntSize[?]', 1)
+   utlib.GetViewportSize(size)
+
+   if size[0].X == 0 or size[0].Y == 0 then
+      print("ERROR: Screen not visible")
+      return nil
+   end
+
+   local Y = math.ceil(size[0].Y/stride)
+   local X = math.ceil(size[0].X/stride)
+   local modalities = 0
+   local seg, masks, depth, flow, rgb
+   if args.segmentation then
+      modalities = modalities + CAPTURE_SEGMENTATION
+      seg = torch.IntTensor(Y, X)
+   end
+   if args.masks then
+      modalities = modalities + CAPTURE_MASKS
+      masks = torch.ByteTensor(Y, X, #objects)
+   end
+   if args.depth then
+      modalities = modalities + CAPTURE_DEPTH
+      depth = torch.FloatTensor(Y, X)
+   end
+   if args.flow then
+      modalities = modalities + CAPTURE_FLOW
+      flow = torch.FloatTensor(Y, X, 2)
+      rgb = torch.FloatTensor(Y, X, 3)
+   end
+
+   local objectArr = ffi.new(string.format("AActor*[%d]",#objects), objects)
+   local function ptr(t) return t and t:data() or nil end
+
+   if not utlib.CaptureModalities(this, size, modalities, stride, objectArr, #objects,
+                                  ptr(seg), ptr(masks), ptr(depth), ptr(flow), ptr(rgb),
+                                  args.maxFlow or 1, verbose) then
+      print("ERROR: Unable to capture modalities")
+      return nil
+   end
+
+   local out = {segmentation = seg, depth = depth}
+   if masks then
+      out.masks = masks:transpose(1,3):transpose(2,3)
+   end
+   if flow then
+      out.flow = flow:transpose(1,3):transpose(2,3)
+      out.flowRGB = rgb:transpose(1,3):transpose(2,3)
+   end
+   return out
+end
+
+-- Trace the pixels of the segmentation, masks, optical flow, depth and
+-- multi-modality captures on the engine's worker threads. The image is split
+-- into square tiles of tileSize x tileSize (strided) pixels, which are traced
+-- concurrently.
+-- The output is identical to the serial path. Captures with verbose=true
+-- always run serially.
+--
+-- Parameters:
+--     enabled: whether to trace in parallel (Default: true)
+--     tileSize: size of each tile in pixels (Default: keep the current size, initially 32)
+function uetorch.SetParallelCapture(enabled, tileSize)
+   if enabled == nil then enabled = true end
+   utlib.SetParallelCapture(enabled, tileSize or 0)
+end
+
 -------------------------------------------------------------------------------
 --
 -- Actor properties
@@ -509,6 +1729,173 @@ function uetorch.GetActorBounds(actor)
    return {x = x[0], y = y[0], z = z[0], boxX = boxX[0], boxY = boxY[0], boxZ = boxZ[0]}
 end
 
+-- Fields of uetorch.GetActorsState, in the order they are written, with their widths
+local actorStateFields = {
+   {name = 'location', flag = 1, width = 3},        -- x, y, z
+   {name = 'rotation', flag = 2, width = 3},        -- pitch, yaw, roll
+   {name = 'scale', flag = 4, width = 3},           -- x, y, z
+   {name = 'velocity', flag = 8, width = 3},        -- x, y, z
+   {name = 'angularVelocity', flag = 16, width = 3},-- x, y, z
+   {name = 'bounds', flag = 32, width = 6},         -- origin x, y, z, extent x, y, z (read only)
+   {name = 'force', flag = 64, width = 3},          -- x, y, z (write only)
+}
+
+-- Build an ffi array of actors, for the bulk actor functions.
+-- Build it once and reuse it to avoid allocations on every tick.
+--
+-- Parameters:
+--     actors: a list of ffi Actor* pointers
+-- Returns:
+--     an ffi AActor*[] array and its size
+function uetorch.ActorArray(actors)
+   return ffi.new('AActor*[?]', #actors, actors), #actors
+end
+
+-- Convert a list of actor state field names to a flag mask and a row width
+local function actorStateMask(fields, exclude)
+   local set = {}
+   for _, name in ipairs(fields) do
+      assert(name ~= exclude, "field '" .. name .. "' is not supported here")
+      set[name] = true
+   end
+   local mask, width = 0, 0
+   for _, field in ipairs(actorStateFields) do
+      if set[field.name] then
+         mask = mask + field.flag
+         width = width + field.width
+      end
+   end
+   return mask, width
+end
+
+-- Read the state of several actors in one call.
+--
+-- Parameters:
+--     actors: a list of ffi Actor* pointers, or an array from uetorch.ActorArray
+--     fields: a list of field names, among 'location', 'rotation', 'scale',
+--             'velocity', 'angularVelocity' (3 values each) and 'bounds'
+--             (origin and extent, 6 values). Values are always written in
+--             that order, whatever the order of the list.
+--     out: an optional FloatTensor to store the output; reusing it avoids
+--          allocating on every tick
+--     status: an optional ByteTensor to store the status of each actor
+--             (0: ok, 1: null actor, 2: no StaticMeshComponent for the velocities)
+--     n: the number of actors, if actors is an ffi array
+-- Returns:
+--     a FloatTensor of size [N,F] with the requested fields of each actor;
+--     fields that can't be read are NaN.
+--     the number of actors whose fields were all read
+function uetorch.GetActorsState(actors, fields, out, status, n)
+   if type(actors) == 'table' then
+      actors, n = uetorch.ActorArray(actors)
+   end
+   local mask, width = actorStateMask(fields, 'force')
+   out = out or torch.FloatTensor()
+   out:resize(n, width)
+   assert(out:isContiguous())
+   if status then
+      status:resize(n)
+   end
+   local nOk = utlib.GetActorsState(actors, n, mask, out:data(), status and status:data() or nil)
+   return out, nOk
+end
+
+-- Set the state of several actors in one call.
+--
+-- Parameters:
+--     actors: a list of ffi Actor* pointers, or an array from uetorch.ActorArray
+--     fields: a list of field names, among 'location', 'rotation', 'scale',
+--             'velocity', 'angularVelocity' and 'force' (3 values each).
+--             Values are always read in that order, whatever the order of the list.
+--             Velocities and forces require physics simulation, like
+--             uetorch.SetActorVelocity and uetorch.AddForce.
+--     data: a FloatTensor of size [N,F] with the fields of each actor
+--     status: an optional ByteTensor to store the status of each actor
+--             (0: ok, 1: null actor, 2: no StaticMeshComponent,
+--             3: no BodyInstance, 4: physics simulation not enabled)
+--     n: the number of actors, if actors is an ffi array
+-- Returns:
+--     the number of actors whose fields were all set, and the status tensor
+function uetorch.SetActorsState(actors, fields, data, status, n)
+   if type(actors) == 'table' then
+      actors, n = uetorch.ActorArray(actors)
+   end
+   local mask, width = actorStateMask(fields, 'bounds')
+   assert(data:isContiguous() and data:nElement() == n * width,
+          string.format("data must be a contiguous [%d,%d] FloatTensor", n, width))
+   status = status or torch.ByteTensor()
+   status:resize(n)
+   local nOk = utlib.SetActorsState(actors, n, mask, data:data(), status:data())
+   return nOk, status
+end
+
+-------------------------------------------------------------------------------
+-- World snapshots
+--
+-- A snapshot records the transforms, visibility, materials, movement
+-- component velocities (e.g. of characters), and physics velocities and
+-- sleep state of a set of actors, and restores them in one
+-- call, which is much faster than uetorch.ExecuteConsoleCommand('RestartLevel').
+-- Keep several snapshots to branch rollouts from shared states.
+-------------------------------------------------------------------------------
+
+-- The live snapshot handles, so that a freed handle is never used again
+local snapshots = setmetatable({}, {__mode = 'k'})
+
+-- Record a snapshot of a set of actors
+--
+-- Parameters:
+--     actors: a list of ffi Actor* pointers, or an array from uetorch.ActorArray
+--             (Default: all the actors of the world)
+--     n: the size of the array, if actors is an ffi array
+-- Returns:
+--     a snapshot handle, freed when it is garbage collected (or with
+--     uetorch.FreeSnapshot), or nil on failure
+function uetorch.CreateSnapshot(actors, n)
+   if type(actors) == 'table' then
+      actors, n = uetorch.ActorArray(actors)
+   end
+   local snapshot = utlib.CreateSnapshot(this, actors, actors and n or 0)
+   if tonumber(ffi.cast('intptr_t', snapshot)) == 0 then
+      return nil
+   end
+   snapshot = ffi.gc(snapshot, utlib.FreeSnapshot)
+   snapshots[snapshot] = true
+   return snapshot
+end
+
+-- Restore a snapshot. Actors destroyed since the snapshot are skipped, and
+-- actors spawned since are left as they are.
+--
+-- Parameters:
+--     snapshot: a handle from uetorch.CreateSnapshot
+-- Returns:
+--     the number of actors restored, or -1 if the snapshot is from another
+--     world or was freed
+function uetorch.RestoreSnapshot(snapshot)
+   if not snapshots[snapshot] then
+      print("ERROR: Invalid snapshot")
+      return -1
+   end
+   return utlib.RestoreSnapshot(this, snapshot)
+end
+
+-- Returns the number of actors in a snapshot
+function uetorch.GetSnapshotNumActors(snapshot)
+   return snapshots[snapshot] and utlib.GetSnapshotNumActors(snapshot) or 0
+end
+
+-- Free a snapshot now rather than when it is garbage collected. Freeing it
+-- again does nothing.
+function uetorch.FreeSnapshot(snapshot)
+   if not snapshots[snapshot] then
+      return
+   end
+   snapshots[snapshot] = nil
+   ffi.gc(snapshot, nil)
+   utlib.FreeSnapshot(snapshot)
+end
+
 uetorch.SetActorLocation = utlib.SetActorLocation
 uetorch.SetActorRotation = utlib.SetActorRotation
 uetorch.SetActorLocationAndRotation = utlib.SetActorLocationAndRotation
@@ -519,8 +1906,104 @@ uetorch.SetActorScale3D = utlib.SetActorScale3D
 uetorch.SetMaterial = utlib.SetMaterial
 uetorch.AddForce = utlib.AddForce
 uetorch.SetResolution = utlib.SetResolution
+
+-- Returns the width and height of the game viewport
+function uetorch.GetViewportSize()
+   local size = ffi.new('IntSize[?]', 1)
+   utlib.GetViewportSize(size)
+   return size[0].X, size[0].Y
+end
 uetorch.SetMouse = utlib.SetMouse
 
+-- Spawn a movable StaticMeshActor
+--
+-- Parameters:
+--     meshPath: the path of the static mesh, e.g. '/Engine/BasicShapes/Cube.Cube'
+--     location: a table {x, y, z} (Default: the origin)
+--     rotation: a table {pitch, yaw, roll} (Default: no rotation)
+--     options: an optional table with
+--        relative: the pose is relative to the player's camera (Default: false)
+--        scale: the uniform scale of the actor (Default: 1)
+--        physics: the actor simulates physics (Default: false)
+-- Returns:
+--     the new actor, or nil on failure
+function uetorch.SpawnStaticMeshActor(meshPath, location, rotation, options)
+   location = location or {x = 0, y = 0, z = 0}
+   rotation = rotation or {pitch = 0, yaw = 0, roll = 0}
+   options = options or {}
+   local actor = utlib.SpawnStaticMeshActor(this, meshPath, options.relative or false,
+                                            location.x, location.y, location.z,
+                                            rotation.pitch, rotation.yaw, rotation.roll,
+                                            options.scale or 1, options.physics or false)
+   if tonumber(ffi.cast('intptr_t', actor)) == 0 then
+      return nil
+   end
+   return actor
+end
+
+-- Destroy an actor. Returns true if the actor was destroyed.
+uetorch.DestroyActor = utlib.DestroyActor
+
+-------------------------------------------------------------------------------
+-- Recording and replay
+--
+-- A recording logs the key and mouse input, the console commands and the
+-- actor mutations made through uetorch (SetActor*, AddForce, SetMaterial,
+-- SetActorsState, SpawnStaticMeshActor, DestroyActor) at every tick, with
+-- the tick length. A replay applies them at the same ticks, with the game in
+-- lockstep at the recorded tick lengths, e.g. to debug an episode or to
+-- regenerate its observations with other capture settings, without rerunning
+-- the agent.
+--
+-- Actors are matched by name (qualified by their level for simulation
+-- environments), so replay from the state the recording started in (e.g.
+-- right after loading the level, with the same environments created in the
+-- same order). uetorch.RestoreSnapshot is not recorded. Agents and tick hooks
+-- still run during a replay, so they should check uetorch.IsReplaying()
+-- before acting. The replay is exact for kinematic scenes; physics
+-- simulation is not guaranteed to be deterministic across sessions.
+-------------------------------------------------------------------------------
+
+-- Start recording, until uetorch.StopRecording is called
+--
+-- Parameters:
+--     path: the log file
+-- Returns:
+--     true if successful
+function uetorch.StartRecording(path)
+   return utlib.StartRecording(path)
+end
+
+-- Stop recording, and flush the log file
+uetorch.StopRecording = utlib.StopRecording
+
+-- Replay a log written by uetorch.StartRecording, from the next tick
+--
+-- Parameters:
+--     path: the log file
+--     options: an optional table with
+--        done: a function called at the end of the replay
+--        quit: quit the game at the end of the replay (Default: false)
+-- Returns:
+--     true if successful
+function uetorch.StartReplay(path, options)
+   options = options or {}
+   if not utlib.StartReplay(this, path) then
+      return false
+   end
+   Replay = {done = options.done, quit = options.quit}
+   return true
+end
+
+-- Stop the current replay, without calling its `done` callback
+function uetorch.StopReplay()
+   Replay = nil
+   utlib.StopReplay(this)
+end
+
+-- Returns true during a replay
+uetorch.IsReplaying = utlib.IsReplaying
+
 -------------------------------------------------------------------------------
 --
 -- Execute UE commands
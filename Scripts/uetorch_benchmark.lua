@@ -0,0 +1,418 @@
+-------------------------------------------------------------------------------
+-- Copyright (c) 2015-present, Facebook, Inc.
+-- All rights reserved.
+-- This source code is licensed under the BSD-style license found in the
+-- LICENSE file in the root directory of this source tree. An additional grant
+-- of patent rights can be found in the PATENTS file in the same directory.
+-------------------------------------------------------------------------------
+
+-- UETorch capture benchmark
+--
+-- Builds a procedural test scene in front of the player's camera (a backdrop
+-- and a configurable number of cubes, laid out from a fixed seed), then
+-- sweeps modality x resolution x stride x object count, timing one capture
+-- per tick. Results are written as JSON lines, one line per configuration,
+-- with the mean, p50 and p99 time per frame, and the rays traced and bytes
+-- written per second (from the UETorch profiler).
+--
+-- The trace-based modalities run under -nullrhi; the 'screen' modality needs
+-- a renderer, and is reported with an error otherwise.
+--
+-- To run it headless, set the 'Main Module' of the TorchPlugin to
+-- 'uetorch_benchmark' and run the game with e.g.
+--     UE4Editor MyProject -game -nullrhi -ResX=640 -ResY=480
+-- Environment variables:
+--     UETORCH_BENCHMARK_OUTPUT: the output file (Default: uetorch_benchmark.jsonl)
+--     UETORCH_BENCHMARK_LABEL: a label stored in each result, e.g. a commit hash
+--     UETORCH_BENCHMARK_CONFIG: a Lua file returning a table of options for
+--        benchmark.run, overriding the defaults
+-- When run as the main module, the game quits once the benchmark is done.
+--
+-- It can also be started from any script or from the REPL:
+--     local benchmark = require 'uetorch_benchmark'
+--     benchmark.run{modalities = {'segmentation', 'depth'}, objects = {64}}
+
+local uetorch = require 'uetorch'
+require 'torch'
+
+local M = {}
+
+-- Bump when a change makes results incomparable with older ones
+M.VERSION = 2
+
+M.defaults = {
+   modalities = {'segmentation', 'masks', 'masks_packed', 'masks_rle', 'depth',
+                 'flow', 'modalities', 'adaptive', 'incremental', 'bboxes', 'screen'},
+   resolutions = {{160, 120}, {320, 240}, {640, 480}},
+   strides = {1, 4},
+   objects = {16, 128},
+   frames = 50,        -- measured frames per configuration
+   warmup = 5,         -- ticks before measuring, e.g. to apply a resolution change
+   moving = 4,         -- objects moved at every tick
+   dt = 1 / 30,        -- fixed tick length
+   seed = 1234,
+   mesh = '/Engine/BasicShapes/Cube.Cube',
+   backdrop = '/Engine/BasicShapes/Plane.Plane',
+   output = 'uetorch_benchmark.jsonl',
+   label = '',
+   quit = false,
+}
+
+-------------------------------------------------------------------------------
+-- Test scene
+-------------------------------------------------------------------------------
+
+-- Park-Miller generator, so that the scene doesn't depend on the torch version
+local function newRandom(seed)
+   local state = seed % 2147483646 + 1
+   return function(a, b)
+      state = (state * 16807) % 2147483647
+      return a + (b - a) * (state - 1) / 2147483646
+   end
+end
+
+local scene = {actors = {}, objects = {}, homes = {}}
+
+-- Destroy the actors of the test scene
+function M.ClearScene()
+   for _, actor in ipairs(scene.actors) do
+      if uetorch.IsActorValid(actor) then
+         uetorch.DestroyActor(actor)
+      end
+   end
+   scene = {actors = {}, objects = {}, homes = {}}
+end
+
+-- Build the test scene in front of the player's camera
+--
+-- Parameters:
+--     nObjects: the number of cubes
+--     options: a table with the seed, mesh and backdrop options
+-- Returns:
+--     the list of cubes, or nil on failure
+function M.BuildScene(nObjects, options)
+   M.ClearScene()
+   local random = newRandom(options.seed)
+
+   if options.backdrop then
+      local backdrop = uetorch.SpawnStaticMeshActor(options.backdrop,
+         {x = 2000, y = 0, z = 0}, {pitch = 90, yaw = 0, roll = 0},
+         {relative = true, scale = 40})
+      table.insert(scene.actors, backdrop)
+   end
+
+   for i = 1, nObjects do
+      -- inside a cone around the view direction
+      local x = random(300, 1800)
+      local location = {x = x, y = random(-0.6, 0.6) * x, z = random(-0.4, 0.4) * x}
+      local rotation = {pitch = random(0, 90), yaw = random(0, 90), roll = 0}
+      local actor = uetorch.SpawnStaticMeshActor(options.mesh, location, rotation,
+                                                 {relative = true, scale = random(0.3, 1)})
+      if not actor then
+         print("ERROR: Unable to build the benchmark scene")
+         M.ClearScene()
+         return nil
+      end
+      table.insert(scene.actors, actor)
+      table.insert(scene.objects, actor)
+      scene.homes[i] = uetorch.GetActorLocation(actor)
+   end
+   return scene.objects
+end
+
+-- Move `moving` objects back and forth, so that the incremental and optical
+-- flow modalities have work to do
+local function animateScene(frame, moving)
+   local n = #scene.objects
+   for k = 1, math.min(moving, n) do
+      local i = (frame * moving + k - 1) % n + 1
+      local home = scene.homes[i]
+      local offset = (frame % 2 == 0) and 10 or -10
+      uetorch.SetActorLocation(scene.objects[i], home.x, home.y + offset, home.z)
+   end
+end
+
+-------------------------------------------------------------------------------
+-- Modalities
+--
+-- Each modality runs a single capture and returns true if it succeeded.
+-- Modalities that don't take a stride are only run once per resolution.
+-------------------------------------------------------------------------------
+
+local modalities = {
+   segmentation = {strided = true, run = function(objects, stride)
+      return uetorch.ObjectSegmentation(objects, stride) ~= nil
+   end},
+   masks = {strided = true, run = function(objects, stride)
+      return uetorch.ObjectMasks(objects, stride) ~= nil
+   end},
+   masks_packed = {strided = true, run = function(objects, stride)
+      return uetorch.ObjectMasksPacked(objects, stride) ~= nil
+   end},
+   masks_rle = {strided = true, run = function(objects, stride)
+      return uetorch.ObjectMasksRLE(objects, stride) ~= nil
+   end},
+   depth = {strided = true, run = function(objects, stride)
+      return uetorch.DepthField(stride) ~= nil
+   end},
+   flow = {strided = true, run = function(objects, stride)
+      return uetorch.OpticalFlow(1, stride) ~= nil
+   end},
+   modalities = {strided = true, run = function(objects, stride)
+      return uetorch.CaptureModalities{objects = objects, stride = stride,
+                                       segmentation = true, depth = true, flow = true} ~= nil
+   end},
+   adaptive = {strided = false, run = function(objects)
+      return uetorch.CaptureAdaptive{objects = objects, segmentation = true, depth = true} ~= nil
+   end},
+   incremental = {strided = true, run = function(objects, stride)
+      return uetorch.ObjectSegmentationIncremental(objects, stride, true) ~= nil
+   end},
+   bboxes = {strided = false, run = function(objects)
+      return uetorch.ObjectBoundingBoxes(objects) ~= nil
+   end},
+   screen = {strided = false, run = function()
+      return uetorch.Screen() ~= nil
+   end},
+}
+
+-------------------------------------------------------------------------------
+-- Results
+-------------------------------------------------------------------------------
+
+local function percentile(sorted, p)
+   if #sorted == 0 then
+      return nil
+   end
+   return sorted[math.max(1, math.ceil(p * #sorted))]
+end
+
+-- Encodes a flat table as JSON, with sorted keys so that lines can be diffed
+local function encodeJSON(t)
+   local keys = {}
+   for k in pairs(t) do
+      table.insert(keys, k)
+   end
+   table.sort(keys)
+   local fields = {}
+   for _, k in ipairs(keys) do
+      local v = t[k]
+      if type(v) == 'string' then
+         v = string.format('%q', v):gsub('\\\n', '\\n')
+      elseif type(v) == 'number' then
+         v = (v ~= v or v == math.huge or v == -math.huge) and 'null' or string.format('%.6g', v)
+      else
+         v = tostring(v)
+      end
+      table.insert(fields, string.format('"%s":%s', k, v))
+   end
+   return '{' .. table.concat(fields, ',') .. '}'
+end
+
+local function summarize(config, times, rays, bytes, err)
+   local result = {
+      suite_version = M.VERSION,
+      label = config.label,
+      modality = config.modality,
+      -- the viewport may not have the requested size, e.g. under -nullrhi
+      width = config.viewportWidth or config.width,
+      height = config.viewportHeight or config.height,
+      requested_width = config.width,
+      requested_height = config.height,
+      stride = config.stride,
+      objects = config.objects,
+      frames = #times,
+      error = err,
+   }
+   if #times > 0 then
+      local total = 0
+      for _, t in ipairs(times) do
+         total = total + t
+      end
+      local sorted = {}
+      for i, t in ipairs(times) do
+         sorted[i] = t
+      end
+      table.sort(sorted)
+      result.ms_mean = 1000 * total / #times
+      result.ms_p50 = 1000 * percentile(sorted, 0.5)
+      result.ms_p99 = 1000 * percentile(sorted, 0.99)
+      if rays and total > 0 then
+         result.rays_per_s = rays / total
+         result.mb_per_s = bytes / total / 2^20
+      end
+   end
+   return result
+end
+
+-------------------------------------------------------------------------------
+-- Runner
+-------------------------------------------------------------------------------
+
+local function buildConfigs(options)
+   local configs = {}
+   for _, nObjects in ipairs(options.objects) do
+      for _, resolution in ipairs(options.resolutions) do
+         for _, name in ipairs(options.modalities) do
+            local modality = modalities[name]
+            assert(modality, "unknown modality " .. name)
+            local strides = modality.strided and options.strides or {1}
+            for _, stride in ipairs(strides) do
+               table.insert(configs, {
+                  label = options.label, modality = name, objects = nObjects,
+                  width = resolution[1], height = resolution[2], stride = stride,
+               })
+            end
+         end
+      end
+   end
+   return configs
+end
+
+local function profilerCounts()
+   if not uetorch.GetProfilerStats then
+      return nil, nil
+   end
+   local stats = uetorch.GetProfilerStats()
+   return stats.rays, stats.bytes
+end
+
+-- Run the benchmark, one capture per tick, from a tick hook
+--
+-- Parameters:
+--     options: a table overriding M.defaults
+--     done: an optional function called with the list of results at the end
+function M.run(options, done)
+   local opts = {}
+   for k, v in pairs(M.defaults) do
+      opts[k] = v
+   end
+   for k, v in pairs(options or {}) do
+      opts[k] = v
+   end
+
+   local configs = buildConfigs(opts)
+   local results = {}
+   local out = assert(io.open(opts.output, 'w'))
+   print(string.format("Benchmark: %d configurations, writing to %s", #configs, opts.output))
+
+   uetorch.SetFPS(1 / opts.dt)
+
+   local index = 1
+   local sceneObjects = nil
+   local wait = 0
+   local frame = 0
+   local profiling = false
+   local times, startRays, startBytes
+   local timer = torch.Timer()
+
+   local function finish()
+      out:close()
+      uetorch.RemoveTickHook(M._hook)
+      M.ClearScene()
+      print(string.format("Benchmark done: %d results in %s", #results, opts.output))
+      if done then
+         done(results)
+      end
+      if opts.quit then
+         uetorch.ExecuteConsoleCommand('quit')
+      end
+   end
+
+   local function record(config, err)
+      local rays, bytes = profilerCounts()
+      if rays then
+         rays, bytes = rays - startRays, bytes - startBytes
+      end
+      local result = summarize(config, times, rays, bytes, err)
+      table.insert(results, result)
+      out:write(encodeJSON(result), '\n')
+      out:flush()
+      print(string.format("%-12s %4dx%-4d stride %d objects %4d: %s",
+                          config.modality, config.width, config.height, config.stride,
+                          config.objects, err or string.format("%.2f ms (p99 %.2f ms)",
+                                                               result.ms_mean, result.ms_p99)))
+   end
+
+   M._hook = function(dt)
+      -- the natives are only bound once the main module is initialized, so
+      -- the profiler counting the rays and bytes is enabled from the hook
+      if not profiling and uetorch.EnableProfiler then
+         uetorch.EnableProfiler(true)
+         profiling = true
+      end
+      local config = configs[index]
+      if not config then
+         finish()
+         return
+      end
+
+      -- set up the scene and resolution of a new configuration
+      if not times then
+         if not sceneObjects or #sceneObjects ~= config.objects then
+            sceneObjects = M.BuildScene(config.objects, opts)
+            if not sceneObjects then
+               finish()
+               return
+            end
+         end
+         if not uetorch.SetResolution(config.width, config.height) then
+            times = {}
+            record(config, 'cannot set resolution')
+            times = nil
+            index = index + 1
+            return
+         end
+         uetorch.ResetIncrementalSegmentation()
+         times = {}
+         startRays, startBytes = profilerCounts()
+         wait = opts.warmup
+         return
+      end
+      if wait > 0 then
+         wait = wait - 1
+         startRays, startBytes = profilerCounts()
+         return
+      end
+      if #times == 0 then
+         -- the viewport is resized asynchronously: record the actual size
+         config.viewportWidth, config.viewportHeight = uetorch.GetViewportSize()
+      end
+
+      animateScene(frame, opts.moving)
+      frame = frame + 1
+
+      timer:reset()
+      local ok = modalities[config.modality].run(sceneObjects, config.stride)
+      local elapsed = timer:time().real
+      if not ok then
+         record(config, 'capture failed')
+      else
+         table.insert(times, elapsed)
+         if #times < opts.frames then
+            return
+         end
+         record(config)
+      end
+      times = nil
+      index = index + 1
+   end
+
+   uetorch.AddTickHook(M._hook, {name = 'benchmark'})
+end
+
+-- Called when this is the main module of the TorchPlugin
+function M.initialize()
+   local options = {quit = true}
+   local config = os.getenv('UETORCH_BENCHMARK_CONFIG')
+   if config then
+      for k, v in pairs(dofile(config)) do
+         options[k] = v
+      end
+   end
+   options.output = os.getenv('UETORCH_BENCHMARK_OUTPUT') or options.output
+   options.label = os.getenv('UETORCH_BENCHMARK_LABEL') or options.label
+   M.run(options)
+end
+
+return M
@@ -47,7 +47,7 @@ public:
 	* @param Out String output from the function
 	*/
 	UFUNCTION(BlueprintCallable, Category = "Script|Functions")
-	virtual bool CallTorchFunctionString(FString FunctionName, FString In, FString &Out);
+	virtual bool CallTorchFunctionString(const FString& FunctionName, const FString& In, FString &Out);
 
 	/**
 	* Calls a script defined function (Array<string> -> string)
@@ -56,7 +56,36 @@ public:
 	* @param Out String output from the function
 	*/
 	UFUNCTION(BlueprintCallable, Category = "Script|Functions")
-	virtual bool CallTorchFunctionArray(FString FunctionName, TArray<FString> In, FString &Out);
+	virtual bool CallTorchFunctionArray(const FString& FunctionName, const TArray<FString>& In, FString &Out);
+
+	/**
+	* Calls a script defined function (float, ... -> float, ...)
+	* The function is called with the elements of In as arguments, and
+	* all of its return values must be numbers.
+	* @param FunctionName Name of the function to call
+	* @param In Float arguments to the function
+	* @param Out Numbers returned by the function
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Script|Functions")
+	virtual bool CallTorchFunctionFloatArray(const FString& FunctionName, const TArray<float>& In, TArray<float>& Out);
+
+	/**
+	* Calls a script defined function (x, y, z -> float, ...)
+	* @param FunctionName Name of the function to call
+	* @param In Vector argument to the function, passed as 3 numbers
+	* @param Out Numbers returned by the function
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Script|Functions")
+	virtual bool CallTorchFunctionVector(const FString& FunctionName, const FVector& In, TArray<float>& Out);
+
+	/**
+	* Calls a script defined function (x, y, z, pitch, yaw, roll, scaleX, scaleY, scaleZ -> float, ...)
+	* @param FunctionName Name of the function to call
+	* @param In Transform argument to the function, passed as 9 numbers
+	* @param Out Numbers returned by the function
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Script|Functions")
+	virtual bool CallTorchFunctionTransform(const FString& FunctionName, const FTransform& In, TArray<float>& Out);
 
 
 	// Begin UActorComponent interface.
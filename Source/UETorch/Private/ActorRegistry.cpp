@@ -0,0 +1,222 @@
+/**
+ * Copyright (c) 2015-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "UETorchPrivatePCH.h"
+#include "ActorRegistry.h"
+#include "EngineUtils.h"
+
+FActorRegistry& FActorRegistry::Get()
+{
+	static FActorRegistry Registry;
+	return Registry;
+}
+
+void FActorRegistry::Reset()
+{
+	if (World.IsValid() && ActorSpawnedHandle.IsValid()) {
+		World->RemoveOnActorSpawnedHandler(ActorSpawnedHandle);
+	}
+	ActorSpawnedHandle.Reset();
+	FWorldDelegates::LevelAddedToWorld.Remove(LevelAddedHandle);
+	FWorldDelegates::LevelRemovedFromWorld.Remove(LevelRemovedHandle);
+	LevelAddedHandle.Reset();
+	LevelRemovedHandle.Reset();
+	World = NULL;
+	ByName.Reset();
+	ByClass.Reset();
+	ByTag.Reset();
+	Known.Reset();
+	NumStale = 0;
+}
+
+void FActorRegistry::Update(UWorld* InWorld)
+{
+	if (InWorld == NULL || World.Get() == InWorld) {
+		return;
+	}
+
+	Reset();
+	World = InWorld;
+	for (TActorIterator<AActor> It(InWorld); It; ++It) {
+		Add(*It);
+	}
+	ActorSpawnedHandle = InWorld->AddOnActorSpawnedHandler(
+		FOnActorSpawned::FDelegate::CreateRaw(this, &FActorRegistry::OnActorSpawned));
+	// loading a streamed level doesn't spawn its actors
+	LevelAddedHandle = FWorldDelegates::LevelAddedToWorld.AddRaw(this, &FActorRegistry::OnLevelAdded);
+	LevelRemovedHandle = FWorldDelegates::LevelRemovedFromWorld.AddRaw(this, &FActorRegistry::OnLevelRemoved);
+}
+
+void FActorRegistry::Add(AActor* Actor)
+{
+	// a new actor may reuse the address of a destroyed one: only skip actors
+	// that are already indexed. The stale entries of a destroyed actor no
+	// longer resolve, so they are skipped by the queries and pruned later.
+	const TWeakObjectPtr<AActor>* Existing = Known.Find(Actor);
+	if (Existing != NULL && Existing->Get() == Actor) {
+		return;
+	}
+	TWeakObjectPtr<AActor> Weak(Actor);
+	Known.Add(Actor, Weak);
+	ByName.Add(Actor->GetFName(), Weak);
+	for (const UClass* Class = Actor->GetClass(); Class != NULL; Class = Class->GetSuperClass()) {
+		ByClass.Add(Class, Weak);
+		if (Class == AActor::StaticClass()) {
+			break;
+		}
+	}
+	for (const FName& Tag : Actor->Tags) {
+		ByTag.Add(Tag, Weak);
+	}
+}
+
+void FActorRegistry::OnActorSpawned(AActor* Actor)
+{
+	if (Actor != NULL) {
+		Add(Actor);
+	}
+}
+
+void FActorRegistry::OnLevelAdded(ULevel* Level, UWorld* InWorld)
+{
+	if (Level == NULL || InWorld != World.Get()) {
+		return;
+	}
+	for (AActor* Actor : Level->Actors) {
+		if (Actor != NULL && !Actor->IsPendingKill()) {
+			Add(Actor);
+		}
+	}
+}
+
+void FActorRegistry::OnLevelRemoved(ULevel* Level, UWorld* InWorld)
+{
+	// a NULL level means that the whole world is torn down, which the weak
+	// pointers already handle
+	if (Level == NULL || InWorld != World.Get()) {
+		return;
+	}
+	auto IsRemoved = [Level](const TWeakObjectPtr<AActor>& Weak) {
+		const AActor* Actor = Weak.Get();
+		return Actor == NULL || Actor->GetLevel() == Level;
+	};
+	for (auto It = Known.CreateIterator(); It; ++It) {
+		if (IsRemoved(It.Value())) {
+			It.RemoveCurrent();
+		}
+	}
+	for (auto It = ByName.CreateIterator(); It; ++It) {
+		if (IsRemoved(It.Value())) {
+			It.RemoveCurrent();
+		}
+	}
+	for (auto It = ByClass.CreateIterator(); It; ++It) {
+		if (IsRemoved(It.Value())) {
+			It.RemoveCurrent();
+		}
+	}
+	for (auto It = ByTag.CreateIterator(); It; ++It) {
+		if (IsRemoved(It.Value())) {
+			It.RemoveCurrent();
+		}
+	}
+}
+
+void FActorRegistry::PruneStale()
+{
+	// only prune once enough stale entries were seen to make it worth it
+	if (++NumStale < 1024) {
+		return;
+	}
+	NumStale = 0;
+	for (auto It = Known.CreateIterator(); It; ++It) {
+		if (!It.Value().IsValid()) {
+			It.RemoveCurrent();
+		}
+	}
+	for (auto It = ByName.CreateIterator(); It; ++It) {
+		if (!It.Value().IsValid()) {
+			It.RemoveCurrent();
+		}
+	}
+	for (auto It = ByClass.CreateIterator(); It; ++It) {
+		if (!It.Value().IsValid()) {
+			It.RemoveCurrent();
+		}
+	}
+	for (auto It = ByTag.CreateIterator(); It; ++It) {
+		if (!It.Value().IsValid()) {
+			It.RemoveCurrent();
+		}
+	}
+}
+
+AActor* FActorRegistry::FindByName(FName Name, const ULevel* Level)
+{
+	const ULevel* PreferredLevel = Level;
+	if (PreferredLevel == NULL && World.IsValid()) {
+		PreferredLevel = World->PersistentLevel;
+	}
+	AActor* Result = NULL;
+	bool bHasStale = false;
+	for (auto It = ByName.CreateConstKeyIterator(Name); It; ++It) {
+		AActor* Actor = It.Value().Get();
+		if (Actor == NULL) {
+			bHasStale = true;
+		} else if (Actor->GetLevel() == PreferredLevel) {
+			Result = Actor;
+			break;
+		} else if (Result == NULL && Level == NULL) {
+			Result = Actor;
+		}
+	}
+	if (bHasStale) {
+		PruneStale();
+	}
+	return Result;
+}
+
+void FActorRegistry::FindByClass(const UClass* Class, TArray<AActor*>& OutActors)
+{
+	bool bHasStale = false;
+	for (auto It = ByClass.CreateConstKeyIterator(Class); It; ++It) {
+		if (AActor* Actor = It.Value().Get()) {
+			OutActors.Add(Actor);
+		} else {
+			bHasStale = true;
+		}
+	}
+	if (bHasStale) {
+		PruneStale();
+	}
+}
+
+void FActorRegistry::FindByTag(FName Tag, TArray<AActor*>& OutActors)
+{
+	bool bHasStale = false;
+	for (auto It = ByTag.CreateConstKeyIterator(Tag); It; ++It) {
+		if (AActor* Actor = It.Value().Get()) {
+			OutActors.Add(Actor);
+		} else {
+			bHasStale = true;
+		}
+	}
+	if (bHasStale) {
+		PruneStale();
+	}
+}
+
+bool FActorRegistry::IsValid(const AActor* Actor) const
+{
+	if (Actor == NULL) {
+		return false;
+	}
+	const TWeakObjectPtr<AActor>* Weak = Known.Find(Actor);
+	return Weak != NULL && Weak->Get() == Actor;
+}
@@ -0,0 +1,69 @@
+/**
+ * Copyright (c) 2015-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+/**
+ * An index of the actors of the current world by name, by class and by tag.
+ * The index is built once per world, when the first TorchContext of the
+ * world is created, and kept current with the world's actor spawned handler
+ * and with the levels streamed in and out (e.g. simulation environments).
+ * Destroyed actors are held as weak pointers, so they are skipped by the
+ * queries and pruned lazily. Tags are indexed when an actor is spawned: tags
+ * added or removed afterwards are not seen by FindByTag.
+ */
+class FActorRegistry
+{
+public:
+	static FActorRegistry& Get();
+
+	FActorRegistry() : NumStale(0) {}
+
+	/** Index World, unless it is already the indexed world */
+	void Update(UWorld* InWorld);
+
+	/**
+	 * Returns the actor with this object name, or NULL. Streamed levels may
+	 * hold actors with the same name (e.g. several environments of a level): if
+	 * Level is NULL, the actor of the persistent level is preferred, and
+	 * otherwise any of them is returned.
+	 */
+	AActor* FindByName(FName Name, const ULevel* Level = NULL);
+
+	/** Appends the actors of this class (or of a subclass) to OutActors */
+	void FindByClass(const UClass* Class, TArray<AActor*>& OutActors);
+
+	/** Appends the actors with this tag to OutActors */
+	void FindByTag(FName Tag, TArray<AActor*>& OutActors);
+
+	/**
+	 * Returns false if Actor is NULL, or if it is not a live actor of the indexed
+	 * world, e.g. a stale pointer to a destroyed actor, or if no world has been
+	 * indexed yet.
+	 */
+	bool IsValid(const AActor* Actor) const;
+
+private:
+	void Reset();
+	void Add(AActor* Actor);
+	void OnActorSpawned(AActor* Actor);
+	void OnLevelAdded(ULevel* Level, UWorld* InWorld);
+	void OnLevelRemoved(ULevel* Level, UWorld* InWorld);
+	void PruneStale();
+
+	TWeakObjectPtr<UWorld> World;
+	FDelegateHandle ActorSpawnedHandle;
+	FDelegateHandle LevelAddedHandle;
+	FDelegateHandle LevelRemovedHandle;
+	TMultiMap<FName, TWeakObjectPtr<AActor>> ByName;
+	TMultiMap<const UClass*, TWeakObjectPtr<AActor>> ByClass;
+	TMultiMap<FName, TWeakObjectPtr<AActor>> ByTag;
+	TMap<const AActor*, TWeakObjectPtr<AActor>> Known;
+	int32 NumStale;
+};
@@ -10,10 +10,34 @@
 #include "UETorchPrivatePCH.h"
 #include "ScriptBlueprintGeneratedClass.h"
 #include "TorchContext.h"
+#include "ActorRegistry.h"
+#include "TorchProfiler.h"
+#include "TorchRecorder.h"
+
+// defined with the capture functions in UETorch.cpp
+extern "C" UETORCH_API void SampleCameraMotion(UObject* _this);
 
 const ANSICHAR *UTPackage = "uetorch";
 
 
+FTorchContext::FTorchContext()
+	: TickRef(LUA_NOREF)
+	, NextTickHookId(1)
+	, bDispatchingTickHooks(false)
+	, bCaptureTick(false)
+	, GCBudget(0)
+	, GCStepSize(0)
+	, GCHeapAfterCycle(0)
+	, GCLastTickSeconds(0)
+	, GCTotalSeconds(0)
+	, GCCycles(0)
+	, TickAllocatedBytes(0)
+	, AllocationRate(0)
+	, bRenderGate(false)
+	, RenderRequests(0)
+{
+}
+
 FTorchContext* FTorchContext::Create(const FString& SourceCode, UObject* Owner)
 {
 	FTorchContext* NewContext = NULL;
@@ -24,7 +48,12 @@ FTorchContext* FTorchContext::Create(const FString& SourceCode, UObject* Owner)
 	{
 		if (NewContext->Initialize(SourceCode, Owner))
 		{
-			// nothing
+			NewContext->Owner = Owner;
+			NewContext->Allocator.Install(NewContext->LuaState);
+			NewContext->BindNatives();
+			// index the world now, so that the bulk actor functions can
+			// validate their actors before any query was made
+			FActorRegistry::Get().Update(Owner->GetWorld());
 		}
 		else
 		{
@@ -35,34 +64,520 @@ FTorchContext* FTorchContext::Create(const FString& SourceCode, UObject* Owner)
 	return NewContext;
 }
 
+void FTorchContext::BindNatives()
+{
+	if (bHasTick)
+	{
+		lua_getglobal(LuaState, "Tick");
+		TickRef = luaL_ref(LuaState, LUA_REGISTRYINDEX);
+	}
+
+	lua_getglobal(LuaState, "package");
+	lua_getfield(LuaState, -1, "loaded");
+	lua_getfield(LuaState, -1, UTPackage);
+	if (!lua_istable(LuaState, -1))
+	{
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Lua module %s is not loaded"), ANSI_TO_TCHAR(UTPackage));
+		lua_pop(LuaState, 3);
+		return;
+	}
+
+	const luaL_Reg Natives[] = {
+		{ "_AddTickHook", &FTorchContext::Lua_AddTickHook },
+		{ "_RemoveTickHook", &FTorchContext::Lua_RemoveTickHook },
+		{ "_ClearTickHooks", &FTorchContext::Lua_ClearTickHooks },
+		{ "IsCaptureTick", &FTorchContext::Lua_IsCaptureTick },
+		{ "SetGCBudget", &FTorchContext::Lua_SetGCBudget },
+		{ "GetMemoryStats", &FTorchContext::Lua_GetMemoryStats },
+		{ "EnableProfiler", &FTorchContext::Lua_EnableProfiler },
+		{ "ResetProfiler", &FTorchContext::Lua_ResetProfiler },
+		{ "GetProfilerStats", &FTorchContext::Lua_GetProfilerStats },
+		{ "StartProfilerTrace", &FTorchContext::Lua_StartProfilerTrace },
+		{ "StopProfilerTrace", &FTorchContext::Lua_StopProfilerTrace },
+		{ "SetRenderGate", &FTorchContext::Lua_SetRenderGate },
+		{ "RequestRender", &FTorchContext::Lua_RequestRender },
+		{ NULL, NULL }
+	};
+	lua_pushlightuserdata(LuaState, this);
+	luaL_setfuncs(LuaState, Natives, 1);
+
+	// register the hooks that were added while the scripts were loading
+	lua_getfield(LuaState, -1, "_FlushPendingTickHooks");
+	if (lua_pcall(LuaState, 0, 0, 0) != 0)
+	{
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot call Lua function _FlushPendingTickHooks: %s"), ANSI_TO_TCHAR(lua_tostring(LuaState, -1)));
+		lua_pop(LuaState, 1);
+	}
+	lua_pop(LuaState, 3);
+}
+
 void FTorchContext::Tick(float DeltaTime)
 {
 	check(LuaState && bHasTick);
 	if (bHasTick) {
+		FTorchProfiler::Get().BeginTick();
+		TORCH_PROFILE_SCOPE("Tick", STAT_TorchTick);
+		if (UObject* Component = Owner.Get())
+		{
+			SampleCameraMotion(Component);
+		}
+
+		// the top-level Tick returns the delta time to pass to the hooks
 		const ANSICHAR* FunctionName = "Tick";
-		lua_getglobal(LuaState, FunctionName);
+		lua_rawgeti(LuaState, LUA_REGISTRYINDEX, TickRef);
 		lua_pushnumber(LuaState, DeltaTime);
 		const int NumArgs = 1;
-		const int NumResults = 0;
-		if (lua_pcall(LuaState, NumArgs, NumResults, 0) != 0)
+		const int NumResults = 1;
+		float HookDeltaTime = DeltaTime;
 		{
-			UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot call Lua function %s: %s"), ANSI_TO_TCHAR(FunctionName), ANSI_TO_TCHAR(lua_tostring(LuaState, -1)));
+			TORCH_PROFILE_NAMED_SCOPE("Tick.Lua");
+			if (lua_pcall(LuaState, NumArgs, NumResults, 0) != 0)
+			{
+				UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot call Lua function %s: %s"), ANSI_TO_TCHAR(FunctionName), ANSI_TO_TCHAR(lua_tostring(LuaState, -1)));
+			}
+			else if (lua_isnumber(LuaState, -1))
+			{
+				HookDeltaTime = lua_tonumber(LuaState, -1);
+			}
+			lua_pop(LuaState, 1);
 		}
+
+		DispatchTickHooks(DeltaTime, HookDeltaTime);
+		ApplyRenderGate(DeltaTime);
+		StepGC();
+
+		if (DeltaTime > 0)
+		{
+			AllocationRate = (Allocator.AllocatedBytes - TickAllocatedBytes) / DeltaTime;
+		}
+		TickAllocatedBytes = Allocator.AllocatedBytes;
 	}
 }
 
-bool FTorchContext::CallFunctionString(const FString& FunctionName, FString In, FString& Out)
+void FTorchContext::Destroy()
 {
-	check(LuaState);
+	SetRenderGate(false);
+	// flush a recording and a trace left running by the script
+	FTorchRecorder::Get().StopRecording();
+	FTorchProfiler::Get().StopTrace();
+	FTorchRecorder::Get().StopReplay();
+	FLuaContext::Destroy();
+	if (LuaState == NULL)
+	{
+		Allocator.Release();
+	}
+}
 
-	bool bSuccess = FLuaUtils::DoesFunctionExist(LuaState, TCHAR_TO_ANSI(*FunctionName));
-	if (bSuccess)
+void FTorchContext::StepGC()
+{
+	GCLastTickSeconds = 0;
+	if (GCBudget <= 0)
+	{
+		return;
+	}
+	TORCH_PROFILE_SCOPE("Tick.GC", STAT_TorchGC);
+
+	// if the steps can't keep up with the allocation rate, finish the cycle
+	// regardless of the budget rather than letting the heap grow unbounded
+	const int32 HeapSize = lua_gc(LuaState, LUA_GCCOUNT, 0);
+	const bool bOverBudget = GCHeapAfterCycle > 0 && HeapSize > 4 * GCHeapAfterCycle;
+
+	const double StartTime = FPlatformTime::Seconds();
+	double Now = StartTime;
+	do
+	{
+		if (lua_gc(LuaState, LUA_GCSTEP, GCStepSize))
+		{
+			GCHeapAfterCycle = lua_gc(LuaState, LUA_GCCOUNT, 0);
+			GCCycles++;
+			Now = FPlatformTime::Seconds();
+			break;
+		}
+		Now = FPlatformTime::Seconds();
+	} while (bOverBudget || Now - StartTime < GCBudget);
+
+	GCLastTickSeconds = Now - StartTime;
+	GCTotalSeconds += GCLastTickSeconds;
+}
+
+static bool IsTickHookDue(const FTorchTickHook& Hook, int32 TicksSinceRun, float SecondsSinceRun)
+{
+	return (Hook.PeriodTicks <= 0 || TicksSinceRun >= Hook.PeriodTicks) &&
+		(Hook.PeriodSeconds <= 0 || SecondsSinceRun >= Hook.PeriodSeconds);
+}
+
+void FTorchContext::DispatchTickHooks(float DeltaTime, float HookDeltaTime)
+{
+	TORCH_PROFILE_SCOPE("Tick.Hooks", STAT_TorchTickHooks);
+	bDispatchingTickHooks = true;
+	for (int32 i = 0; i < TickHooks.Num(); i++)
+	{
+		FTorchTickHook& Hook = TickHooks[i];
+		if (Hook.Ref == LUA_NOREF)
+		{
+			continue; // removed by a previous hook
+		}
+		Hook.TicksSinceRun++;
+		Hook.SecondsSinceRun += DeltaTime;
+		Hook.ElapsedSinceRun += HookDeltaTime;
+		if (!IsTickHookDue(Hook, Hook.TicksSinceRun, Hook.SecondsSinceRun))
+		{
+			continue;
+		}
+
+		// hooks are called with the time elapsed since they last ran
+		const float Elapsed = Hook.ElapsedSinceRun;
+		Hook.TicksSinceRun = 0;
+		Hook.SecondsSinceRun = 0;
+		Hook.ElapsedSinceRun = 0;
+		bCaptureTick = Hook.bNeedsCapture;
+		lua_rawgeti(LuaState, LUA_REGISTRYINDEX, Hook.Ref);
+		lua_pushnumber(LuaState, Elapsed);
+		{
+			FTorchProfileScope Scope(Hook.Name);
+			if (lua_pcall(LuaState, 1, 0, 0) != 0)
+			{
+				UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot call tick hook %d: %s"), TickHooks[i].Id, ANSI_TO_TCHAR(lua_tostring(LuaState, -1)));
+				lua_pop(LuaState, 1);
+			}
+		}
+		bCaptureTick = false;
+	}
+	bDispatchingTickHooks = false;
+
+	// apply the changes made by the hooks
+	TickHooks.RemoveAll([](const FTorchTickHook& Hook) { return Hook.Ref == LUA_NOREF; });
+	for (const FTorchTickHook& Hook : AddedTickHooks)
+	{
+		AddTickHook(Hook);
+	}
+	AddedTickHooks.Reset();
+}
+
+int32 FTorchContext::AddTickHook(const FTorchTickHook& InHook)
+{
+	FTorchTickHook Hook = InHook;
+	if (Hook.Id <= 0)
+	{
+		Hook.Id = NextTickHookId++;
+	}
+	Hook.TicksSinceRun = 0;
+	Hook.SecondsSinceRun = 0;
+	Hook.ElapsedSinceRun = 0;
+	if (bDispatchingTickHooks)
+	{
+		AddedTickHooks.Add(Hook);
+		return Hook.Id;
+	}
+
+	// keep the hooks sorted by decreasing priority, and in insertion order within a priority
+	int32 Index = 0;
+	while (Index < TickHooks.Num() && TickHooks[Index].Priority >= Hook.Priority)
+	{
+		Index++;
+	}
+	TickHooks.Insert(Hook, Index);
+	return Hook.Id;
+}
+
+void FTorchContext::RemoveTickHook(int32 Id)
+{
+	auto Remove = [this, Id](FTorchTickHook& Hook) {
+		if (Hook.Id == Id && Hook.Ref != LUA_NOREF)
+		{
+			luaL_unref(LuaState, LUA_REGISTRYINDEX, Hook.Ref);
+			Hook.Ref = LUA_NOREF;
+		}
+	};
+	for (FTorchTickHook& Hook : TickHooks)
+	{
+		Remove(Hook);
+	}
+	for (FTorchTickHook& Hook : AddedTickHooks)
+	{
+		Remove(Hook);
+	}
+	if (!bDispatchingTickHooks)
+	{
+		TickHooks.RemoveAll([](const FTorchTickHook& Hook) { return Hook.Ref == LUA_NOREF; });
+	}
+	AddedTickHooks.RemoveAll([](const FTorchTickHook& Hook) { return Hook.Ref == LUA_NOREF; });
+}
+
+void FTorchContext::ClearTickHooks()
+{
+	for (FTorchTickHook& Hook : TickHooks)
+	{
+		if (Hook.Ref != LUA_NOREF)
+		{
+			luaL_unref(LuaState, LUA_REGISTRYINDEX, Hook.Ref);
+			Hook.Ref = LUA_NOREF;
+		}
+	}
+	for (const FTorchTickHook& Hook : AddedTickHooks)
+	{
+		luaL_unref(LuaState, LUA_REGISTRYINDEX, Hook.Ref);
+	}
+	AddedTickHooks.Reset();
+	if (!bDispatchingTickHooks)
+	{
+		TickHooks.Reset();
+	}
+}
+
+bool FTorchContext::NeedsCaptureNextTick(float DeltaTime) const
+{
+	for (const FTorchTickHook& Hook : TickHooks)
+	{
+		if (Hook.Ref != LUA_NOREF && Hook.bNeedsCapture &&
+			IsTickHookDue(Hook, Hook.TicksSinceRun + 1, Hook.SecondsSinceRun + DeltaTime))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Enables or disables drawing the game viewport, including the world
+static void SetGameRendering(bool bEnabled)
+{
+	UGameViewportClient* GameViewport = GEngine ? GEngine->GameViewport : NULL;
+	if (GameViewport == NULL)
+	{
+		return;
+	}
+	GameViewport->bDisableWorldRendering = !bEnabled;
+	if (GameViewport->Viewport)
+	{
+		GameViewport->Viewport->SetGameRenderingEnabled(bEnabled);
+	}
+}
+
+void FTorchContext::SetRenderGate(bool bEnabled)
+{
+	if (bRenderGate && !bEnabled)
+	{
+		SetGameRendering(true);
+	}
+	bRenderGate = bEnabled;
+	RenderRequests = 0;
+}
+
+void FTorchContext::RequestRender(int32 NumFrames)
+{
+	RenderRequests = FMath::Max(RenderRequests, NumFrames);
+	if (bRenderGate && RenderRequests > 0)
+	{
+		SetGameRendering(true);
+	}
+}
+
+// The frame drawn at the end of this tick is the one that the captures of the
+// next tick read, so it is only rendered if a capture is due on the next tick
+void FTorchContext::ApplyRenderGate(float DeltaTime)
+{
+	if (!bRenderGate)
+	{
+		return;
+	}
+	const bool bRender = RenderRequests > 0 || NeedsCaptureNextTick(DeltaTime);
+	if (RenderRequests > 0)
 	{
-		bSuccess = FTorchUtils::CallFunctionString(LuaState, TCHAR_TO_ANSI(*FunctionName), TCHAR_TO_ANSI(*In), Out);
+		RenderRequests--;
+	}
+	SetGameRendering(bRender);
+}
+
+// uetorch._AddTickHook(f, periodTicks, periodSeconds, priority, needsCapture, name) -> id
+int FTorchContext::Lua_AddTickHook(lua_State* L)
+{
+	FTorchContext* Context = (FTorchContext*) lua_touserdata(L, lua_upvalueindex(1));
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	FTorchTickHook Hook;
+	Hook.Id = 0;
+	if (lua_isstring(L, 6))
+	{
+		Hook.Name = FName(ANSI_TO_TCHAR(lua_tostring(L, 6)));
 	}
 	else
 	{
+		// name the hook after where its function is defined
+		lua_Debug Info;
+		lua_pushvalue(L, 1);
+		lua_getinfo(L, ">S", &Info);
+		Hook.Name = FName(*FString::Printf(TEXT("Hook %s:%d"), ANSI_TO_TCHAR(Info.short_src), Info.linedefined));
+	}
+	Hook.PeriodTicks = (int32) luaL_optinteger(L, 2, 0);
+	Hook.PeriodSeconds = (float) luaL_optnumber(L, 3, 0);
+	Hook.Priority = (int32) luaL_optinteger(L, 4, 0);
+	Hook.bNeedsCapture = lua_toboolean(L, 5) != 0;
+	lua_pushvalue(L, 1);
+	Hook.Ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushinteger(L, Context->AddTickHook(Hook));
+	return 1;
+}
+
+// uetorch._RemoveTickHook(id)
+int FTorchContext::Lua_RemoveTickHook(lua_State* L)
+{
+	FTorchContext* Context = (FTorchContext*) lua_touserdata(L, lua_upvalueindex(1));
+	Context->RemoveTickHook((int32) luaL_checkinteger(L, 1));
+	return 0;
+}
+
+// uetorch._ClearTickHooks()
+int FTorchContext::Lua_ClearTickHooks(lua_State* L)
+{
+	FTorchContext* Context = (FTorchContext*) lua_touserdata(L, lua_upvalueindex(1));
+	Context->ClearTickHooks();
+	return 0;
+}
+
+// uetorch.IsCaptureTick() -> true while a hook that needs a capture is running
+int FTorchContext::Lua_IsCaptureTick(lua_State* L)
+{
+	FTorchContext* Context = (FTorchContext*) lua_touserdata(L, lua_upvalueindex(1));
+	lua_pushboolean(L, Context->bCaptureTick);
+	return 1;
+}
+
+// uetorch.SetGCBudget(ms, stepKB): runs the GC for up to ms milliseconds
+// after each tick, and nowhere else. ms <= 0 restores the automatic GC.
+int FTorchContext::Lua_SetGCBudget(lua_State* L)
+{
+	FTorchContext* Context = (FTorchContext*) lua_touserdata(L, lua_upvalueindex(1));
+	Context->GCBudget = (float) luaL_optnumber(L, 1, 0) / 1000.0f;
+	Context->GCStepSize = (int32) luaL_optinteger(L, 2, 0);
+	lua_gc(L, Context->GCBudget > 0 ? LUA_GCSTOP : LUA_GCRESTART, 0);
+	return 0;
+}
+
+// uetorch.GetMemoryStats() -> table of heap and GC statistics
+int FTorchContext::Lua_GetMemoryStats(lua_State* L)
+{
+	FTorchContext* Context = (FTorchContext*) lua_touserdata(L, lua_upvalueindex(1));
+	const FTorchLuaAllocator& Allocator = Context->Allocator;
+	lua_createtable(L, 0, 9);
+	lua_pushnumber(L, lua_gc(L, LUA_GCCOUNT, 0) + lua_gc(L, LUA_GCCOUNTB, 0) / 1024.0);
+	lua_setfield(L, -2, "heapKB");
+	lua_pushnumber(L, (lua_Number) Allocator.ArenaBytes / 1024.0);
+	lua_setfield(L, -2, "arenaKB");
+	lua_pushnumber(L, (lua_Number) Allocator.NumAllocations);
+	lua_setfield(L, -2, "allocations");
+	lua_pushnumber(L, (lua_Number) Allocator.AllocatedBytes / 1024.0);
+	lua_setfield(L, -2, "allocatedKB");
+	lua_pushnumber(L, Context->AllocationRate / 1024.0);
+	lua_setfield(L, -2, "allocRateKBps");
+	lua_pushnumber(L, Context->GCLastTickSeconds);
+	lua_setfield(L, -2, "gcSeconds");
+	lua_pushnumber(L, Context->GCTotalSeconds);
+	lua_setfield(L, -2, "gcTotalSeconds");
+	lua_pushinteger(L, Context->GCCycles);
+	lua_setfield(L, -2, "gcCycles");
+	lua_pushnumber(L, Context->GCBudget * 1000.0);
+	lua_setfield(L, -2, "gcBudgetMs");
+	return 1;
+}
+
+// uetorch.EnableProfiler(enabled)
+int FTorchContext::Lua_EnableProfiler(lua_State* L)
+{
+	FTorchProfiler::Get().SetEnabled(lua_isnone(L, 1) || lua_toboolean(L, 1) != 0);
+	return 0;
+}
+
+// uetorch.ResetProfiler()
+int FTorchContext::Lua_ResetProfiler(lua_State* L)
+{
+	FTorchProfiler::Get().Reset();
+	return 0;
+}
+
+// uetorch.GetProfilerStats() -> {ticks, rays, bytes, scopes = {name = {count, total, mean, max}}}
+int FTorchContext::Lua_GetProfilerStats(lua_State* L)
+{
+	const FTorchProfiler& Profiler = FTorchProfiler::Get();
+	lua_createtable(L, 0, 4);
+	lua_pushnumber(L, (lua_Number) Profiler.GetNumTicks());
+	lua_setfield(L, -2, "ticks");
+	lua_pushnumber(L, (lua_Number) Profiler.GetRays());
+	lua_setfield(L, -2, "rays");
+	lua_pushnumber(L, (lua_Number) Profiler.GetBytes());
+	lua_setfield(L, -2, "bytes");
+
+	lua_createtable(L, 0, Profiler.GetStats().Num());
+	for (const auto& Entry : Profiler.GetStats())
+	{
+		const FTorchProfileStat& Stat = Entry.Value;
+		lua_createtable(L, 0, 4);
+		lua_pushnumber(L, (lua_Number) Stat.Count);
+		lua_setfield(L, -2, "count");
+		lua_pushnumber(L, Stat.TotalSeconds);
+		lua_setfield(L, -2, "total");
+		lua_pushnumber(L, Stat.Count > 0 ? Stat.TotalSeconds / Stat.Count : 0);
+		lua_setfield(L, -2, "mean");
+		lua_pushnumber(L, Stat.MaxSeconds);
+		lua_setfield(L, -2, "max");
+		lua_setfield(L, -2, TCHAR_TO_ANSI(*Entry.Key.ToString()));
+	}
+	lua_setfield(L, -2, "scopes");
+	return 1;
+}
+
+// uetorch.StartProfilerTrace(path, ticks) -> true if the trace file was opened
+int FTorchContext::Lua_StartProfilerTrace(lua_State* L)
+{
+	const char* Path = luaL_checkstring(L, 1);
+	const int32 NumTicks = (int32) luaL_optinteger(L, 2, 0);
+	lua_pushboolean(L, FTorchProfiler::Get().StartTrace(ANSI_TO_TCHAR(Path), NumTicks));
+	return 1;
+}
+
+// uetorch.StopProfilerTrace()
+int FTorchContext::Lua_StopProfilerTrace(lua_State* L)
+{
+	FTorchProfiler::Get().StopTrace();
+	return 0;
+}
+
+// uetorch.SetRenderGate(enabled)
+int FTorchContext::Lua_SetRenderGate(lua_State* L)
+{
+	FTorchContext* Context = (FTorchContext*) lua_touserdata(L, lua_upvalueindex(1));
+	Context->SetRenderGate(lua_isnone(L, 1) || lua_toboolean(L, 1) != 0);
+	return 0;
+}
+
+// uetorch.RequestRender(frames)
+int FTorchContext::Lua_RequestRender(lua_State* L)
+{
+	FTorchContext* Context = (FTorchContext*) lua_touserdata(L, lua_upvalueindex(1));
+	Context->RequestRender((int32) luaL_optinteger(L, 1, 1));
+	return 0;
+}
+
+bool FTorchContext::PushFunction(const FString& FunctionName)
+{
+	// the global is looked up on every call, so that a function redefined by
+	// the script (e.g. from the REPL) is the one called
+	lua_getglobal(LuaState, TCHAR_TO_ANSI(*FunctionName));
+	if (!lua_isfunction(LuaState, -1))
+	{
+		lua_pop(LuaState, 1);
 		UE_LOG(LogScriptPlugin, Warning, TEXT("Failed to call function '%s' "), *FunctionName);
+		return false;
+	}
+	return true;
+}
+
+bool FTorchContext::CallFunctionString(const FString& FunctionName, const FString& In, FString& Out)
+{
+	check(LuaState);
+
+	bool bSuccess = PushFunction(FunctionName);
+	if (bSuccess)
+	{
+		bSuccess = FTorchUtils::CallFunctionString(LuaState, NULL, TCHAR_TO_ANSI(*In), Out);
 	}
 
 	return bSuccess;
@@ -81,11 +596,11 @@ bool FTorchUtils::CallFunctionString(lua_State* LuaState, const ANSICHAR* Functi
 	const int NumResults = 1;
 	if (lua_pcall(LuaState, NumArgs, NumResults, 0) != 0)
 	{
-		UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot call Lua function %s: %s"), ANSI_TO_TCHAR(FunctionName), ANSI_TO_TCHAR(lua_tostring(LuaState, -1)));
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot call Lua function %s: %s"), (FunctionName ? ANSI_TO_TCHAR(FunctionName) : TEXT("<pushed>")), ANSI_TO_TCHAR(lua_tostring(LuaState, -1)));
 		bResult = false;
 	}
 	if (!lua_isstring(LuaState, -1) && !lua_isnil(LuaState, -1)) {
-		UE_LOG(LogScriptPlugin, Warning, TEXT("Lua function %s did not return a string or nil"), ANSI_TO_TCHAR(FunctionName));
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Lua function %s did not return a string or nil"), (FunctionName ? ANSI_TO_TCHAR(FunctionName) : TEXT("<pushed>")));
 	}
 	if (lua_isnil(LuaState, -1)) {
 	  Out = FString(TEXT("<nil>"));
@@ -100,17 +615,97 @@ bool FTorchContext::CallFunctionArray(const FString& FunctionName, const TArray<
 {
 	check(LuaState);
 
-	bool bSuccess = FLuaUtils::DoesFunctionExist(LuaState, TCHAR_TO_ANSI(*FunctionName));
+	bool bSuccess = PushFunction(FunctionName);
 	if (bSuccess)
 	{
-		bSuccess = FTorchUtils::CallFunctionArray(LuaState, TCHAR_TO_ANSI(*FunctionName), In, Out);
+		bSuccess = FTorchUtils::CallFunctionArray(LuaState, NULL, In, Out);
 	}
-	else
+
+	return bSuccess;
+}
+
+bool FTorchContext::CallFunctionNumbers(const FString& FunctionName, int32 NumArgs, TArray<float>& Out)
+{
+	const int32 Base = lua_gettop(LuaState) - NumArgs - 1;
+	Out.Reset();
+	if (lua_pcall(LuaState, NumArgs, LUA_MULTRET, 0) != 0)
 	{
-		UE_LOG(LogScriptPlugin, Warning, TEXT("Failed to call function '%s' "), *FunctionName);
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot call Lua function %s: %s"), *FunctionName, ANSI_TO_TCHAR(lua_tostring(LuaState, -1)));
+		lua_settop(LuaState, Base);
+		return false;
+	}
+	const int32 NumResults = lua_gettop(LuaState) - Base;
+	bool bResult = true;
+	for (int32 i = 1; i <= NumResults; i++)
+	{
+		if (!lua_isnumber(LuaState, Base + i))
+		{
+			UE_LOG(LogScriptPlugin, Warning, TEXT("Lua function %s returned a non-number at position %d"), *FunctionName, i);
+			bResult = false;
+			break;
+		}
+		Out.Add(lua_tonumber(LuaState, Base + i));
 	}
+	lua_settop(LuaState, Base);
+	return bResult;
+}
 
-	return bSuccess;
+bool FTorchContext::CallFunctionFloatArray(const FString& FunctionName, const TArray<float>& In, TArray<float>& Out)
+{
+	check(LuaState);
+
+	if (!PushFunction(FunctionName))
+	{
+		return false;
+	}
+	if (!lua_checkstack(LuaState, In.Num()))
+	{
+		lua_pop(LuaState, 1);
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Too many arguments for Lua function %s: %d"), *FunctionName, In.Num());
+		return false;
+	}
+	for (float Value : In)
+	{
+		lua_pushnumber(LuaState, Value);
+	}
+	return CallFunctionNumbers(FunctionName, In.Num(), Out);
+}
+
+bool FTorchContext::CallFunctionVector(const FString& FunctionName, const FVector& In, TArray<float>& Out)
+{
+	check(LuaState);
+
+	if (!PushFunction(FunctionName))
+	{
+		return false;
+	}
+	lua_pushnumber(LuaState, In.X);
+	lua_pushnumber(LuaState, In.Y);
+	lua_pushnumber(LuaState, In.Z);
+	return CallFunctionNumbers(FunctionName, 3, Out);
+}
+
+bool FTorchContext::CallFunctionTransform(const FString& FunctionName, const FTransform& In, TArray<float>& Out)
+{
+	check(LuaState);
+
+	if (!PushFunction(FunctionName))
+	{
+		return false;
+	}
+	const FVector Location = In.GetLocation();
+	const FRotator Rotation = In.Rotator();
+	const FVector Scale = In.GetScale3D();
+	lua_pushnumber(LuaState, Location.X);
+	lua_pushnumber(LuaState, Location.Y);
+	lua_pushnumber(LuaState, Location.Z);
+	lua_pushnumber(LuaState, Rotation.Pitch);
+	lua_pushnumber(LuaState, Rotation.Yaw);
+	lua_pushnumber(LuaState, Rotation.Roll);
+	lua_pushnumber(LuaState, Scale.X);
+	lua_pushnumber(LuaState, Scale.Y);
+	lua_pushnumber(LuaState, Scale.Z);
+	return CallFunctionNumbers(FunctionName, 9, Out);
 }
 
 bool FTorchUtils::CallFunctionArray(lua_State* LuaState, const ANSICHAR* FunctionName, const TArray<FString>& In, FString& Out)
@@ -127,11 +722,11 @@ bool FTorchUtils::CallFunctionArray(lua_State* LuaState, const ANSICHAR* Functio
 	const int NumResults = 1;
 	if (lua_pcall(LuaState, NumArgs, NumResults, 0) != 0)
 	{
-		UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot call Lua function %s: %s"), ANSI_TO_TCHAR(FunctionName), ANSI_TO_TCHAR(lua_tostring(LuaState, -1)));
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot call Lua function %s: %s"), (FunctionName ? ANSI_TO_TCHAR(FunctionName) : TEXT("<pushed>")), ANSI_TO_TCHAR(lua_tostring(LuaState, -1)));
 		bResult = false;
 	}
 	if (!lua_isstring(LuaState, -1) && !lua_isnil(LuaState, -1)) {
-		UE_LOG(LogScriptPlugin, Warning, TEXT("Lua function %s did not return a string or nil"), ANSI_TO_TCHAR(FunctionName));
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Lua function %s did not return a string or nil"), (FunctionName ? ANSI_TO_TCHAR(FunctionName) : TEXT("<pushed>")));
 	}
 	if (lua_isnil(LuaState, -1)) {
 	  Out = FString(TEXT("<nil>"));
@@ -14,17 +14,119 @@
 #endif
 
 #include "LuaIntegration.h"
+#include "TorchLuaAllocator.h"
+
+/**
+ * A Lua function called by FTorchContext::Tick, see uetorch.AddTickHook().
+ * A hook runs once every PeriodTicks ticks and/or every PeriodSeconds
+ * seconds (every tick if both are 0). Hooks run in decreasing Priority
+ * order, then in the order they were added.
+ */
+struct FTorchTickHook {
+	int32 Id;
+	int32 Ref;
+	/** Profiler scope name */
+	FName Name;
+	int32 PeriodTicks;
+	float PeriodSeconds;
+	int32 Priority;
+	bool bNeedsCapture;
+
+	int32 TicksSinceRun;
+	float SecondsSinceRun;
+	float ElapsedSinceRun;
+};
 
 class FTorchContext : public FLuaContext
 {
 protected:
+	/** Registry ref to the global Tick function */
+	int32 TickRef;
+
+	/** The TorchPluginComponent running this context */
+	TWeakObjectPtr<UObject> Owner;
+
+	TArray<FTorchTickHook> TickHooks;
+	TArray<FTorchTickHook> AddedTickHooks;
+	int32 NextTickHookId;
+	bool bDispatchingTickHooks;
+	bool bCaptureTick;
+
+	FTorchLuaAllocator Allocator;
+
+	/** Time budget for the GC steps after each tick, in seconds (0 lets Lua collect on its own) */
+	float GCBudget;
+	/** Size of each GC step, in KB */
+	int32 GCStepSize;
+	/** Heap size after the last complete GC cycle, in KB */
+	int32 GCHeapAfterCycle;
+	double GCLastTickSeconds;
+	double GCTotalSeconds;
+	int32 GCCycles;
+	/** Allocator.AllocatedBytes at the end of the last tick, and the allocation rate over it (bytes per second) */
+	uint64 TickAllocatedBytes;
+	double AllocationRate;
+
+	/** If true, the world is only rendered on the frames before a capture, see ApplyRenderGate */
+	bool bRenderGate;
+	/** Number of upcoming frames to render regardless of the tick hooks */
+	int32 RenderRequests;
+
+	FTorchContext();
+
+	/** Enables world rendering for the next frame only if it will be captured */
+	void ApplyRenderGate(float DeltaTime);
+
+	/** Runs incremental GC steps within GCBudget */
+	void StepGC();
+
+	/** Binds the native functions of this context in the uetorch module */
+	void BindNatives();
+
+	void DispatchTickHooks(float DeltaTime, float HookDeltaTime);
+
+	static int Lua_AddTickHook(lua_State* L);
+	static int Lua_RemoveTickHook(lua_State* L);
+	static int Lua_ClearTickHooks(lua_State* L);
+	static int Lua_IsCaptureTick(lua_State* L);
+	static int Lua_SetGCBudget(lua_State* L);
+	static int Lua_GetMemoryStats(lua_State* L);
+	static int Lua_EnableProfiler(lua_State* L);
+	static int Lua_ResetProfiler(lua_State* L);
+	static int Lua_GetProfilerStats(lua_State* L);
+	static int Lua_StartProfilerTrace(lua_State* L);
+	static int Lua_StopProfilerTrace(lua_State* L);
+	static int Lua_SetRenderGate(lua_State* L);
+	static int Lua_RequestRender(lua_State* L);
+
+	/** Pushes the global function FunctionName. Returns false if it doesn't exist. */
+	bool PushFunction(const FString& FunctionName);
+
+	/** Calls the function on top of the stack with NumArgs arguments, and appends its numeric results to Out */
+	bool CallFunctionNumbers(const FString& FunctionName, int32 NumArgs, TArray<float>& Out);
 
 public:
 	static FTorchContext* Create(const FString& SourceCode, UObject* Owner);
 
 	void Tick(float DeltaTime);
-	bool CallFunctionString(const FString& FunctionName, FString In, FString& Out);
+	void Destroy();
+	bool CallFunctionString(const FString& FunctionName, const FString& In, FString& Out);
 	bool CallFunctionArray(const FString& FunctionName, const TArray<FString>& In, FString& Out);
+	bool CallFunctionFloatArray(const FString& FunctionName, const TArray<float>& In, TArray<float>& Out);
+	bool CallFunctionVector(const FString& FunctionName, const FVector& In, TArray<float>& Out);
+	bool CallFunctionTransform(const FString& FunctionName, const FTransform& In, TArray<float>& Out);
+
+	/** Registers a tick hook, taking ownership of Hook.Ref, and returns its id */
+	int32 AddTickHook(const FTorchTickHook& Hook);
+	void RemoveTickHook(int32 Id);
+	void ClearTickHooks();
+
+	/** Returns true if a hook that needs a capture will run on the next tick (assuming the same DeltaTime) */
+	bool NeedsCaptureNextTick(float DeltaTime) const;
+
+	void SetRenderGate(bool bEnabled);
+	/** Renders the next NumFrames frames even if the render gate is enabled */
+	void RequestRender(int32 NumFrames);
 };
 
 struct FTorchUtils {
@@ -0,0 +1,170 @@
+/**
+ * Copyright (c) 2015-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "UETorchPrivatePCH.h"
+#include "TorchLuaAllocator.h"
+
+FTorchLuaAllocator::FTorchLuaAllocator()
+	: NumAllocations(0)
+	, AllocatedBytes(0)
+	, ArenaBytes(0)
+	, OriginalAlloc(NULL)
+	, OriginalUserData(NULL)
+{
+	for (int32 i = 0; i < NumSizeClasses; i++)
+	{
+		FreeLists[i] = NULL;
+		ArenaCursor[i] = NULL;
+		ArenaEnd[i] = NULL;
+	}
+}
+
+void FTorchLuaAllocator::Install(lua_State* LuaState)
+{
+	OriginalAlloc = lua_getallocf(LuaState, &OriginalUserData);
+	lua_setallocf(LuaState, &FTorchLuaAllocator::Alloc, this);
+}
+
+void FTorchLuaAllocator::Release()
+{
+	for (UPTRINT Arena : Arenas)
+	{
+		FMemory::Free((void*) Arena);
+	}
+	Arenas.Reset();
+	ArenaBytes = 0;
+	for (int32 i = 0; i < NumSizeClasses; i++)
+	{
+		FreeLists[i] = NULL;
+		ArenaCursor[i] = NULL;
+		ArenaEnd[i] = NULL;
+	}
+}
+
+// Size classes are 16, 32, ..., MaxPooledSize bytes
+int32 FTorchLuaAllocator::GetSizeClass(size_t Size)
+{
+	int32 SizeClass = 0;
+	size_t ClassSize = 16;
+	while (ClassSize < Size)
+	{
+		ClassSize <<= 1;
+		SizeClass++;
+	}
+	return SizeClass;
+}
+
+bool FTorchLuaAllocator::IsPooled(const void* Ptr) const
+{
+	return Arenas.Contains((UPTRINT) Ptr & ~(UPTRINT) (ArenaSize - 1));
+}
+
+void* FTorchLuaAllocator::Allocate(size_t Size)
+{
+	const int32 SizeClass = GetSizeClass(Size);
+	NumAllocations++;
+	AllocatedBytes += Size;
+
+	if (FFreeBlock* Block = FreeLists[SizeClass])
+	{
+		FreeLists[SizeClass] = Block->Next;
+		return Block;
+	}
+
+	const size_t ClassSize = (size_t) 16 << SizeClass;
+	if (ArenaCursor[SizeClass] + ClassSize > ArenaEnd[SizeClass] || ArenaCursor[SizeClass] == NULL)
+	{
+		uint8* Arena = (uint8*) FMemory::Malloc(ArenaSize, ArenaSize);
+		if (Arena == NULL)
+		{
+			return NULL;
+		}
+		Arenas.Add((UPTRINT) Arena);
+		ArenaBytes += ArenaSize;
+		ArenaCursor[SizeClass] = Arena;
+		ArenaEnd[SizeClass] = Arena + ArenaSize;
+	}
+	void* Block = ArenaCursor[SizeClass];
+	ArenaCursor[SizeClass] += ClassSize;
+	return Block;
+}
+
+void FTorchLuaAllocator::Free(void* Ptr, size_t Size)
+{
+	const int32 SizeClass = GetSizeClass(Size);
+	FFreeBlock* Block = (FFreeBlock*) Ptr;
+	Block->Next = FreeLists[SizeClass];
+	FreeLists[SizeClass] = Block;
+}
+
+void* FTorchLuaAllocator::Alloc(void* UserData, void* Ptr, size_t OldSize, size_t NewSize)
+{
+	FTorchLuaAllocator* Allocator = (FTorchLuaAllocator*) UserData;
+
+	// blocks allocated before Install
+	if (Ptr != NULL && !Allocator->IsPooled(Ptr))
+	{
+		if (NewSize > 0 && NewSize <= MaxPooledSize)
+		{
+			void* NewPtr = Allocator->Allocate(NewSize);
+			if (NewPtr != NULL)
+			{
+				FMemory::Memcpy(NewPtr, Ptr, FMath::Min(OldSize, NewSize));
+				Allocator->OriginalAlloc(Allocator->OriginalUserData, Ptr, OldSize, 0);
+				return NewPtr;
+			}
+		}
+		if (NewSize > OldSize)
+		{
+			Allocator->NumAllocations++;
+			Allocator->AllocatedBytes += NewSize;
+		}
+		return Allocator->OriginalAlloc(Allocator->OriginalUserData, Ptr, OldSize, NewSize);
+	}
+
+	// from here on, Ptr is NULL or pooled; if Ptr is NULL, OldSize is a type tag and not a size
+	if (NewSize == 0)
+	{
+		if (Ptr != NULL)
+		{
+			Allocator->Free(Ptr, OldSize);
+		}
+		return NULL;
+	}
+
+	if (NewSize > MaxPooledSize)
+	{
+		Allocator->NumAllocations++;
+		Allocator->AllocatedBytes += NewSize;
+		void* NewPtr = Allocator->OriginalAlloc(Allocator->OriginalUserData, NULL, Ptr ? 0 : OldSize, NewSize);
+		if (NewPtr != NULL && Ptr != NULL)
+		{
+			FMemory::Memcpy(NewPtr, Ptr, OldSize);
+			Allocator->Free(Ptr, OldSize);
+		}
+		return NewPtr;
+	}
+
+	if (Ptr != NULL && GetSizeClass(OldSize) == GetSizeClass(NewSize))
+	{
+		return Ptr;
+	}
+	void* NewPtr = Allocator->Allocate(NewSize);
+	if (Ptr != NULL)
+	{
+		if (NewPtr == NULL)
+		{
+			// Lua requires shrinking to succeed; the old block is big enough
+			return NewSize < OldSize ? Ptr : NULL;
+		}
+		FMemory::Memcpy(NewPtr, Ptr, FMath::Min(OldSize, NewSize));
+		Allocator->Free(Ptr, OldSize);
+	}
+	return NewPtr;
+}
@@ -0,0 +1,64 @@
+/**
+ * Copyright (c) 2015-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include "LuaIntegration.h"
+
+/**
+ * A lua_Alloc for FTorchContext that serves small blocks (the vast majority
+ * of Lua allocations: strings, tables, closures, cdata) from per-size-class
+ * free lists carved out of 64KB arenas. Larger blocks, and the blocks that
+ * were allocated before the allocator was installed, go to the state's
+ * original allocator; arenas are aligned to their size, so a block's arena
+ * is found by masking its address.
+ */
+class FTorchLuaAllocator
+{
+public:
+	FTorchLuaAllocator();
+
+	/** Installs the allocator in LuaState, keeping its current allocator for the other blocks */
+	void Install(lua_State* LuaState);
+
+	/** Frees all the arenas; only call this once the Lua state is closed */
+	void Release();
+
+	/** Number of allocations (including reallocations to a larger size) so far */
+	uint64 NumAllocations;
+	/** Number of bytes allocated (including reallocations to a larger size) so far */
+	uint64 AllocatedBytes;
+	/** Number of bytes in the arenas */
+	uint64 ArenaBytes;
+
+private:
+	static const int32 ArenaSize = 64 * 1024;
+	static const int32 NumSizeClasses = 6;
+	static const int32 MaxPooledSize = 16 << (NumSizeClasses - 1);
+
+	struct FFreeBlock
+	{
+		FFreeBlock* Next;
+	};
+
+	static void* Alloc(void* UserData, void* Ptr, size_t OldSize, size_t NewSize);
+
+	static int32 GetSizeClass(size_t Size);
+	bool IsPooled(const void* Ptr) const;
+	void* Allocate(size_t Size);
+	void Free(void* Ptr, size_t Size);
+
+	lua_Alloc OriginalAlloc;
+	void* OriginalUserData;
+
+	FFreeBlock* FreeLists[NumSizeClasses];
+	uint8* ArenaCursor[NumSizeClasses];
+	uint8* ArenaEnd[NumSizeClasses];
+	TSet<UPTRINT> Arenas;
+};
@@ -93,7 +93,7 @@ bool UTorchPluginComponent::CallTorchFunction(FString FunctionName)
 	return bSuccess;
 }
 
-bool UTorchPluginComponent::CallTorchFunctionString(FString FunctionName, FString In, FString &Out)
+bool UTorchPluginComponent::CallTorchFunctionString(const FString& FunctionName, const FString& In, FString &Out)
 {
 	bool bSuccess = false;
 	if (Context)
@@ -103,7 +103,7 @@ bool UTorchPluginComponent::CallTorchFunctionString(FString FunctionName, FStrin
 	return bSuccess;
 }
 
-bool UTorchPluginComponent::CallTorchFunctionArray(FString FunctionName, TArray<FString> In, FString &Out)
+bool UTorchPluginComponent::CallTorchFunctionArray(const FString& FunctionName, const TArray<FString>& In, FString &Out)
 {
   bool bSuccess = false;
   if (Context)
@@ -113,3 +113,32 @@ bool UTorchPluginComponent::CallTorchFunctionArray(FString FunctionName, TArray<
   return bSuccess;
 }
 
+bool UTorchPluginComponent::CallTorchFunctionFloatArray(const FString& FunctionName, const TArray<float>& In, TArray<float>& Out)
+{
+	bool bSuccess = false;
+	if (Context)
+	{
+		bSuccess = Context->CallFunctionFloatArray(FunctionName, In, Out);
+	}
+	return bSuccess;
+}
+
+bool UTorchPluginComponent::CallTorchFunctionVector(const FString& FunctionName, const FVector& In, TArray<float>& Out)
+{
+	bool bSuccess = false;
+	if (Context)
+	{
+		bSuccess = Context->CallFunctionVector(FunctionName, In, Out);
+	}
+	return bSuccess;
+}
+
+bool UTorchPluginComponent::CallTorchFunctionTransform(const FString& FunctionName, const FTransform& In, TArray<float>& Out)
+{
+	bool bSuccess = false;
+	if (Context)
+	{
+		bSuccess = Context->CallFunctionTransform(FunctionName, In, Out);
+	}
+	return bSuccess;
+}
@@ -0,0 +1,170 @@
+/**
+ * Copyright (c) 2015-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "UETorchPrivatePCH.h"
+#include "TorchProfiler.h"
+
+DEFINE_STAT(STAT_TorchTick);
+DEFINE_STAT(STAT_TorchTickHooks);
+DEFINE_STAT(STAT_TorchGC);
+DEFINE_STAT(STAT_TorchCapture);
+DEFINE_STAT(STAT_TorchInitCapture);
+DEFINE_STAT(STAT_TorchFlushRendering);
+DEFINE_STAT(STAT_TorchRays);
+DEFINE_STAT(STAT_TorchBytes);
+
+// write the trace to the file every few KB rather than at every event
+static const int32 TraceFlushSize = 64 * 1024;
+
+FTorchProfiler& FTorchProfiler::Get()
+{
+	static FTorchProfiler Profiler;
+	return Profiler;
+}
+
+FTorchProfiler::FTorchProfiler()
+	: bEnabled(false)
+	, NumTicks(0)
+	, Rays(0)
+	, Bytes(0)
+	, TickFrame(0)
+	, TickRays(0)
+	, TickBytes(0)
+	, TraceFile(NULL)
+	, TraceStartSeconds(0)
+	, TraceTicksRemaining(0)
+	, bTraceFirstEvent(true)
+{
+}
+
+void FTorchProfiler::SetEnabled(bool bInEnabled)
+{
+	if (!bInEnabled)
+	{
+		StopTrace();
+	}
+	bEnabled = bInEnabled;
+	TickFrame = GFrameCounter;
+}
+
+void FTorchProfiler::Reset()
+{
+	Stats.Reset();
+	NumTicks = 0;
+	Rays = 0;
+	Bytes = 0;
+}
+
+void FTorchProfiler::BeginTick()
+{
+	if (!bEnabled || GFrameCounter == TickFrame)
+	{
+		return;
+	}
+	EndTick();
+	TickFrame = GFrameCounter;
+}
+
+void FTorchProfiler::EndTick()
+{
+	NumTicks++;
+	if (TraceFile)
+	{
+		// counter events for the tick that just ended
+		const double Timestamp = (FPlatformTime::Seconds() - TraceStartSeconds) * 1e6;
+		TraceBuffer += FString::Printf(TEXT("%s{\"name\":\"counters\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"args\":{\"rays\":%lld,\"bytes\":%lld}}"),
+			bTraceFirstEvent ? TEXT("\n") : TEXT(",\n"), Timestamp, TickRays, TickBytes);
+		bTraceFirstEvent = false;
+
+		if (TraceTicksRemaining > 0 && --TraceTicksRemaining == 0)
+		{
+			StopTrace();
+		}
+		else if (TraceBuffer.Len() >= TraceFlushSize)
+		{
+			FlushTrace();
+		}
+	}
+	TickRays = 0;
+	TickBytes = 0;
+}
+
+void FTorchProfiler::AddScope(FName Name, double StartSeconds, double EndSeconds)
+{
+	const double Duration = EndSeconds - StartSeconds;
+	FTorchProfileStat& Stat = Stats.FindOrAdd(Name);
+	Stat.Count++;
+	Stat.TotalSeconds += Duration;
+	Stat.MaxSeconds = FMath::Max(Stat.MaxSeconds, Duration);
+
+	if (TraceFile)
+	{
+		TraceBuffer += FString::Printf(TEXT("%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}"),
+			bTraceFirstEvent ? TEXT("\n") : TEXT(",\n"), *Name.ToString().ReplaceCharWithEscapedChar(),
+			(StartSeconds - TraceStartSeconds) * 1e6, Duration * 1e6);
+		bTraceFirstEvent = false;
+	}
+}
+
+void FTorchProfiler::CountRays(int64 InRays)
+{
+	INC_DWORD_STAT_BY(STAT_TorchRays, InRays);
+	if (bEnabled)
+	{
+		Rays += InRays;
+		TickRays += InRays;
+	}
+}
+
+void FTorchProfiler::CountBytes(int64 InBytes)
+{
+	INC_DWORD_STAT_BY(STAT_TorchBytes, InBytes);
+	if (bEnabled)
+	{
+		Bytes += InBytes;
+		TickBytes += InBytes;
+	}
+}
+
+bool FTorchProfiler::StartTrace(const FString& Path, int32 InNumTicks)
+{
+	StopTrace();
+	TraceFile = IFileManager::Get().CreateFileWriter(*Path);
+	if (!TraceFile)
+	{
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot open trace file %s"), *Path);
+		return false;
+	}
+	SetEnabled(true);
+	TraceStartSeconds = FPlatformTime::Seconds();
+	TraceTicksRemaining = InNumTicks;
+	bTraceFirstEvent = true;
+	TraceBuffer = TEXT("{\"traceEvents\":[");
+	return true;
+}
+
+void FTorchProfiler::StopTrace()
+{
+	if (!TraceFile)
+	{
+		return;
+	}
+	TraceBuffer += TEXT("\n]}\n");
+	FlushTrace();
+	TraceFile->Close();
+	delete TraceFile;
+	TraceFile = NULL;
+}
+
+void FTorchProfiler::FlushTrace()
+{
+	FTCHARToUTF8 Utf8(*TraceBuffer);
+	TraceFile->Serialize((void*) Utf8.Get(), Utf8.Length());
+	TraceBuffer.Reset();
+}
@@ -0,0 +1,122 @@
+/**
+ * Copyright (c) 2015-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+DECLARE_STATS_GROUP(TEXT("UETorch"), STATGROUP_UETorch, STATCAT_Advanced);
+
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Torch Tick"), STAT_TorchTick, STATGROUP_UETorch, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Torch Tick Hooks"), STAT_TorchTickHooks, STATGROUP_UETorch, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Torch Lua GC"), STAT_TorchGC, STATGROUP_UETorch, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Torch Capture"), STAT_TorchCapture, STATGROUP_UETorch, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Torch Init Capture"), STAT_TorchInitCapture, STATGROUP_UETorch, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Torch Flush Rendering"), STAT_TorchFlushRendering, STATGROUP_UETorch, );
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Torch Rays Traced"), STAT_TorchRays, STATGROUP_UETorch, );
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Torch Bytes Written"), STAT_TorchBytes, STATGROUP_UETorch, );
+
+/** Aggregated timings of a profiler scope */
+struct FTorchProfileStat
+{
+	int64 Count;
+	double TotalSeconds;
+	double MaxSeconds;
+
+	FTorchProfileStat() : Count(0), TotalSeconds(0), MaxSeconds(0) {}
+};
+
+/**
+ * Aggregates the timings of the UETorch scopes (see TORCH_PROFILE_SCOPE) and
+ * the rays and bytes counters, and optionally streams them as a Chrome
+ * trace-event JSON file (chrome://tracing) for a window of ticks.
+ * The same scopes and counters also feed the engine's `stat UETorch`.
+ * Scopes and counters must only be used on the game thread.
+ */
+class FTorchProfiler
+{
+public:
+	static FTorchProfiler& Get();
+
+	FORCEINLINE bool IsEnabled() const { return bEnabled; }
+	void SetEnabled(bool bInEnabled);
+
+	/** Clears the aggregated stats and counters */
+	void Reset();
+
+	/** Marks the beginning of an engine frame; any number of contexts can call it in the same frame */
+	void BeginTick();
+
+	void AddScope(FName Name, double StartSeconds, double EndSeconds);
+	void CountRays(int64 Rays);
+	void CountBytes(int64 Bytes);
+
+	/** Streams the next NumTicks ticks (or all ticks until StopTrace if NumTicks <= 0) to Path */
+	bool StartTrace(const FString& Path, int32 NumTicks);
+	void StopTrace();
+	FORCEINLINE bool IsTracing() const { return TraceFile != NULL; }
+
+	const TMap<FName, FTorchProfileStat>& GetStats() const { return Stats; }
+	int64 GetNumTicks() const { return NumTicks; }
+	int64 GetRays() const { return Rays; }
+	int64 GetBytes() const { return Bytes; }
+
+private:
+	FTorchProfiler();
+
+	void EndTick();
+	void FlushTrace();
+
+	bool bEnabled;
+	TMap<FName, FTorchProfileStat> Stats;
+	int64 NumTicks;
+	int64 Rays;
+	int64 Bytes;
+
+	uint64 TickFrame;
+	int64 TickRays;
+	int64 TickBytes;
+
+	FArchive* TraceFile;
+	double TraceStartSeconds;
+	int32 TraceTicksRemaining;
+	bool bTraceFirstEvent;
+	FString TraceBuffer;
+};
+
+/** Times the enclosing scope under Name, if the profiler is enabled */
+class FTorchProfileScope
+{
+public:
+	FORCEINLINE FTorchProfileScope(FName InName)
+		: Name(InName)
+		, StartSeconds(FTorchProfiler::Get().IsEnabled() ? FPlatformTime::Seconds() : -1.0)
+	{
+	}
+
+	FORCEINLINE ~FTorchProfileScope()
+	{
+		if (StartSeconds >= 0)
+		{
+			FTorchProfiler::Get().AddScope(Name, StartSeconds, FPlatformTime::Seconds());
+		}
+	}
+
+private:
+	FName Name;
+	double StartSeconds;
+};
+
+/** Times the enclosing scope in the UETorch profiler under Name */
+#define TORCH_PROFILE_NAMED_SCOPE(Name) \
+	static const FName PREPROCESSOR_JOIN(TorchProfileName, __LINE__)(Name); \
+	FTorchProfileScope PREPROCESSOR_JOIN(TorchProfileScope, __LINE__)(PREPROCESSOR_JOIN(TorchProfileName, __LINE__))
+
+/** Times the enclosing scope in the UETorch profiler under Name, and in the engine stat Stat */
+#define TORCH_PROFILE_SCOPE(Name, Stat) \
+	SCOPE_CYCLE_COUNTER(Stat); \
+	TORCH_PROFILE_NAMED_SCOPE(Name)
@@ -0,0 +1,374 @@
+/**
+ * Copyright (c) 2015-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "UETorchPrivatePCH.h"
+#include "TorchRecorder.h"
+
+static const uint32 LogMagic = 0x43525455; // "UTRC"
+static const uint32 LogVersion = 1;
+
+// write the log to the file every few KB rather than at every tick
+static const int32 LogFlushSize = 64 * 1024;
+
+FTorchRecorder& FTorchRecorder::Get()
+{
+	static FTorchRecorder Recorder;
+	return Recorder;
+}
+
+FTorchRecorder::FTorchRecorder()
+	: Writer(NULL)
+	, NumTicks(0)
+	, ReplayOffset(INDEX_NONE)
+{
+}
+
+bool FTorchRecorder::StartRecording(const FString& Path, float DeltaTime)
+{
+	StopRecording();
+	if (IsReplaying())
+	{
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot record during a replay"));
+		return false;
+	}
+	Writer = IFileManager::Get().CreateFileWriter(*Path);
+	if (!Writer)
+	{
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot open log file %s"), *Path);
+		return false;
+	}
+	StringIds.Reset();
+	NumTicks = 0;
+	Buffer.Reset();
+	FMemoryWriter Ar(Buffer, false, true);
+	uint32 Magic = LogMagic;
+	uint32 Version = LogVersion;
+	Ar << Magic << Version;
+	// scripts start recording in the middle of a tick: its records belong to
+	// this first tick, rather than preceding any tick
+	RecordTick(DeltaTime);
+	return true;
+}
+
+void FTorchRecorder::StopRecording()
+{
+	if (!Writer)
+	{
+		return;
+	}
+	Flush();
+	Writer->Close();
+	delete Writer;
+	Writer = NULL;
+}
+
+void FTorchRecorder::Flush()
+{
+	Writer->Serialize(Buffer.GetData(), Buffer.Num());
+	Buffer.Reset();
+}
+
+int32 FTorchRecorder::GetStringId(const FString& String)
+{
+	if (const int32* Id = StringIds.Find(String))
+	{
+		return *Id;
+	}
+	int32 Id = StringIds.Num();
+	StringIds.Add(String, Id);
+	FMemoryWriter Ar(Buffer, false, true);
+	uint8 Type = (uint8) ETorchRecord::String;
+	FString Value = String;
+	Ar << Type << Id << Value;
+	return Id;
+}
+
+int32 FTorchRecorder::GetActorId(const AActor* Actor)
+{
+	// actors of streamed levels (e.g. simulation environments) may share names,
+	// so they are qualified with the package of their level
+	const ULevel* Level = Actor->GetLevel();
+	const UWorld* World = Actor->GetWorld();
+	if (Level != NULL && World != NULL && Level != World->PersistentLevel)
+	{
+		return GetStringId(Level->GetOutermost()->GetName() + TEXT(":") + Actor->GetName());
+	}
+	return GetStringId(Actor->GetName());
+}
+
+void FTorchRecorder::RecordTick(float DeltaTime)
+{
+	if (!Writer)
+	{
+		return;
+	}
+	if (Buffer.Num() >= LogFlushSize)
+	{
+		Flush();
+	}
+	FMemoryWriter Ar(Buffer, false, true);
+	uint8 Type = (uint8) ETorchRecord::Tick;
+	Ar << Type << DeltaTime;
+	NumTicks++;
+}
+
+void FTorchRecorder::RecordKey(const FString& Key, int32 ControllerId, uint8 EventType)
+{
+	if (!Writer)
+	{
+		return;
+	}
+	int32 KeyId = GetStringId(Key);
+	FMemoryWriter Ar(Buffer, false, true);
+	uint8 Type = (uint8) ETorchRecord::Key;
+	Ar << Type << KeyId << ControllerId << EventType;
+}
+
+void FTorchRecorder::RecordMouse(int32 X, int32 Y)
+{
+	if (!Writer)
+	{
+		return;
+	}
+	FMemoryWriter Ar(Buffer, false, true);
+	uint8 Type = (uint8) ETorchRecord::Mouse;
+	Ar << Type << X << Y;
+}
+
+static void SerializeValues(FArchive& Ar, const float* Values, int32 NumValues)
+{
+	uint8 Num = (uint8) NumValues;
+	Ar << Num;
+	Ar.Serialize((void*) Values, Num * sizeof(float));
+}
+
+void FTorchRecorder::RecordActorOp(ETorchActorOp Op, const AActor* Actor, int32 Arg, const float* Values, int32 NumValues)
+{
+	if (!Writer)
+	{
+		return;
+	}
+	int32 ActorId = GetActorId(Actor);
+	FMemoryWriter Ar(Buffer, false, true);
+	uint8 Type = (uint8) ETorchRecord::ActorOp;
+	uint8 OpCode = (uint8) Op;
+	Ar << Type << OpCode << ActorId << Arg;
+	SerializeValues(Ar, Values, NumValues);
+}
+
+void FTorchRecorder::RecordMaterial(const AActor* Actor, const UObject* Material)
+{
+	if (!Writer)
+	{
+		return;
+	}
+	RecordActorOp(ETorchActorOp::Material, Actor, GetStringId(Material->GetPathName()), NULL, 0);
+}
+
+void FTorchRecorder::RecordSpawn(const AActor* Actor, const FString& MeshPath, int32 Arg, const float* Values, int32 NumValues)
+{
+	if (!Writer)
+	{
+		return;
+	}
+	int32 ActorId = GetActorId(Actor);
+	int32 MeshId = GetStringId(MeshPath);
+	FMemoryWriter Ar(Buffer, false, true);
+	uint8 Type = (uint8) ETorchRecord::Spawn;
+	Ar << Type << ActorId << MeshId << Arg;
+	SerializeValues(Ar, Values, NumValues);
+}
+
+void FTorchRecorder::RecordDestroy(const AActor* Actor)
+{
+	if (!Writer)
+	{
+		return;
+	}
+	int32 ActorId = GetActorId(Actor);
+	FMemoryWriter Ar(Buffer, false, true);
+	uint8 Type = (uint8) ETorchRecord::Destroy;
+	Ar << Type << ActorId;
+}
+
+void FTorchRecorder::RecordConsoleCommand(const FString& Command)
+{
+	if (!Writer)
+	{
+		return;
+	}
+	int32 CommandId = GetStringId(Command);
+	FMemoryWriter Ar(Buffer, false, true);
+	uint8 Type = (uint8) ETorchRecord::Console;
+	Ar << Type << CommandId;
+}
+
+bool FTorchRecorder::StartReplay(const FString& Path)
+{
+	StopReplay();
+	if (IsRecording())
+	{
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot replay during a recording"));
+		return false;
+	}
+	if (!FFileHelper::LoadFileToArray(Log, *Path))
+	{
+		UE_LOG(LogScriptPlugin, Warning, TEXT("Cannot read log file %s"), *Path);
+		return false;
+	}
+	FMemoryReader Ar(Log, true);
+	uint32 Magic = 0;
+	uint32 Version = 0;
+	Ar << Magic << Version;
+	if (Ar.IsError() || Magic != LogMagic || Version != LogVersion)
+	{
+		UE_LOG(LogScriptPlugin, Warning, TEXT("%s is not a UETorch log (version %u)"), *Path, LogVersion);
+		Log.Empty();
+		return false;
+	}
+	ReplayOffset = Ar.Tell();
+	ReplayStrings.Reset();
+	ReplayActors.Reset();
+	NumTicks = 0;
+	return true;
+}
+
+void FTorchRecorder::StopReplay()
+{
+	Log.Empty();
+	ReplayOffset = INDEX_NONE;
+	ReplayStrings.Reset();
+	ReplayActors.Reset();
+}
+
+bool FTorchRecorder::ReadEvent(FTorchReplayEvent& Event)
+{
+	if (!IsReplaying())
+	{
+		return false;
+	}
+	FMemoryReader Ar(Log, true);
+	Ar.Seek(ReplayOffset);
+	while (!Ar.AtEnd())
+	{
+		uint8 Type = 0;
+		Ar << Type;
+		Event.Type = (ETorchRecord) Type;
+		Event.Values.Reset();
+		switch (Event.Type)
+		{
+		case ETorchRecord::String:
+		{
+			int32 Id = 0;
+			FString Value;
+			Ar << Id << Value;
+			if (Id >= ReplayStrings.Num())
+			{
+				ReplayStrings.SetNum(Id + 1);
+			}
+			ReplayStrings[Id] = Value;
+			continue;
+		}
+		case ETorchRecord::Tick:
+			Ar << Event.DeltaTime;
+			NumTicks++;
+			break;
+		case ETorchRecord::Key:
+		{
+			int32 KeyId = 0;
+			Ar << KeyId << Event.ControllerId << Event.EventType;
+			Event.String = GetReplayString(KeyId);
+			break;
+		}
+		case ETorchRecord::Mouse:
+			Ar << Event.X << Event.Y;
+			break;
+		case ETorchRecord::ActorOp:
+		case ETorchRecord::Spawn:
+		{
+			if (Event.Type == ETorchRecord::ActorOp)
+			{
+				uint8 Op = 0;
+				Ar << Op << Event.Actor << Event.Arg;
+				Event.Op = (ETorchActorOp) Op;
+			}
+			else
+			{
+				int32 MeshId = 0;
+				Ar << Event.Actor << MeshId << Event.Arg;
+				Event.String = GetReplayString(MeshId);
+			}
+			uint8 Num = 0;
+			Ar << Num;
+			Event.Values.SetNumUninitialized(Num);
+			Ar.Serialize(Event.Values.GetData(), Num * sizeof(float));
+			break;
+		}
+		case ETorchRecord::Destroy:
+			Ar << Event.Actor;
+			break;
+		case ETorchRecord::Console:
+		{
+			int32 CommandId = 0;
+			Ar << CommandId;
+			Event.String = GetReplayString(CommandId);
+			break;
+		}
+		default:
+			UE_LOG(LogScriptPlugin, Warning, TEXT("Corrupt UETorch log (record type %d)"), Type);
+			ReplayOffset = Log.Num();
+			return false;
+		}
+		if (Ar.IsError())
+		{
+			UE_LOG(LogScriptPlugin, Warning, TEXT("Truncated UETorch log"));
+			ReplayOffset = Log.Num();
+			return false;
+		}
+		ReplayOffset = Ar.Tell();
+		return true;
+	}
+	ReplayOffset = Log.Num();
+	return false;
+}
+
+bool FTorchRecorder::IsAtTick() const
+{
+	return !IsReplaying() || ReplayOffset >= Log.Num() || Log[ReplayOffset] == (uint8) ETorchRecord::Tick;
+}
+
+float FTorchRecorder::PeekTickDeltaTime() const
+{
+	if (!IsReplaying() || ReplayOffset + 1 + (int32) sizeof(float) > Log.Num() || Log[ReplayOffset] != (uint8) ETorchRecord::Tick)
+	{
+		return 0;
+	}
+	FMemoryReader Ar(Log, true);
+	Ar.Seek(ReplayOffset + 1);
+	float DeltaTime = 0;
+	Ar << DeltaTime;
+	return DeltaTime;
+}
+
+const FString& FTorchRecorder::GetReplayString(int32 Id) const
+{
+	static const FString Empty;
+	return ReplayStrings.IsValidIndex(Id) ? ReplayStrings[Id] : Empty;
+}
+
+AActor* FTorchRecorder::GetReplayActor(int32 Id) const
+{
+	const TWeakObjectPtr<AActor>* Actor = ReplayActors.Find(Id);
+	return Actor ? Actor->Get() : NULL;
+}
+
+void FTorchRecorder::SetReplayActor(int32 Id, AActor* Actor)
+{
+	ReplayActors.Add(Id, Actor);
+}
@@ -0,0 +1,119 @@
+/**
+ * Copyright (c) 2015-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+/** The record types of a replay log */
+enum class ETorchRecord : uint8
+{
+	Tick = 1,       // DeltaTime; starts the records of a tick
+	String = 2,     // Id, String; defines a string used by the next records
+	Key = 3,        // key name id, ControllerId, EventType
+	Mouse = 4,      // X, Y
+	ActorOp = 5,    // Op, actor name id, Arg, Values
+	Spawn = 6,      // actor name id, mesh path id, Arg (relative, physics), Values (pose, scale)
+	Destroy = 7,    // actor name id
+	Console = 8,    // command id
+};
+
+/** The actor mutations of ActorOp records; Values hold the function arguments */
+enum class ETorchActorOp : uint8
+{
+	Location = 1,
+	Rotation = 2,
+	LocationAndRotation = 3,
+	Visible = 4,
+	Velocity = 5,
+	AngularVelocity = 6,
+	Scale = 7,
+	Force = 8,
+	Material = 9,   // Arg is the material path id
+	State = 10,     // Arg is the SetActorsState fields
+};
+
+/** A record read back from a replay log */
+struct FTorchReplayEvent
+{
+	ETorchRecord Type;
+	float DeltaTime;
+	ETorchActorOp Op;
+	int32 Actor;
+	int32 Arg;
+	int32 ControllerId;
+	uint8 EventType;
+	int32 X;
+	int32 Y;
+	FString String;
+	TArray<float> Values;
+};
+
+/**
+ * Records the inputs and the actor mutations made through the plugin in a
+ * compact binary log, one group of records per tick, and reads them back
+ * for a replay. Actors are identified by name (qualified by the package of
+ * their level, for streamed levels), so that a log can be replayed in a new
+ * session; strings (names, keys, paths) are written once and then
+ * referred to by id.
+ */
+class FTorchRecorder
+{
+public:
+	static FTorchRecorder& Get();
+
+	/** Starts a log, whose first tick is the current one, of length DeltaTime */
+	bool StartRecording(const FString& Path, float DeltaTime);
+	void StopRecording();
+	FORCEINLINE bool IsRecording() const { return Writer != NULL; }
+
+	void RecordTick(float DeltaTime);
+	void RecordKey(const FString& Key, int32 ControllerId, uint8 EventType);
+	void RecordMouse(int32 X, int32 Y);
+	void RecordActorOp(ETorchActorOp Op, const AActor* Actor, int32 Arg, const float* Values, int32 NumValues);
+	void RecordMaterial(const AActor* Actor, const UObject* Material);
+	void RecordSpawn(const AActor* Actor, const FString& MeshPath, int32 Arg, const float* Values, int32 NumValues);
+	void RecordDestroy(const AActor* Actor);
+	void RecordConsoleCommand(const FString& Command);
+
+	bool StartReplay(const FString& Path);
+	void StopReplay();
+	FORCEINLINE bool IsReplaying() const { return ReplayOffset != INDEX_NONE; }
+
+	/** Reads the next record (other than String) into Event; returns false at the end of the log */
+	bool ReadEvent(FTorchReplayEvent& Event);
+	/** Returns true if the next record is a Tick, or the log is over */
+	bool IsAtTick() const;
+	/** Returns the DeltaTime of the next Tick record, or 0 at the end of the log */
+	float PeekTickDeltaTime() const;
+
+	const FString& GetReplayString(int32 Id) const;
+	/** The actor bound to an actor name id during the replay (e.g. a spawned actor), or NULL */
+	AActor* GetReplayActor(int32 Id) const;
+	void SetReplayActor(int32 Id, AActor* Actor);
+
+	int64 GetNumTicks() const { return NumTicks; }
+
+private:
+	FTorchRecorder();
+
+	int32 GetStringId(const FString& String);
+	int32 GetActorId(const AActor* Actor);
+	void Flush();
+
+	// recording
+	FArchive* Writer;
+	TArray<uint8> Buffer;
+	TMap<FString, int32> StringIds;
+	int64 NumTicks;
+
+	// replay
+	TArray<uint8> Log;
+	int32 ReplayOffset;
+	TArray<FString> ReplayStrings;
+	TMap<int32, TWeakObjectPtr<AActor>> ReplayActors;
+};
@@ -9,9 +9,33 @@
 
 #include "UETorchPrivatePCH.h"
 #include "TorchPluginComponent.h"
+#include "ActorRegistry.h"
+#include "TorchProfiler.h"
+#include "TorchRecorder.h"
 #include "Kismet/KismetSystemLibrary.h"
 #include "SceneViewport.h"
+#include "EngineUtils.h"
+#include "Components/SceneCaptureComponent2D.h"
+#include "Engine/TextureRenderTarget2D.h"
+#include "Engine/StaticMeshActor.h"
+#include "Engine/CollisionProfile.h"
+#include "Engine/LevelStreamingKismet.h"
+#include "Async/ParallelFor.h"
 #include <type_traits>
+#include <limits>
+#include <initializer_list>
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS && !PLATFORM_ENABLE_VECTORINTRINSICS_NEON
+#include <emmintrin.h>
+// _mm_shuffle_epi8 needs SSSE3, which is only assumed when the compiler targets it
+#if defined(__SSSE3__) || defined(__AVX__)
+#define UETORCH_ENABLE_SSSE3 1
+#include <tmmintrin.h>
+#endif
+#endif
+#ifndef UETORCH_ENABLE_SSSE3
+#define UETORCH_ENABLE_SSSE3 0
+#endif
 
 
 class FUETorch : public IUETorch
@@ -49,6 +73,106 @@ extern "C" UETORCH_API AActor *FindActor(const char *fullName) {
     return Result;
 }
 
+// Returns the actor registry, indexing the world of _this if needed
+FActorRegistry* GetActorRegistry(UObject* _this)
+{
+	UWorld *World = GEngine->GetWorldFromContextObject(_this);
+	if(World == NULL) {
+		printf("World null\n");
+		return NULL;
+	}
+	FActorRegistry& Registry = FActorRegistry::Get();
+	Registry.Update(World);
+	return &Registry;
+}
+
+/**
+ * Look up an actor of the current world by name, in constant time.
+ *
+ * @param _this the TorchPluginComponent
+ * @param name the ID name of the actor
+ * @returns the actor, or NULL if there is none with this name
+ */
+extern "C" UETORCH_API AActor* GetActorByName(UObject* _this, const char* name)
+{
+	FActorRegistry* Registry = GetActorRegistry(_this);
+	return Registry ? Registry->FindByName(FName(name)) : NULL;
+}
+
+// Copies up to maxActors (if positive) of Actors to actors, and returns the total number of actors
+static int CopyActorHandles(const TArray<AActor*>& Actors, AActor** actors, int maxActors)
+{
+	FMemory::Memcpy(actors, Actors.GetData(), FMath::Clamp(maxActors, 0, Actors.Num()) * sizeof(AActor*));
+	return Actors.Num();
+}
+
+/**
+ * Find the actors of the current world of a given class, including subclasses.
+ *
+ * @param _this the TorchPluginComponent
+ * @param className the name of the class, e.g. StaticMeshActor or MyBlueprint_C
+ * @param actors an array of maxActors Actor* pointers, filled with the actors
+ * @param maxActors size of the actors array
+ * @returns the number of actors of this class, which may be more than maxActors,
+ *          or -1 if the class doesn't exist
+ */
+extern "C" UETORCH_API int GetActorsByClass(UObject* _this, const char* className, AActor** actors, int maxActors)
+{
+	FActorRegistry* Registry = GetActorRegistry(_this);
+	if (Registry == NULL) {
+		return -1;
+	}
+	UClass* Class = FindObject<UClass>(ANY_PACKAGE, *FString(className));
+	if (Class == NULL) {
+		printf("Class %s not found\n", className);
+		return -1;
+	}
+	TArray<AActor*> Actors;
+	Registry->FindByClass(Class, Actors);
+	return CopyActorHandles(Actors, actors, maxActors);
+}
+
+/**
+ * Find the actors of the current world with a given tag.
+ *
+ * @param _this the TorchPluginComponent
+ * @param tag the tag
+ * @param actors an array of maxActors Actor* pointers, filled with the actors
+ * @param maxActors size of the actors array
+ * @returns the number of actors with this tag, which may be more than maxActors,
+ *          or -1 on failure
+ */
+extern "C" UETORCH_API int GetActorsByTag(UObject* _this, const char* tag, AActor** actors, int maxActors)
+{
+	FActorRegistry* Registry = GetActorRegistry(_this);
+	if (Registry == NULL) {
+		return -1;
+	}
+	TArray<AActor*> Actors;
+	Registry->FindByTag(FName(tag), Actors);
+	return CopyActorHandles(Actors, actors, maxActors);
+}
+
+/**
+ * Check that an actor handle is still valid, i.e. that the actor was not destroyed.
+ * Handles are only checked once the registry has indexed a world
+ * (see GetActorByName, GetActorsByClass and GetActorsByTag).
+ */
+extern "C" UETORCH_API bool IsActorValid(const AActor* actor)
+{
+	return FActorRegistry::Get().IsValid(actor);
+}
+
+// Records an actor mutation made through the plugin, if a recording is in
+// progress (see StartRecording)
+static void RecordActorOp(ETorchActorOp Op, const AActor* Actor, std::initializer_list<float> Values, int32 Arg = 0)
+{
+	FTorchRecorder& Recorder = FTorchRecorder::Get();
+	if (Recorder.IsRecording()) {
+		Recorder.RecordActorOp(Op, Actor, Arg, Values.begin(), (int32) Values.size());
+	}
+}
+
 /**
  * Simulate a user input event (press or relese a key).
  *
@@ -62,6 +186,9 @@ extern "C" UETORCH_API AActor *FindActor(const char *fullName) {
  */
  extern "C" UETORCH_API void PressKey(UObject* _this, const char *key, int ControllerId, int eventType) {
 	auto fKey = FKey(key);
+	if (FTorchRecorder::Get().IsRecording()) {
+		FTorchRecorder::Get().RecordKey(key, ControllerId, (uint8) eventType);
+	}
 
 	auto PlayerController = UGameplayStatics::GetPlayerController(_this, 0);
 	if(PlayerController == NULL) {
@@ -102,6 +229,96 @@ extern "C" UETORCH_API bool SetTickDeltaBounds(UObject* _this, float MinDeltaSec
 	return true;
 }
 
+// The engine settings overridden by SetLockstep, restored when it is disabled
+struct FLockstepSettings {
+	bool bEnabled;
+	bool bUseFixedTimeStep;
+	double FixedDeltaTime;
+	bool bSmoothFrameRate;
+	bool bUseFixedFrameRate;
+	float MaxFPS;
+	int32 VSync;
+	float MinUndilatedFrameTime;
+	float MaxUndilatedFrameTime;
+};
+
+static FLockstepSettings GLockstepSettings = { false };
+
+static void SetConsoleVariable(const TCHAR* Name, float Value, float* OutPrevious)
+{
+	IConsoleVariable* Variable = IConsoleManager::Get().FindConsoleVariable(Name);
+	if (Variable) {
+		if (OutPrevious) {
+			*OutPrevious = Variable->GetFloat();
+		}
+		Variable->Set(Value);
+	}
+}
+
+/**
+ * Run the game in lockstep: every tick advances the game time by exactly dt,
+ * and ticks run back to back as fast as the CPU allows, without real-time
+ * throttling (fixed time step, no frame rate smoothing, no frame rate cap
+ * and no vsync). Unlike SetTickDeltaBounds alone, the engine doesn't wait
+ * for real time to catch up with the game.
+ *
+ * @param _this the TorchPluginComponent
+ * @param enabled true to enable lockstep, false to restore the previous settings
+ * @param dt the game time per tick, in seconds
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool SetLockstep(UObject* _this, bool enabled, float dt)
+{
+	UWorld *world = GEngine->GetWorldFromContextObject(_this);
+	if(world == NULL) {
+		printf("World null\n");
+		return false;
+	}
+	AWorldSettings *settings = world->GetWorldSettings();
+	if(settings == NULL) {
+		printf("WorldSettings null\n");
+		return false;
+	}
+	if (enabled && dt <= 0) {
+		printf("Lockstep dt must be positive\n");
+		return false;
+	}
+
+	FLockstepSettings& Saved = GLockstepSettings;
+	if (enabled) {
+		if (!Saved.bEnabled) {
+			Saved.bUseFixedTimeStep = FApp::UseFixedTimeStep();
+			Saved.FixedDeltaTime = FApp::GetFixedDeltaTime();
+			Saved.bSmoothFrameRate = GEngine->bSmoothFrameRate;
+			Saved.bUseFixedFrameRate = GEngine->bUseFixedFrameRate;
+			Saved.MinUndilatedFrameTime = settings->MinUndilatedFrameTime;
+			Saved.MaxUndilatedFrameTime = settings->MaxUndilatedFrameTime;
+			float VSync = 0;
+			SetConsoleVariable(TEXT("t.MaxFPS"), 0, &Saved.MaxFPS);
+			SetConsoleVariable(TEXT("r.VSync"), 0, &VSync);
+			Saved.VSync = (int32) VSync;
+			Saved.bEnabled = true;
+		}
+		FApp::SetUseFixedTimeStep(true);
+		FApp::SetFixedDeltaTime(dt);
+		GEngine->bSmoothFrameRate = false;
+		GEngine->bUseFixedFrameRate = false;
+		settings->MinUndilatedFrameTime = dt;
+		settings->MaxUndilatedFrameTime = dt;
+	} else if (Saved.bEnabled) {
+		FApp::SetUseFixedTimeStep(Saved.bUseFixedTimeStep);
+		FApp::SetFixedDeltaTime(Saved.FixedDeltaTime);
+		GEngine->bSmoothFrameRate = Saved.bSmoothFrameRate;
+		GEngine->bUseFixedFrameRate = Saved.bUseFixedFrameRate;
+		settings->MinUndilatedFrameTime = Saved.MinUndilatedFrameTime;
+		settings->MaxUndilatedFrameTime = Saved.MaxUndilatedFrameTime;
+		SetConsoleVariable(TEXT("t.MaxFPS"), Saved.MaxFPS, NULL);
+		SetConsoleVariable(TEXT("r.VSync"), Saved.VSync, NULL);
+		Saved.bEnabled = false;
+	}
+	return true;
+}
+
 typedef struct {
 	int32 X;
 	int32 Y;
@@ -137,6 +354,9 @@ extern "C" UETORCH_API void GetViewportSize(IntSize* r)
  */
 extern "C" UETORCH_API void SetMouse(int x, int y)
 {
+	if (FTorchRecorder::Get().IsRecording()) {
+		FTorchRecorder::Get().RecordMouse(x, y);
+	}
 	if(GEngine == NULL){
 		printf("GEngine null\n");
 		return;
@@ -154,17 +374,24 @@ extern "C" UETORCH_API void SetMouse(int x, int y)
 }
 
 
-/**
- * Capture a screenshot from this actor's viewport.
- *
- * @param size the size of the viewport.
- * @param data a float array of 3 * size->X * size->Y elements.
- *             This array is filled with the screenshot data in [Y,X,color] order.
- * @returns true if successful
- */
-extern "C" UETORCH_API bool CaptureScreenshot(IntSize* size, void* data)
+// FlushRenderingCommands, timed by the profiler
+static void FlushCaptureRenderingCommands()
 {
+	TORCH_PROFILE_SCOPE("FlushRenderingCommands", STAT_TorchFlushRendering);
 	FlushRenderingCommands();
+}
+
+// Counts the rays traced and the bytes written by a capture in the profiler
+static void CountCapture(int64 Rays, int64 Bytes)
+{
+	FTorchProfiler::Get().CountRays(Rays);
+	FTorchProfiler::Get().CountBytes(Bytes);
+}
+
+// Reads the viewport image into Bitmap, in [Y,X] order
+bool ReadViewportBitmap(const IntSize* size, TArray<FColor>& Bitmap)
+{
+	FlushCaptureRenderingCommands();
 
 	if(GEngine == NULL){
 		printf("GEngine null\n");
@@ -180,7 +407,6 @@ extern "C" UETORCH_API bool CaptureScreenshot(IntSize* size, void* data)
 	}
 
 	FViewport* Viewport = GEngine->GameViewport->Viewport;
-	TArray<FColor> Bitmap;
 
 	if (size->X != Viewport->GetSizeXY().X || size->Y != Viewport->GetSizeXY().Y) {
 		return false;
@@ -202,81 +428,272 @@ extern "C" UETORCH_API bool CaptureScreenshot(IntSize* size, void* data)
 		bScreenshotSuccessful = GetViewportScreenShot(Viewport, Bitmap, SizeRect);
 	}
 
-	if (bScreenshotSuccessful)
-	{
-		if (Bitmap.Num() != size->X * size->Y) {
-			printf("Screenshot bitmap had the wrong number of elements: %d\n", Bitmap.Num());
-			return false;
-		}
-		float* values = (float*) data;
-		for (const FColor& color : Bitmap) {
-			*values++ = color.R / 255.0f;
-		}
-		for (const FColor& color : Bitmap) {
-			*values++ = color.G / 255.0f;
-		}
-		for (const FColor& color : Bitmap) {
-			*values++ = color.B / 255.0f;
-		}
+	if (bScreenshotSuccessful && Bitmap.Num() != size->X * size->Y) {
+		printf("Screenshot bitmap had the wrong number of elements: %d\n", Bitmap.Num());
+		return false;
 	}
-
 	return bScreenshotSuccessful;
 }
 
-// Looks up the player's SceneView object
-// modeled after APlayerController::GetHitResultAtScreenPosition
-FSceneView* GetSceneView(APlayerController* PlayerController, UWorld* World) {
-	if(GEngine == NULL){
-		printf("GEngine null\n");
-		return NULL;
+// Layouts for the byte screenshot functions
+enum EScreenshotLayout {
+	SCREENSHOT_CHW = 0,
+	SCREENSHOT_HWC = 1,
+};
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS && !PLATFORM_ENABLE_VECTORINTRINSICS_NEON
+// Extracts the byte at Shift from each of 16 FColors (4 per register)
+template<int Shift>
+FORCEINLINE __m128i DeinterleaveColorChannel(const __m128i& P0, const __m128i& P1, const __m128i& P2, const __m128i& P3)
+{
+	const __m128i Mask = _mm_set1_epi32(0xFF);
+	const __m128i Lo = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(P0, Shift), Mask), _mm_and_si128(_mm_srli_epi32(P1, Shift), Mask));
+	const __m128i Hi = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(P2, Shift), Mask), _mm_and_si128(_mm_srli_epi32(P3, Shift), Mask));
+	return _mm_packus_epi16(Lo, Hi);
+}
+#endif
+
+// Splits Bitmap into R, G and B planes of N bytes each, in a single pass
+void DeinterleaveBitmapCHW(const FColor* Colors, int32 N, uint8* R, uint8* G, uint8* B)
+{
+	int32 i = 0;
+#if PLATFORM_ENABLE_VECTORINTRINSICS && !PLATFORM_ENABLE_VECTORINTRINSICS_NEON
+	// FColor is stored as BGRA, i.e. B | G << 8 | R << 16 | A << 24
+	static_assert(sizeof(FColor) == 4, "FColor should be 4 bytes");
+	for (; i + 16 <= N; i += 16) {
+		const __m128i* Src = (const __m128i*) (Colors + i);
+		const __m128i P0 = _mm_loadu_si128(Src);
+		const __m128i P1 = _mm_loadu_si128(Src + 1);
+		const __m128i P2 = _mm_loadu_si128(Src + 2);
+		const __m128i P3 = _mm_loadu_si128(Src + 3);
+		_mm_storeu_si128((__m128i*) (R + i), DeinterleaveColorChannel<16>(P0, P1, P2, P3));
+		_mm_storeu_si128((__m128i*) (G + i), DeinterleaveColorChannel<8>(P0, P1, P2, P3));
+		_mm_storeu_si128((__m128i*) (B + i), DeinterleaveColorChannel<0>(P0, P1, P2, P3));
+	}
+#endif
+	for (; i < N; i++) {
+		R[i] = Colors[i].R;
+		G[i] = Colors[i].G;
+		B[i] = Colors[i].B;
 	}
-	if(GEngine->GameViewport == NULL){
-		printf("GameViewport null\n");
-		return NULL;
+}
+
+// Packs the R, G and B bytes of N colors into RGB, 3 bytes per pixel
+void PackBitmapHWC(const FColor* Colors, int32 N, uint8* RGB)
+{
+	int32 i = 0;
+#if UETORCH_ENABLE_SSSE3
+	static_assert(sizeof(FColor) == 4, "FColor should be 4 bytes");
+	// moves the RGB bytes of 4 BGRA colors to the low 12 bytes, and zeroes the rest
+	const __m128i Shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	for (; i + 16 <= N; i += 16) {
+		const __m128i* Src = (const __m128i*) (Colors + i);
+		const __m128i P0 = _mm_shuffle_epi8(_mm_loadu_si128(Src), Shuffle);
+		const __m128i P1 = _mm_shuffle_epi8(_mm_loadu_si128(Src + 1), Shuffle);
+		const __m128i P2 = _mm_shuffle_epi8(_mm_loadu_si128(Src + 2), Shuffle);
+		const __m128i P3 = _mm_shuffle_epi8(_mm_loadu_si128(Src + 3), Shuffle);
+		// concatenates the 4 x 12 bytes into 48 bytes
+		__m128i* Dst = (__m128i*) (RGB + 3 * i);
+		_mm_storeu_si128(Dst, _mm_or_si128(P0, _mm_slli_si128(P1, 12)));
+		_mm_storeu_si128(Dst + 1, _mm_or_si128(_mm_srli_si128(P1, 4), _mm_slli_si128(P2, 8)));
+		_mm_storeu_si128(Dst + 2, _mm_or_si128(_mm_srli_si128(P2, 8), _mm_slli_si128(P3, 4)));
+	}
+#endif
+	for (; i < N; i++) {
+		RGB[3 * i]     = Colors[i].R;
+		RGB[3 * i + 1] = Colors[i].G;
+		RGB[3 * i + 2] = Colors[i].B;
 	}
-	if(GEngine->GameViewport->Viewport == NULL){
-		printf("Viewport null\n");
-		return NULL;
+}
+
+// Writes Bitmap as float planes in a single pass, mapping each channel byte through its lookup table
+void ConvertBitmapToFloatCHW(const TArray<FColor>& Bitmap, const float* LutR, const float* LutG, const float* LutB, float* values)
+{
+	const int32 N = Bitmap.Num();
+	float* R = values;
+	float* G = values + N;
+	float* B = values + 2 * N;
+	for (int32 i = 0; i < N; i++) {
+		const FColor& color = Bitmap[i];
+		R[i] = LutR[color.R];
+		G[i] = LutG[color.G];
+		B[i] = LutB[color.B];
 	}
+}
 
-	auto Viewport = GEngine->GameViewport->Viewport;
+// Output formats for screenshot bitmaps
+enum EScreenshotFormat {
+	SCREENSHOT_FLOAT_CHW = 0,
+	SCREENSHOT_BYTE_CHW = 1,
+	SCREENSHOT_BYTE_HWC = 2,
+};
 
-	// Create a view family for the game viewport
-	static TSharedPtr<FSceneViewFamilyContext> ViewFamily;
-	ViewFamily = MakeShareable(new FSceneViewFamilyContext(
-		FSceneViewFamily::ConstructionValues(
-			Viewport,
-			World->Scene,
-			GEngine->GameViewport->EngineShowFlags )
-		.SetRealtimeUpdate(true) ) );
+// Writes a screenshot bitmap to data in one of the EScreenshotFormat formats;
+// floats are in [0,1].
+void WriteScreenshotBitmap(const TArray<FColor>& Bitmap, void* data, int format)
+{
+	const int32 N = Bitmap.Num();
+	if (format == SCREENSHOT_FLOAT_CHW) {
+		static float Lut[256];
+		static bool bLutInitialized = false;
+		if (!bLutInitialized) {
+			for (int v = 0; v < 256; v++) {
+				Lut[v] = v / 255.0f;
+			}
+			bLutInitialized = true;
+		}
+		ConvertBitmapToFloatCHW(Bitmap, Lut, Lut, Lut, (float*) data);
+	} else if (format == SCREENSHOT_BYTE_HWC) {
+		PackBitmapHWC(Bitmap.GetData(), N, (uint8*) data);
+	} else {
+		uint8* values = (uint8*) data;
+		DeinterleaveBitmapCHW(Bitmap.GetData(), N, values, values + N, values + 2 * N);
+	}
+	CountCapture(0, (int64) N * 3 * (format == SCREENSHOT_FLOAT_CHW ? sizeof(float) : 1));
+}
+
+/**
+ * Capture a screenshot from this actor's viewport.
+ *
+ * @param size the size of the viewport.
+ * @param data a float array of 3 * size->X * size->Y elements.
+ *             This array is filled with the screenshot data in [color,Y,X] order,
+ *             with values in [0,1].
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool CaptureScreenshot(IntSize* size, void* data)
+{
+	TORCH_PROFILE_SCOPE("CaptureScreenshot", STAT_TorchCapture);
+	TArray<FColor> Bitmap;
+	if (!ReadViewportBitmap(size, Bitmap)) {
+		return false;
+	}
 
+	WriteScreenshotBitmap(Bitmap, data, SCREENSHOT_FLOAT_CHW);
+	return true;
+}
 
-	// Calculate a view where the player is to update the streaming from the players start location
-	FVector ViewLocation;
-	FRotator ViewRotation;
-	ULocalPlayer* LocalPlayer = Cast<ULocalPlayer>(PlayerController->Player);
-	if (LocalPlayer == NULL) {
-		return NULL;
+/**
+ * Capture a screenshot from this actor's viewport as 8-bit RGB.
+ *
+ * @param size the size of the viewport.
+ * @param data a byte array of 3 * size->X * size->Y elements.
+ * @param layout SCREENSHOT_CHW to fill data in [color,Y,X] order,
+ *               or SCREENSHOT_HWC to fill it in [Y,X,color] order.
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool CaptureScreenshotBytes(IntSize* size, void* data, int layout)
+{
+	TORCH_PROFILE_SCOPE("CaptureScreenshotBytes", STAT_TorchCapture);
+	TArray<FColor> Bitmap;
+	if (!ReadViewportBitmap(size, Bitmap)) {
+		return false;
 	}
-	FSceneView* SceneView = LocalPlayer->CalcSceneView( ViewFamily.Get(), /*out*/ ViewLocation, /*out*/ ViewRotation, Viewport );
-	return SceneView;
+
+	WriteScreenshotBitmap(Bitmap, data, layout == SCREENSHOT_HWC ? SCREENSHOT_BYTE_HWC : SCREENSHOT_BYTE_CHW);
+	return true;
 }
 
-// a variant of FSceneView::SafeDeprojectFVector2D that avoids InverseFast().
-// Using InverseFast() sometimes leads to warning message spew from denormalized SceneView.ViewMatrix
-void FSceneView__SafeDeprojectFVector2D(const FSceneView* SceneView, const FVector2D& ScreenPos, FVector& out_WorldOrigin, FVector& out_WorldDirection)
+/**
+ * Capture a screenshot from this actor's viewport, normalized per channel
+ * as (value / 255 - mean) / std.
+ *
+ * @param size the size of the viewport.
+ * @param data a float array of 3 * size->X * size->Y elements.
+ *             This array is filled with the screenshot data in [color,Y,X] order.
+ * @param mean an array of 3 per-channel (RGB) means
+ * @param std an array of 3 per-channel (RGB) standard deviations
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool CaptureScreenshotNormalized(IntSize* size, void* data, const float* mean, const float* std)
 {
-	const FMatrix InverseViewMatrix = SceneView->ViewMatrices.ViewMatrix.Inverse();
-	const FMatrix InvProjectionMatrix = SceneView->ViewMatrices.GetInvProjMatrix();
+	TORCH_PROFILE_SCOPE("CaptureScreenshotNormalized", STAT_TorchCapture);
+	TArray<FColor> Bitmap;
+	if (!ReadViewportBitmap(size, Bitmap)) {
+		return false;
+	}
 
-	SceneView->DeprojectScreenToWorld(ScreenPos, SceneView->UnscaledViewRect, InverseViewMatrix, InvProjectionMatrix, out_WorldOrigin, out_WorldDirection);
+	float Lut[3][256];
+	for (int c = 0; c < 3; c++) {
+		for (int v = 0; v < 256; v++) {
+			Lut[c][v] = (v / 255.0f - mean[c]) / std[c];
+		}
+	}
+	ConvertBitmapToFloatCHW(Bitmap, Lut[0], Lut[1], Lut[2], (float*) data);
+	CountCapture(0, (int64) Bitmap.Num() * 3 * sizeof(float));
+	return true;
 }
 
-// Looks up common UE objects necessary for capturing segmentation, etc.
-bool InitCapture(UObject* _this, const IntSize* size, FViewport** pViewport, APlayerController** pPlayerController, UWorld** pWorld, FSceneView** pSceneView)
+// Enqueues a readback of RenderTarget into OutData on the render thread.
+// Modeled after FViewport::ReadPixels, without the FlushRenderingCommands();
+// OutData is only valid once the rendering commands have been flushed or fenced.
+void EnqueueReadSurfaceData(FRenderTarget* RenderTarget, FIntRect Rect, TArray<FColor>* OutData)
 {
-	FlushRenderingCommands();
+	struct FReadSurfaceContext
+	{
+		FRenderTarget* SrcRenderTarget;
+		TArray<FColor>* OutData;
+		FIntRect Rect;
+	};
+	FReadSurfaceContext ReadSurfaceContext = { RenderTarget, OutData, Rect };
+	ENQUEUE_UNIQUE_RENDER_COMMAND_ONEPARAMETER(
+		UETorchReadSurfaceCommand,
+		FReadSurfaceContext, Context, ReadSurfaceContext,
+	{
+		RHICmdList.ReadSurfaceData(Context.SrcRenderTarget->GetRenderTargetTexture(), Context.Rect, *Context.OutData, FReadSurfaceDataFlags());
+	});
+}
+
+/**
+ * Asynchronous screenshots.
+ * RequestScreenshotAsync enqueues a readback of the viewport on the render
+ * thread and returns immediately, instead of flushing the rendering commands
+ * like CaptureScreenshot does. The readbacks go into a small ring of buffers,
+ * and are collected on a later tick with PeekScreenshotAsync and
+ * PopScreenshotAsync, so that rendering, readback and simulation overlap.
+ */
+struct FAsyncScreenshot {
+	TArray<FColor> Bitmap;
+	FRenderCommandFence Fence;
+	IntSize Size;
+	uint64 FrameNumber;
+	float GameTime;
+};
+
+static TArray<TSharedPtr<FAsyncScreenshot>> GAsyncScreenshots;
+static int32 GAsyncScreenshotFirst = 0;
+static int32 GAsyncScreenshotCount = 0;
+
+/**
+ * Set the number of screenshots that can be in flight at once.
+ * Waits for (and discards) all pending screenshots.
+ *
+ * @param depth the size of the ring of readback buffers
+ */
+extern "C" UETORCH_API void SetAsyncScreenshotDepth(int depth)
+{
+	for (auto& Screenshot : GAsyncScreenshots) {
+		Screenshot->Fence.Wait();
+	}
+	GAsyncScreenshots.Reset();
+	for (int i = 0; i < FMath::Max(depth, 1); i++) {
+		GAsyncScreenshots.Add(MakeShareable(new FAsyncScreenshot()));
+	}
+	GAsyncScreenshotFirst = 0;
+	GAsyncScreenshotCount = 0;
+}
 
+/**
+ * Start an asynchronous readback of the viewport.
+ *
+ * @param _this the TorchPluginComponent
+ * @param size the size of the viewport.
+ * @returns false if the viewport is not available or if the ring of
+ *          screenshots is full; call PopScreenshotAsync first in that case.
+ */
+extern "C" UETORCH_API bool RequestScreenshotAsync(UObject* _this, const IntSize* size)
+{
+	TORCH_PROFILE_SCOPE("RequestScreenshotAsync", STAT_TorchCapture);
 	if(GEngine == NULL){
 		printf("GEngine null\n");
 		return false;
@@ -290,126 +707,1528 @@ bool InitCapture(UObject* _this, const IntSize* size, FViewport** pViewport, APl
 		return false;
 	}
 
-	*pViewport = GEngine->GameViewport->Viewport;
-
-	if (size->X != (*pViewport)->GetSizeXY().X || size->Y != (*pViewport)->GetSizeXY().Y) {
+	FViewport* Viewport = GEngine->GameViewport->Viewport;
+	if (size->X != Viewport->GetSizeXY().X || size->Y != Viewport->GetSizeXY().Y) {
 		printf("Wrong size\n");
 		return false;
 	}
 
-	*pPlayerController = UGameplayStatics::GetPlayerController(_this, 0);
-	if(*pPlayerController == NULL) {
-		printf("PlayerController null\n");
-		return false;
-	}
-
-	*pWorld = GEngine->GetWorldFromContextObject(_this);
-	if(*pWorld == NULL) {
+	UWorld *World = GEngine->GetWorldFromContextObject(_this);
+	if(World == NULL) {
 		printf("World null\n");
 		return false;
 	}
 
-	*pSceneView = GetSceneView(*pPlayerController, *pWorld);
-	if(*pSceneView == NULL) {
-		printf("SceneView null\n");
+	if (GAsyncScreenshots.Num() == 0) {
+		SetAsyncScreenshotDepth(2);
+	}
+	if (GAsyncScreenshotCount == GAsyncScreenshots.Num()) {
 		return false;
 	}
 
+	FAsyncScreenshot* Screenshot = GAsyncScreenshots[(GAsyncScreenshotFirst + GAsyncScreenshotCount) % GAsyncScreenshots.Num()].Get();
+	GAsyncScreenshotCount++;
+	Screenshot->Size = *size;
+	Screenshot->FrameNumber = GFrameCounter;
+	Screenshot->GameTime = World->GetTimeSeconds();
+	Screenshot->Bitmap.Reset();
+
+	EnqueueReadSurfaceData(Viewport, FIntRect(0, 0, size->X, size->Y), &Screenshot->Bitmap);
+	Screenshot->Fence.BeginFence();
 	return true;
 }
 
 /**
- * Calculate the segmentation for a set of objects in the viewport image.
- * Each value in seg_data is the index in the objects array of the object at that pixel, or 0.
+ * Check whether the oldest asynchronous screenshot is ready.
  *
- * @param _this the TorchPluginComponent
- * @param size the size of the viewport.
- * @param seg_data an int array of size->Y/stride * size->X/stride elements.
- *                 This array is filled with the segmentation data in [Y,X] order.
- *                 Each value (1..nObjects) corresponds to the index of the foreground object in the objects array,
- *                 or 0 if none of the objects is in the foreground at this pixel.
- * @param stride stride in pixels at which to compute the optical flow.
- * @param objects array of nObjects Actor* pointers which will be recorded in the segmentation mask
- * @param nObjects size of the objects array
- * @param verbose verbose output
- * @returns true if the optical flow capture was successful
+ * @param wait if true, block until the oldest screenshot is ready
+ * @param size filled with the size of the screenshot
+ * @param frameNumber filled with the engine frame number at which the screenshot was requested
+ * @param gameTime filled with the game time at which the screenshot was requested
+ * @returns true if a screenshot is ready to be popped
  */
-extern "C" UETORCH_API bool CaptureSegmentation(UObject* _this, const IntSize* size, void* seg_data, int stride, const AActor** objects, int nObjects, bool verbose)
+extern "C" UETORCH_API bool PeekScreenshotAsync(bool wait, IntSize* size, int64* frameNumber, float* gameTime)
 {
-	FViewport* Viewport = nullptr;
-	APlayerController* PlayerController = nullptr;
-	UWorld* World = nullptr;
-	FSceneView* SceneView = nullptr;
-
-	bool bOk = InitCapture(_this, size, &Viewport, &PlayerController, &World, &SceneView);
-	if(!bOk) {
+	TORCH_PROFILE_SCOPE("PeekScreenshotAsync", STAT_TorchCapture);
+	if (GAsyncScreenshotCount == 0) {
 		return false;
 	}
+	FAsyncScreenshot* Screenshot = GAsyncScreenshots[GAsyncScreenshotFirst].Get();
+	if (wait) {
+		Screenshot->Fence.Wait();
+	} else if (!Screenshot->Fence.IsFenceComplete()) {
+		return false;
+	}
+	*size = Screenshot->Size;
+	*frameNumber = Screenshot->FrameNumber;
+	*gameTime = Screenshot->GameTime;
+	return true;
+}
+
+/**
+ * Copy out the oldest asynchronous screenshot, which must be ready
+ * (see PeekScreenshotAsync), and release its buffer.
+ *
+ * @param data an array of 3 * size->X * size->Y floats or bytes, depending on format
+ * @param format one of SCREENSHOT_FLOAT_CHW, SCREENSHOT_BYTE_CHW or SCREENSHOT_BYTE_HWC
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool PopScreenshotAsync(void* data, int format)
+{
+	TORCH_PROFILE_SCOPE("PopScreenshotAsync", STAT_TorchCapture);
+	if (GAsyncScreenshotCount == 0) {
+		return false;
+	}
+	FAsyncScreenshot* Screenshot = GAsyncScreenshots[GAsyncScreenshotFirst].Get();
+	Screenshot->Fence.Wait();
+	GAsyncScreenshotFirst = (GAsyncScreenshotFirst + 1) % GAsyncScreenshots.Num();
+	GAsyncScreenshotCount--;
+
+	if (Screenshot->Bitmap.Num() != Screenshot->Size.X * Screenshot->Size.Y) {
+		printf("Screenshot bitmap had the wrong number of elements: %d\n", Screenshot->Bitmap.Num());
+		return false;
+	}
+	WriteScreenshotBitmap(Screenshot->Bitmap, data, format);
+	return true;
+}
+
+/**
+ * Off-screen cameras.
+ * Each camera is a USceneCaptureComponent2D rendering into its own
+ * UTextureRenderTarget2D, so it has its own resolution and pose,
+ * independent of the game viewport. The components are owned by the
+ * TorchPluginComponent's actor.
+ */
+static TArray<TWeakObjectPtr<USceneCaptureComponent2D>> GCaptureCameras;
+
+// Looks up a camera created by CreateCaptureCamera
+USceneCaptureComponent2D* GetCaptureCameraComponent(int id)
+{
+	if (!GCaptureCameras.IsValidIndex(id) || !GCaptureCameras[id].IsValid()) {
+		printf("Invalid capture camera %d\n", id);
+		return NULL;
+	}
+	return GCaptureCameras[id].Get();
+}
+
+/**
+ * Create an off-screen camera.
+ *
+ * @param _this the TorchPluginComponent
+ * @param width the width of the camera image
+ * @param height the height of the camera image
+ * @param fov the horizontal field of view, in degrees
+ * @returns the camera id, or -1 on failure
+ */
+extern "C" UETORCH_API int CreateCaptureCamera(UObject* _this, int width, int height, float fov)
+{
+	UActorComponent* Component = Cast<UActorComponent>(_this);
+	if (Component == NULL || Component->GetOwner() == NULL) {
+		printf("Owner null\n");
+		return -1;
+	}
+	UWorld *World = GEngine->GetWorldFromContextObject(_this);
+	if(World == NULL) {
+		printf("World null\n");
+		return -1;
+	}
+	if (width <= 0 || height <= 0) {
+		printf("Bad camera size %dx%d\n", width, height);
+		return -1;
+	}
+
+	AActor* Owner = Component->GetOwner();
+	USceneCaptureComponent2D* Capture = NewObject<USceneCaptureComponent2D>(Owner);
+	Capture->bCaptureEveryFrame = false;
+	Capture->bCaptureOnMovement = false;
+	Capture->CaptureSource = SCS_FinalColorLDR;
+	Capture->FOVAngle = fov;
+
+	UTextureRenderTarget2D* Target = NewObject<UTextureRenderTarget2D>(Capture);
+	Target->InitCustomFormat(width, height, PF_B8G8R8A8, false);
+	Target->UpdateResourceImmediate();
+	Capture->TextureTarget = Target;
+
+	Owner->AddInstanceComponent(Capture);
+	Capture->RegisterComponentWithWorld(World);
+
+	for (int id = 0; id < GCaptureCameras.Num(); id++) {
+		if (!GCaptureCameras[id].IsValid()) {
+			GCaptureCameras[id] = Capture;
+			return id;
+		}
+	}
+	return GCaptureCameras.Add(Capture);
+}
+
+/**
+ * Destroy an off-screen camera created by CreateCaptureCamera.
+ *
+ * @param id the camera id
+ */
+extern "C" UETORCH_API void DestroyCaptureCamera(int id)
+{
+	USceneCaptureComponent2D* Capture = GetCaptureCameraComponent(id);
+	if (Capture == NULL) {
+		return;
+	}
+	if (Capture->GetOwner() != NULL) {
+		Capture->GetOwner()->RemoveInstanceComponent(Capture);
+	}
+	Capture->DestroyComponent();
+	GCaptureCameras[id] = NULL;
+}
+
+/**
+ * Get the image size of an off-screen camera.
+ *
+ * @param id the camera id
+ * @param size filled with the camera image size
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool GetCaptureCameraSize(int id, IntSize* size)
+{
+	USceneCaptureComponent2D* Capture = GetCaptureCameraComponent(id);
+	if (Capture == NULL || Capture->TextureTarget == NULL) {
+		return false;
+	}
+	size->X = Capture->TextureTarget->SizeX;
+	size->Y = Capture->TextureTarget->SizeY;
+	return true;
+}
+
+/**
+ * Set the pose of an off-screen camera.
+ *
+ * @param _this the TorchPluginComponent
+ * @param id the camera id
+ * @param relative if true, the pose is relative to the player's camera,
+ *                 e.g. to build a stereo rig; otherwise it is in world space
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool SetCaptureCameraPose(UObject* _this, int id, bool relative, float x, float y, float z, float pitch, float yaw, float roll)
+{
+	USceneCaptureComponent2D* Capture = GetCaptureCameraComponent(id);
+	if (Capture == NULL) {
+		return false;
+	}
+
+	FTransform Pose(FRotator(pitch, yaw, roll), FVector(x, y, z));
+	if (relative) {
+		APlayerController* PlayerController = UGameplayStatics::GetPlayerController(_this, 0);
+		if (PlayerController == NULL || PlayerController->PlayerCameraManager == NULL) {
+			printf("PlayerCameraManager null\n");
+			return false;
+		}
+		FTransform View(PlayerController->PlayerCameraManager->GetCameraRotation(), PlayerController->PlayerCameraManager->GetCameraLocation());
+		Pose = Pose * View;
+	}
+	Capture->SetWorldLocationAndRotation(Pose.GetLocation(), Pose.GetRotation());
+	return true;
+}
+
+/**
+ * Render and read back a batch of off-screen cameras.
+ * All the cameras are rendered and their readbacks enqueued before a single
+ * flush of the rendering commands.
+ *
+ * @param _this the TorchPluginComponent
+ * @param ids an array of n camera ids
+ * @param n the number of cameras
+ * @param data an array of n buffers; buffer i holds
+ *             3 * width_i * height_i floats or bytes, depending on format
+ * @param format one of SCREENSHOT_FLOAT_CHW, SCREENSHOT_BYTE_CHW or SCREENSHOT_BYTE_HWC
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool CaptureCameras(UObject* _this, const int* ids, int n, void** data, int format)
+{
+	TORCH_PROFILE_SCOPE("CaptureCameras", STAT_TorchCapture);
+	UWorld *World = GEngine->GetWorldFromContextObject(_this);
+	if(World == NULL || World->Scene == NULL) {
+		printf("World null\n");
+		return false;
+	}
+
+	// validate all the cameras before enqueuing any readback, since the
+	// render thread writes into Bitmaps until the flush
+	TArray<USceneCaptureComponent2D*> Captures;
+	Captures.SetNum(n);
+	TArray<FTextureRenderTargetResource*> Resources;
+	Resources.SetNum(n);
+	TArray<IntSize> Sizes;
+	Sizes.SetNum(n);
+	for (int i = 0; i < n; i++) {
+		Captures[i] = GetCaptureCameraComponent(ids[i]);
+		if (Captures[i] == NULL || Captures[i]->TextureTarget == NULL || !GetCaptureCameraSize(ids[i], &Sizes[i])) {
+			return false;
+		}
+		Resources[i] = Captures[i]->TextureTarget->GameThread_GetRenderTargetResource();
+		if (Resources[i] == NULL) {
+			printf("Render target resource null\n");
+			return false;
+		}
+	}
+
+	TArray<TArray<FColor>> Bitmaps;
+	Bitmaps.SetNum(n);
+	for (int i = 0; i < n; i++) {
+		World->Scene->UpdateSceneCaptureContents(Captures[i]);
+		EnqueueReadSurfaceData(Resources[i], FIntRect(0, 0, Sizes[i].X, Sizes[i].Y), &Bitmaps[i]);
+	}
+	FlushCaptureRenderingCommands();
+
+	for (int i = 0; i < n; i++) {
+		if (Bitmaps[i].Num() != Sizes[i].X * Sizes[i].Y) {
+			printf("Camera %d bitmap had the wrong number of elements: %d\n", ids[i], Bitmaps[i].Num());
+			return false;
+		}
+		WriteScreenshotBitmap(Bitmaps[i], data[i], format);
+	}
+	return true;
+}
+
+/**
+ * Simulation environments.
+ * An environment is a copy of a level streamed into the current world at its
+ * own origin, with its own off-screen camera, so that several environments
+ * share one process, one asset cache and one tick. The environments share the
+ * world, its physics scene and the player controller: they are isolated by
+ * the distance between their origins, and driven through their actors. Each
+ * camera only renders the actors of its environment.
+ */
+struct FTorchEnvironment {
+	TWeakObjectPtr<ULevelStreaming> Level;
+	FVector Origin;
+	int32 CameraId;
+	/** Whether the camera was restricted to the actors of the loaded level */
+	bool bCameraBound;
+};
+
+static TArray<FTorchEnvironment> GEnvironments;
+
+// Looks up an environment created by CreateEnvironment
+static FTorchEnvironment* GetEnvironment(int id)
+{
+	if (!GEnvironments.IsValidIndex(id) || !GEnvironments[id].Level.IsValid()) {
+		printf("Invalid environment %d\n", id);
+		return NULL;
+	}
+	return &GEnvironments[id];
+}
+
+// Restricts the camera of an environment to the actors of its level, once loaded
+static void BindEnvironmentCamera(FTorchEnvironment& Environment)
+{
+	ULevel* Level = Environment.Level->GetLoadedLevel();
+	if (Environment.bCameraBound || Level == NULL || !Environment.Level->IsLevelVisible()) {
+		return;
+	}
+	USceneCaptureComponent2D* Capture = GetCaptureCameraComponent(Environment.CameraId);
+	if (Capture == NULL) {
+		return;
+	}
+	for (AActor* Actor : Level->Actors) {
+		if (Actor != NULL && !Actor->IsPendingKill()) {
+			Capture->ShowOnlyActorComponents(Actor);
+		}
+	}
+	Environment.bCameraBound = true;
+}
+
+/**
+ * Load a copy of a level at an origin in the current world, with an
+ * off-screen camera. The level is streamed in asynchronously; see
+ * IsEnvironmentLoaded.
+ *
+ * @param _this the TorchPluginComponent
+ * @param levelName the package name of the level, e.g. /Game/Maps/Room
+ * @param x, y, z the origin of the environment, in world space
+ * @param width the width of the camera image
+ * @param height the height of the camera image
+ * @param fov the horizontal field of view of the camera, in degrees
+ * @returns the environment id, or -1 on failure
+ */
+extern "C" UETORCH_API int CreateEnvironment(UObject* _this, const char* levelName, float x, float y, float z, int width, int height, float fov)
+{
+	const int CameraId = CreateCaptureCamera(_this, width, height, fov);
+	if (CameraId < 0) {
+		return -1;
+	}
+	const FVector Origin(x, y, z);
+	bool bSuccess = false;
+	ULevelStreamingKismet* Level = ULevelStreamingKismet::LoadLevelEnvironment(_this, ANSI_TO_TCHAR(levelName), Origin, FRotator::ZeroRotator, bSuccess);
+	if (!bSuccess || Level == NULL) {
+		printf("Unable to load level %s\n", levelName);
+		DestroyCaptureCamera(CameraId);
+		return -1;
+	}
+	SetCaptureCameraPose(_this, CameraId, false, x, y, z, 0, 0, 0);
+
+	FTorchEnvironment Environment;
+	Environment.Level = Level;
+	Environment.Origin = Origin;
+	Environment.CameraId = CameraId;
+	Environment.bCameraBound = false;
+	for (int id = 0; id < GEnvironments.Num(); id++) {
+		if (!GEnvironments[id].Level.IsValid()) {
+			GEnvironments[id] = Environment;
+			return id;
+		}
+	}
+	return GEnvironments.Add(Environment);
+}
+
+/**
+ * Unload an environment created by CreateEnvironment, and destroy its camera.
+ *
+ * @param id the environment id
+ */
+extern "C" UETORCH_API void DestroyEnvironment(int id)
+{
+	FTorchEnvironment* Environment = GetEnvironment(id);
+	if (Environment == NULL) {
+		return;
+	}
+	ULevelStreaming* Level = Environment->Level.Get();
+	Level->bShouldBeLoaded = false;
+	Level->bShouldBeVisible = false;
+	Level->bIsRequestingUnloadAndRemoval = true;
+	DestroyCaptureCamera(Environment->CameraId);
+	GEnvironments[id].Level = NULL;
+}
+
+/**
+ * @param id the environment id
+ * @returns true once the level of the environment is loaded and visible
+ */
+extern "C" UETORCH_API bool IsEnvironmentLoaded(int id)
+{
+	FTorchEnvironment* Environment = GetEnvironment(id);
+	if (Environment == NULL) {
+		return false;
+	}
+	BindEnvironmentCamera(*Environment);
+	return Environment->bCameraBound;
+}
+
+/**
+ * Show an actor that is not part of the level of an environment (e.g. spawned
+ * by SpawnStaticMeshActor) to the camera of the environment.
+ *
+ * @param id the environment id
+ * @param actor the actor
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool AddEnvironmentCameraActor(int id, AActor* actor)
+{
+	FTorchEnvironment* Environment = GetEnvironment(id);
+	if (Environment == NULL || !FActorRegistry::Get().IsValid(actor)) {
+		return false;
+	}
+	USceneCaptureComponent2D* Capture = GetCaptureCameraComponent(Environment->CameraId);
+	if (Capture == NULL) {
+		return false;
+	}
+	Capture->ShowOnlyActorComponents(actor);
+	return true;
+}
+
+/**
+ * Get the origin and the camera of an environment.
+ *
+ * @param id the environment id
+ * @param x, y, z filled with the origin of the environment
+ * @returns the camera id of the environment, or -1 if the environment is invalid
+ */
+extern "C" UETORCH_API int GetEnvironmentInfo(int id, float* x, float* y, float* z)
+{
+	FTorchEnvironment* Environment = GetEnvironment(id);
+	if (Environment == NULL) {
+		return -1;
+	}
+	BindEnvironmentCamera(*Environment);
+	*x = Environment->Origin.X;
+	*y = Environment->Origin.Y;
+	*z = Environment->Origin.Z;
+	return Environment->CameraId;
+}
+
+/**
+ * List the actors of a loaded environment.
+ *
+ * @param id the environment id
+ * @param actors an array filled with up to maxActors actors
+ * @param maxActors the size of the array
+ * @returns the number of actors of the environment (which may exceed maxActors),
+ *          or -1 if the environment is invalid or not loaded yet
+ */
+extern "C" UETORCH_API int GetEnvironmentActors(int id, AActor** actors, int maxActors)
+{
+	FTorchEnvironment* Environment = GetEnvironment(id);
+	ULevel* Level = Environment ? Environment->Level->GetLoadedLevel() : NULL;
+	if (Level == NULL) {
+		return -1;
+	}
+	int n = 0;
+	for (AActor* Actor : Level->Actors) {
+		if (Actor == NULL || Actor->IsPendingKill()) {
+			continue;
+		}
+		if (n < maxActors) {
+			actors[n] = Actor;
+		}
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Set the pose of the camera of an environment, relative to its origin.
+ *
+ * @param _this the TorchPluginComponent
+ * @param id the environment id
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool SetEnvironmentCameraPose(UObject* _this, int id, float x, float y, float z, float pitch, float yaw, float roll)
+{
+	FTorchEnvironment* Environment = GetEnvironment(id);
+	if (Environment == NULL) {
+		return false;
+	}
+	const FVector Location = Environment->Origin + FVector(x, y, z);
+	return SetCaptureCameraPose(_this, Environment->CameraId, false, Location.X, Location.Y, Location.Z, pitch, yaw, roll);
+}
+
+// Looks up the player's SceneView object
+// modeled after APlayerController::GetHitResultAtScreenPosition
+FSceneView* GetSceneView(APlayerController* PlayerController, UWorld* World) {
+	if(GEngine == NULL){
+		printf("GEngine null\n");
+		return NULL;
+	}
+	if(GEngine->GameViewport == NULL){
+		printf("GameViewport null\n");
+		return NULL;
+	}
+	if(GEngine->GameViewport->Viewport == NULL){
+		printf("Viewport null\n");
+		return NULL;
+	}
+
+	auto Viewport = GEngine->GameViewport->Viewport;
+
+	// Create a view family for the game viewport
+	static TSharedPtr<FSceneViewFamilyContext> ViewFamily;
+	ViewFamily = MakeShareable(new FSceneViewFamilyContext(
+		FSceneViewFamily::ConstructionValues(
+			Viewport,
+			World->Scene,
+			GEngine->GameViewport->EngineShowFlags )
+		.SetRealtimeUpdate(true) ) );
+
+
+	// Calculate a view where the player is to update the streaming from the players start location
+	FVector ViewLocation;
+	FRotator ViewRotation;
+	ULocalPlayer* LocalPlayer = Cast<ULocalPlayer>(PlayerController->Player);
+	if (LocalPlayer == NULL) {
+		return NULL;
+	}
+	FSceneView* SceneView = LocalPlayer->CalcSceneView( ViewFamily.Get(), /*out*/ ViewLocation, /*out*/ ViewRotation, Viewport );
+	return SceneView;
+}
+
+// Looks up common UE objects necessary for capturing segmentation, etc.
+bool InitCapture(UObject* _this, const IntSize* size, FViewport** pViewport, APlayerController** pPlayerController, UWorld** pWorld, FSceneView** pSceneView)
+{
+	TORCH_PROFILE_SCOPE("InitCapture", STAT_TorchInitCapture);
+	FlushCaptureRenderingCommands();
+
+	if(GEngine == NULL){
+		printf("GEngine null\n");
+		return false;
+	}
+	if(GEngine->GameViewport == NULL){
+		printf("GameViewport null\n");
+		return false;
+	}
+	if(GEngine->GameViewport->Viewport == NULL){
+		printf("Viewport null\n");
+		return false;
+	}
+
+	*pViewport = GEngine->GameViewport->Viewport;
+
+	if (size->X != (*pViewport)->GetSizeXY().X || size->Y != (*pViewport)->GetSizeXY().Y) {
+		printf("Wrong size\n");
+		return false;
+	}
+
+	*pPlayerController = UGameplayStatics::GetPlayerController(_this, 0);
+	if(*pPlayerController == NULL) {
+		printf("PlayerController null\n");
+		return false;
+	}
+
+	*pWorld = GEngine->GetWorldFromContextObject(_this);
+	if(*pWorld == NULL) {
+		printf("World null\n");
+		return false;
+	}
+
+	*pSceneView = GetSceneView(*pPlayerController, *pWorld);
+	if(*pSceneView == NULL) {
+		printf("SceneView null\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Parallel tracing settings, see SetParallelCapture()
+static bool GParallelCapture = false;
+static int32 GCaptureTileSize = 32;
+
+/**
+ * Enable or disable parallel tracing for the capture functions.
+ * When enabled, the pixel grid is split into square tiles which are traced
+ * on the task graph worker threads. Scene queries only take the physics scene
+ * read lock, so they are safe to run concurrently; each pixel is written by
+ * exactly one worker, so the output is identical to the serial path.
+ *
+ * @param enabled whether to trace in parallel
+ * @param tileSize the size of each tile, in (strided) pixels. Values < 1 keep the current size.
+ */
+extern "C" UETORCH_API void SetParallelCapture(bool enabled, int tileSize)
+{
+	GParallelCapture = enabled;
+	if (tileSize > 0) {
+		GCaptureTileSize = tileSize;
+	}
+}
+
+/**
+ * Calls Body(x, y, index) for each pixel of the capture grid, i.e. every
+ * stride pixels of the viewport. index is the offset of the pixel in the
+ * [Y/stride,X/stride] output arrays.
+ * If parallel capture is enabled (and bForceSerial is false), tiles of the grid
+ * are processed concurrently, so Body may only write to output element index.
+ */
+template<typename BodyType>
+void ForEachCapturePixel(const IntSize* size, int stride, bool bForceSerial, const BodyType& Body)
+{
+	const int32 NX = (size->X + stride - 1) / stride;
+	const int32 NY = (size->Y + stride - 1) / stride;
+
+	if (bForceSerial || !GParallelCapture) {
+		for (int32 iy = 0; iy < NY; iy++) {
+			for (int32 ix = 0; ix < NX; ix++) {
+				Body(ix * stride, iy * stride, iy * NX + ix);
+			}
+		}
+		return;
+	}
+
+	const int32 Tile = GCaptureTileSize;
+	const int32 TilesX = (NX + Tile - 1) / Tile;
+	const int32 TilesY = (NY + Tile - 1) / Tile;
+	ParallelFor(TilesX * TilesY, [&](int32 TileIndex) {
+		const int32 X0 = (TileIndex % TilesX) * Tile;
+		const int32 Y0 = (TileIndex / TilesX) * Tile;
+		const int32 X1 = FMath::Min(X0 + Tile, NX);
+		const int32 Y1 = FMath::Min(Y0 + Tile, NY);
+		for (int32 iy = Y0; iy < Y1; iy++) {
+			for (int32 ix = X0; ix < X1; ix++) {
+				Body(ix * stride, iy * stride, iy * NX + ix);
+			}
+		}
+	});
+}
+
+/**
+ * The ray origin and direction for each pixel of the capture grid.
+ * Building the grid inverts the view and projection matrices once, and
+ * deprojects the whole grid with the vector intrinsics. The last grid is
+ * cached and reused by all capture functions for as long as the camera,
+ * viewport and stride stay the same.
+ */
+struct FCaptureRayGrid {
+	FMatrix ViewMatrix;
+	FMatrix ProjMatrix;
+	FMatrix InvViewMatrix;
+	FMatrix InvProjMatrix;
+	FIntRect ViewRect;
+	int32 SizeX;
+	int32 SizeY;
+	int32 Stride;
+	int32 NX;
+	int32 NY;
+	TArray<FVector> Origins;
+	TArray<FVector> Directions;
+
+	// Screen-space Jacobian for optical flow, see BuildCaptureFlowJacobian()
+	bool bHasFlowJacobian;
+	FVector ClipWAxis;
+	float ClipWOffset;
+	TArray<FVector> FlowGradX;
+	TArray<FVector> FlowGradY;
+
+	FCaptureRayGrid() : SizeX(0), SizeY(0), Stride(0), NX(0), NY(0), bHasFlowJacobian(false) {}
+
+	// Returns clip space W of a world position, i.e. its depth for a perspective projection
+	float GetClipW(const FVector& WorldPos) const
+	{
+		return FVector::DotProduct(WorldPos, ClipWAxis) + ClipWOffset;
+	}
+};
+
+static FCaptureRayGrid GCaptureRayGrid;
+
+// Normalizes the xyz components of V (whose w component must be 0)
+static FORCEINLINE VectorRegister CaptureRayGrid__Normalize3(const VectorRegister& V)
+{
+	return VectorMultiply(V, VectorReciprocalSqrtAccurate(VectorDot3(V, V)));
+}
+
+/**
+ * Helper function for optical flow
+ * Calculate dPixel / dWorld, i.e. how much the pixel coordinates of a point
+ * change per change of its world position, for each pixel of the grid.
+ *
+ * A world point P projects to clip = [P,1] * ViewMatrix * ProjMatrix and to
+ *   PixelX = Min.X + (0.5 + 0.5 * clip.x / clip.w) * Width
+ *   PixelY = Min.Y + (0.5 - 0.5 * clip.y / clip.w) * Height
+ * so that, with C0, C1, C3 the rotation part of the columns of ViewMatrix * ProjMatrix,
+ *   dPixelX/dP = 0.5 * Width  * (C0 - ndc.x * C3) / clip.w
+ *   dPixelY/dP = -0.5 * Height * (C1 - ndc.y * C3) / clip.w
+ * ndc is the same for every point along the ray of a pixel, so only clip.w
+ * depends on the hit, and the numerators are stored per pixel in FlowGradX/Y.
+ */
+void BuildCaptureFlowJacobian(FCaptureRayGrid& Grid)
+{
+	if (Grid.bHasFlowJacobian) {
+		return;
+	}
+
+	const FMatrix ViewProj = Grid.ViewMatrix * Grid.ProjMatrix;
+	Grid.ClipWAxis = FVector(ViewProj.M[0][3], ViewProj.M[1][3], ViewProj.M[2][3]);
+	Grid.ClipWOffset = ViewProj.M[3][3];
+
+	const float HalfWidth = 0.5f * Grid.ViewRect.Width();
+	const float HalfHeight = 0.5f * Grid.ViewRect.Height();
+	const VectorRegister AX = VectorMultiply(VectorSetFloat1(HalfWidth), MakeVectorRegister(ViewProj.M[0][0], ViewProj.M[1][0], ViewProj.M[2][0], 0.0f));
+	const VectorRegister AY = VectorMultiply(VectorSetFloat1(-HalfHeight), MakeVectorRegister(ViewProj.M[0][1], ViewProj.M[1][1], ViewProj.M[2][1], 0.0f));
+	const VectorRegister C3 = MakeVectorRegister(ViewProj.M[0][3], ViewProj.M[1][3], ViewProj.M[2][3], 0.0f);
+	const VectorRegister BX = VectorMultiply(VectorSetFloat1(-HalfWidth), C3);
+	const VectorRegister BY = VectorMultiply(VectorSetFloat1(HalfHeight), C3);
+
+	Grid.FlowGradX.SetNumUninitialized(Grid.NX * Grid.NY);
+	Grid.FlowGradY.SetNumUninitialized(Grid.NX * Grid.NY);
+
+	ParallelFor(Grid.NY, [&](int32 iy) {
+		const int32 PixelY = iy * Grid.Stride;
+		const float NdcY = ((1.0f - (PixelY - Grid.ViewRect.Min.Y) / (float) Grid.ViewRect.Height()) - 0.5f) * 2.0f;
+		const VectorRegister RowY = VectorMultiplyAdd(VectorSetFloat1(NdcY), BY, AY);
+
+		FVector* GradX = Grid.FlowGradX.GetData() + iy * Grid.NX;
+		FVector* GradY = Grid.FlowGradY.GetData() + iy * Grid.NX;
+		for (int32 ix = 0; ix < Grid.NX; ix++) {
+			const int32 PixelX = ix * Grid.Stride;
+			const float NdcX = ((PixelX - Grid.ViewRect.Min.X) / (float) Grid.ViewRect.Width() - 0.5f) * 2.0f;
+			VectorStoreFloat3(VectorMultiplyAdd(VectorSetFloat1(NdcX), BX, AX), &GradX[ix]);
+			VectorStoreFloat3(RowY, &GradY[ix]);
+		}
+	}, !GParallelCapture);
+
+	Grid.bHasFlowJacobian = true;
+}
+
+/**
+ * Returns the ray grid for SceneView at the given stride, rebuilding the
+ * cached grid if the view or the viewport have changed.
+ * If bWithFlowJacobian is true, the grid also has the optical flow Jacobian.
+ * This follows FSceneView::DeprojectScreenToWorld: the ray start is the
+ * pixel at z=1 (near plane) and the direction goes towards z=0.5, both in
+ * projection space. Since the projection-space points are linear in the pixel
+ * coordinates, each row only needs one multiply-add per pixel before the
+ * perspective divide and the inverse view transform.
+ */
+const FCaptureRayGrid& GetCaptureRayGrid(const FSceneView* SceneView, const IntSize* size, int stride, bool bWithFlowJacobian = false)
+{
+	FCaptureRayGrid& Grid = GCaptureRayGrid;
+	const FMatrix& ViewMatrix = SceneView->ViewMatrices.ViewMatrix;
+	const FMatrix& ProjMatrix = SceneView->ViewMatrices.ProjMatrix;
+	const FIntRect& ViewRect = SceneView->UnscaledViewRect;
+
+	if (Grid.SizeX == size->X && Grid.SizeY == size->Y && Grid.Stride == stride &&
+		Grid.ViewRect == ViewRect && Grid.ViewMatrix == ViewMatrix && Grid.ProjMatrix == ProjMatrix) {
+		if (bWithFlowJacobian) {
+			BuildCaptureFlowJacobian(Grid);
+		}
+		return Grid;
+	}
+
+	Grid.ViewMatrix = ViewMatrix;
+	Grid.ProjMatrix = ProjMatrix;
+	// Inverse() rather than InverseFast(), which leads to warning message spew
+	// from a denormalized SceneView.ViewMatrix
+	Grid.InvViewMatrix = ViewMatrix.Inverse();
+	Grid.InvProjMatrix = SceneView->ViewMatrices.GetInvProjMatrix();
+	Grid.ViewRect = ViewRect;
+	Grid.SizeX = size->X;
+	Grid.SizeY = size->Y;
+	Grid.Stride = stride;
+	Grid.NX = (size->X + stride - 1) / stride;
+	Grid.NY = (size->Y + stride - 1) / stride;
+	Grid.Origins.SetNumUninitialized(Grid.NX * Grid.NY);
+	Grid.Directions.SetNumUninitialized(Grid.NX * Grid.NY);
+	Grid.bHasFlowJacobian = false;
+
+	const VectorRegister Row0 = VectorLoad(&Grid.InvProjMatrix.M[0][0]);
+	const VectorRegister Row1 = VectorLoad(&Grid.InvProjMatrix.M[1][0]);
+	const VectorRegister Row2 = VectorLoad(&Grid.InvProjMatrix.M[2][0]);
+	const VectorRegister Row3 = VectorLoad(&Grid.InvProjMatrix.M[3][0]);
+	// (.., .., 1, 1) and (.., .., 0.5, 1) in projection space
+	const VectorRegister StartZW = VectorAdd(Row2, Row3);
+	const VectorRegister EndZW = VectorMultiplyAdd(VectorSetFloat1(0.5f), Row2, Row3);
+
+	const float Width = (float) ViewRect.Width();
+	const float Height = (float) ViewRect.Height();
+
+	ParallelFor(Grid.NY, [&](int32 iy) {
+		const int32 PixelY = iy * stride;
+		const float NormalizedY = (PixelY - ViewRect.Min.Y) / Height;
+		const float ScreenSpaceY = ((1.0f - NormalizedY) - 0.5f) * 2.0f;
+		const VectorRegister SY = VectorSetFloat1(ScreenSpaceY);
+		const VectorRegister RowStart = VectorMultiplyAdd(SY, Row1, StartZW);
+		const VectorRegister RowEnd = VectorMultiplyAdd(SY, Row1, EndZW);
+
+		FVector* Origins = Grid.Origins.GetData() + iy * Grid.NX;
+		FVector* Directions = Grid.Directions.GetData() + iy * Grid.NX;
+		for (int32 ix = 0; ix < Grid.NX; ix++) {
+			const int32 PixelX = ix * stride;
+			const float NormalizedX = (PixelX - ViewRect.Min.X) / Width;
+			const float ScreenSpaceX = (NormalizedX - 0.5f) * 2.0f;
+			const VectorRegister SX = VectorSetFloat1(ScreenSpaceX);
+
+			// inverse projection, then divide by W to get view space coordinates
+			VectorRegister Start = VectorMultiplyAdd(SX, Row0, RowStart);
+			VectorRegister End = VectorMultiplyAdd(SX, Row0, RowEnd);
+			Start = VectorDivide(Start, VectorReplicate(Start, 3));
+			End = VectorDivide(End, VectorReplicate(End, 3));
+			const VectorRegister DirView = CaptureRayGrid__Normalize3(VectorSet_W0(VectorSubtract(End, Start)));
+
+			// inverse view transform (W=1 for the position, W=0 for the direction)
+			const VectorRegister WorldOrigin = VectorTransformVector(VectorSet_W1(Start), &Grid.InvViewMatrix);
+			const VectorRegister WorldDir = VectorTransformVector(DirView, &Grid.InvViewMatrix);
+			VectorStoreFloat3(WorldOrigin, &Origins[ix]);
+			VectorStoreFloat3(CaptureRayGrid__Normalize3(VectorSet_W0(WorldDir)), &Directions[ix]);
+		}
+	}, !GParallelCapture);
+
+	if (bWithFlowJacobian) {
+		BuildCaptureFlowJacobian(Grid);
+	}
+	return Grid;
+}
+
+FBodyInstance* GetBodyInstance(AActor* Actor) {
+	auto SceneComponent = Actor->GetRootComponent();
+	if(SceneComponent == NULL) return NULL;
+	auto PrimitiveComponent = Cast<UPrimitiveComponent>(SceneComponent);
+	if (PrimitiveComponent == NULL) return NULL;
+	FBodyInstance* BodyInst = PrimitiveComponent->GetBodyInstance();
+	return BodyInst;
+}
+
+/*************************************************************************
+ * Per-pixel capture helpers
+ * These are shared by the single-modality capture functions and
+ * CaptureModalities, so that each modality is computed the same way
+ * whether or not it is captured together with others.
+ *************************************************************************/
+
+const float HitResultTraceDistance = 100000.f;
+
+// The player camera state needed for depth and optical flow
+struct FCaptureCamera {
+	FVector Location;
+	FRotator Rotation;
+	FVector Forward;
+	FVector ViewOrigin;
+	FVector Velocity;
+	FVector AngularVelocity;
+};
+
+// The view at the last tick, sampled at every tick by the TorchContext
+// (see SampleCameraMotion), used to estimate the angular velocity of the camera
+struct FCaptureCameraMotion {
+	FQuat Rotation;
+	float Time;
+	uint64 Frame;
+	FVector AngularVelocity;
+};
+
+static FCaptureCameraMotion GCaptureCameraMotion = { FQuat::Identity, 0.0f, 0, FVector::ZeroVector };
+
+// Records the view rotation of this tick, once per tick, and estimates the
+// angular velocity from the rotation at the previous tick
+static void UpdateCaptureCameraMotion(const FQuat& Rotation, float Time)
+{
+	FCaptureCameraMotion& Motion = GCaptureCameraMotion;
+	if (Motion.Frame == GFrameCounter) {
+		return;
+	}
+
+	FVector AngularVelocity = FVector::ZeroVector;
+	if (Motion.Frame + 1 == GFrameCounter && Time > Motion.Time) {
+		FQuat Delta = Rotation * Motion.Rotation.Inverse();
+		if (Delta.W < 0) {
+			// take the shortest path
+			Delta = FQuat(-Delta.X, -Delta.Y, -Delta.Z, -Delta.W);
+		}
+		FVector Axis;
+		float Angle;
+		Delta.ToAxisAndAngle(Axis, Angle);
+		AngularVelocity = Axis * (Angle / (Time - Motion.Time));
+	}
+
+	Motion.Rotation = Rotation;
+	Motion.Time = Time;
+	Motion.Frame = GFrameCounter;
+	Motion.AngularVelocity = AngularVelocity;
+}
+
+/**
+ * Sample the rotation of the player's view. The TorchContext calls this at
+ * every tick, so that optical flow accounts for the rotation of the camera
+ * even when the previous tick had no capture (e.g. with tick hooks that run
+ * every few ticks, or with the render gate).
+ *
+ * @param _this the TorchPluginComponent
+ */
+extern "C" UETORCH_API void SampleCameraMotion(UObject* _this)
+{
+	UWorld* World = GEngine->GetWorldFromContextObject(_this);
+	APlayerController* PlayerController = UGameplayStatics::GetPlayerController(_this, 0);
+	if (World == NULL || PlayerController == NULL || PlayerController->PlayerCameraManager == NULL) {
+		return;
+	}
+	UpdateCaptureCameraMotion(PlayerController->PlayerCameraManager->GetCameraRotation().Quaternion(), World->GetTimeSeconds());
+}
+
+/**
+ * Estimate the angular velocity of the view from its rotation at the previous tick.
+ * The view rotation follows the control rotation, which is not simulated by
+ * physics, so this is the only way to know how fast the camera is turning.
+ * The rotation is sampled at every tick by SampleCameraMotion; if it wasn't
+ * (e.g. outside of a TorchContext), the camera is assumed not to rotate.
+ */
+FVector GetCaptureCameraAngularVelocity(const FSceneView* SceneView, UWorld* World)
+{
+	UpdateCaptureCameraMotion(SceneView->ViewRotation.Quaternion(), World->GetTimeSeconds());
+	return GCaptureCameraMotion.AngularVelocity;
+}
+
+// Looks up the player camera state for depth and optical flow captures
+bool InitCaptureCamera(UObject* _this, APlayerController* PlayerController, UWorld* World, const FSceneView* SceneView, FCaptureCamera* Camera)
+{
+	ACharacter* PlayerCharacter = UGameplayStatics::GetPlayerCharacter(_this, 0);
+	if(PlayerCharacter == NULL) {
+		printf("PlayerCharacter null\n");
+		return false;
+	}
+
+	Camera->Location = PlayerCharacter->GetActorLocation();
+	Camera->Rotation = PlayerController->GetControlRotation();
+	FRotationMatrix PlayerRotMat(Camera->Rotation);
+
+	Camera->Forward = PlayerRotMat.GetScaledAxis( EAxis::X );
+	Camera->Forward.Normalize();
+
+	Camera->ViewOrigin = SceneView->ViewMatrices.ViewOrigin;
+	Camera->Velocity = PlayerCharacter->GetVelocity();
+	Camera->AngularVelocity = GetCaptureCameraAngularVelocity(SceneView, World);
+	return true;
+}
+
+// Casts the ray of grid pixel index on the visibility channel to find the foreground object
+bool TraceCapturePixel(UWorld* World, const FCaptureRayGrid& Grid, int index, const FCollisionQueryParams& CollisionQueryParams, FHitResult& HitResult)
+{
+	const FVector& WorldOrigin = Grid.Origins[index];
+	const FVector& WorldDirection = Grid.Directions[index];
+
+	ECollisionChannel TraceChannel = ECollisionChannel::ECC_Visibility; // FIXME?
+	return World->LineTraceSingleByChannel(
+		HitResult,
+		WorldOrigin,
+		WorldOrigin + WorldDirection * HitResultTraceDistance,
+		TraceChannel,
+		CollisionQueryParams);
+}
+
+/**
+ * Maps the actors in the objects array of a capture to their labels, so
+ * that each hit is looked up in constant time. The map is kept across calls,
+ * and only rebuilt when the objects array changes.
+ */
+struct FCaptureLabelMap {
+	TArray<const AActor*> Objects;
+	// label (1..nObjects) of the first occurrence of each actor in Objects
+	TMap<const AActor*, int32> Labels;
+	// index in Objects of the next occurrence of the same actor, or INDEX_NONE
+	TArray<int32> NextDuplicate;
+};
+
+static FCaptureLabelMap GCaptureLabelMap;
+
+const FCaptureLabelMap& GetCaptureLabelMap(const AActor** objects, int nObjects)
+{
+	FCaptureLabelMap& Map = GCaptureLabelMap;
+	if (Map.Objects.Num() == nObjects &&
+		(nObjects == 0 || FMemory::Memcmp(Map.Objects.GetData(), objects, nObjects * sizeof(AActor*)) == 0)) {
+		return Map;
+	}
+
+	Map.Objects.Reset();
+	Map.Objects.Append(objects, nObjects);
+	Map.Labels.Reset();
+	Map.NextDuplicate.Init(INDEX_NONE, nObjects);
+	TMap<const AActor*, int32> LastIndex;
+	for (int i = 0; i < nObjects; i++) {
+		if (int32* Last = LastIndex.Find(objects[i])) {
+			Map.NextDuplicate[*Last] = i;
+			*Last = i;
+		} else {
+			Map.Labels.Add(objects[i], i+1);
+			LastIndex.Add(objects[i], i);
+		}
+	}
+	return Map;
+}
+
+// Returns the index (1..nObjects) in objects of the actor that was hit, or 0
+int GetSegmentationLabel(const FHitResult& HitResult, bool bHit, const FCaptureLabelMap& LabelMap)
+{
+	if(bHit) {
+		AActor* Actor = HitResult.GetActor();
+		if(Actor != NULL)
+		{
+			const int32* Label = LabelMap.Labels.Find(Actor);
+			if (Label != NULL) {
+				return *Label;
+			}
+		}
+	}
+	return 0;
+}
+
+// Calls Emit(i) for each i such that objects[i] is on the ray through (x, y), even if occluded
+template<typename EmitType>
+void ForEachCaptureMaskHit(UWorld* World, const FCaptureRayGrid& Grid, int x, int y, int index, const FCollisionQueryParams& CollisionQueryParams, const FCaptureLabelMap& LabelMap, bool verbose, const EmitType& Emit)
+{
+	const FVector& WorldOrigin = Grid.Origins[index];
+	const FVector& WorldDirection = Grid.Directions[index];
+
+	TArray<struct FHitResult> HitResults;
+
+	// LineTraceMultiByChannel stops recording hits after it sees a blocking hit in the trace channel,
+	// so we don't want any objects to generate blocking hits.
+	//
+	// By setting collision channel to 0 (default) and CollisionResponseParams to ECR_Overlap,
+	// I cause all objects to generate non-blocking (Overlap) hit events
+	//
+	// Note: bHit is true only if a blocking hit is generated, so it should always be false here
+	World->LineTraceMultiByChannel(HitResults, WorldOrigin, WorldOrigin + WorldDirection * HitResultTraceDistance, (ECollisionChannel) 0, CollisionQueryParams, FCollisionResponseParams(ECR_Overlap));
+
+	for(int h = 0; h < HitResults.Num(); h++) {
+		AActor* Actor = HitResults[h].GetActor();
+		const int32* Label = Actor ? LabelMap.Labels.Find(Actor) : NULL;
+		if (Label == NULL) {
+			continue;
+		}
+		for (int32 i = *Label - 1; i != INDEX_NONE; i = LabelMap.NextDuplicate[i]) {
+			if(verbose) {
+				printf("  >> %d %d %d %d %p %p\n", x, y, i, h, Actor, LabelMap.Objects[i]);
+			}
+			Emit(i);
+		}
+	}
+}
+
+// Sets mask_values[i] to 1 if objects[i] is on the ray through (x, y), even if occluded, and 0 otherwise
+void TraceCaptureMasks(UWorld* World, const FCaptureRayGrid& Grid, int x, int y, int index, const FCollisionQueryParams& CollisionQueryParams, const FCaptureLabelMap& LabelMap, char* mask_values, bool verbose)
+{
+	FMemory::Memzero(mask_values, LabelMap.Objects.Num());
+	ForEachCaptureMaskHit(World, Grid, x, y, index, CollisionQueryParams, LabelMap, verbose, [&](int32 i) {
+		mask_values[i] = 1;
+	});
+}
+
+// Returns the distance of the hit along the camera axis, or 0 if nothing was hit
+float GetCaptureDepth(const FHitResult& HitResult, bool bHit, const FCaptureCamera& Camera)
+{
+	if(bHit) {
+		const auto &HitLoc = HitResult.Location;
+		return FVector::DotProduct(HitLoc - Camera.Location, Camera.Forward);
+	}
+	return 0;
+}
+
+// Calculates the optical flow (in pixels/s) of the hit point at grid pixel index.
+// Grid must have its flow Jacobian, see BuildCaptureFlowJacobian().
+FVector2D GetCaptureOpticalFlow(const FHitResult& HitResult, bool bHit, const FCaptureCamera& Camera, const FCaptureRayGrid& Grid, int x, int y, int index, bool verbose)
+{
+	FVector2D Flow(0, 0);
+	if(!bHit) {
+		return Flow;
+	}
+
+	// Get the location and velocity of the hit object
+	FVector PointVel;
+	const auto &HitLoc = HitResult.Location;
+	AActor* Actor = HitResult.GetActor();
+	FBodyInstance* ActorBodyInst = GetBodyInstance(Actor);
+	if(ActorBodyInst != NULL)
+	{
+		PointVel = ActorBodyInst->GetUnrealWorldVelocityAtPoint(HitLoc);
+	} else {
+		printf("BodyInst null\n");
+		PointVel = Actor->GetVelocity();
+	}
+
+	// Velocity of the point relative to the (translating and rotating) camera
+	FVector RelVel = PointVel - Camera.Velocity - FVector::CrossProduct(Camera.AngularVelocity, HitLoc - Camera.ViewOrigin);
+
+	// calculate the optical flow
+	const FVector& GradX = Grid.FlowGradX[index];
+	const FVector& GradY = Grid.FlowGradY[index];
+	float ClipW = Grid.GetClipW(HitLoc);
+	Flow.X = FVector::DotProduct(RelVel, GradX) / ClipW;
+	Flow.Y = FVector::DotProduct(RelVel, GradY) / ClipW;
+
+	if(verbose) {
+		printf("(%d, %d) PlayerRot: (%g, %g, %g) PointVel: (%g, %g, %g), CamVel: (%g, %g, %g) CamAngVel: (%g, %g, %g) GradX: (%g, %g, %g) GradY: (%g, %g, %g) ClipW: %g Flow: (%g, %g)\n",
+			x, y,
+			Camera.Rotation.Pitch, Camera.Rotation.Yaw, Camera.Rotation.Roll,
+			PointVel.X, PointVel.Y, PointVel.Z,
+			Camera.Velocity.X, Camera.Velocity.Y, Camera.Velocity.Z,
+			Camera.AngularVelocity.X, Camera.AngularVelocity.Y, Camera.AngularVelocity.Z,
+			GradX.X, GradX.Y, GradX.Z,
+			GradY.X, GradY.Y, GradY.Z,
+			ClipW,
+			Flow.X, Flow.Y);
+	}
+	return Flow;
+}
+
+// Converts flow to RGB, where hue represents direction and saturation represents magnitude
+FLinearColor OpticalFlowToRGB(const FVector2D& Flow, float maxFlow)
+{
+	FVector PolarFlow;
+	FMath::CartesianToPolar(Flow.X, Flow.Y, PolarFlow.X, PolarFlow.Y);
+	float Hue = FMath::RadiansToDegrees(PolarFlow.Y);
+	if(Hue < 0) Hue = Hue + 360.f;
+	float Sat = FMath::Clamp(PolarFlow.X / maxFlow, 0.f, 1.f);
+
+	FLinearColor HSV(Hue, Sat, 1);
+	return HSV.HSVToLinearRGB();
+}
+
+/**
+ * Calculate the segmentation for a set of objects in the viewport image.
+ * Each value in seg_data is the index in the objects array of the object at that pixel, or 0.
+ *
+ * @param _this the TorchPluginComponent
+ * @param size the size of the viewport.
+ * @param seg_data an int array of size->Y/stride * size->X/stride elements.
+ *                 This array is filled with the segmentation data in [Y,X] order.
+ *                 Each value (1..nObjects) corresponds to the index of the foreground object in the objects array,
+ *                 or 0 if none of the objects is in the foreground at this pixel.
+ * @param stride stride in pixels at which to compute the optical flow.
+ * @param objects array of nObjects Actor* pointers which will be recorded in the segmentation mask
+ * @param nObjects size of the objects array
+ * @param verbose verbose output
+ * @returns true if the optical flow capture was successful
+ */
+extern "C" UETORCH_API bool CaptureSegmentation(UObject* _this, const IntSize* size, void* seg_data, int stride, const AActor** objects, int nObjects, bool verbose)
+{
+	TORCH_PROFILE_SCOPE("CaptureSegmentation", STAT_TorchCapture);
+	FViewport* Viewport = nullptr;
+	APlayerController* PlayerController = nullptr;
+	UWorld* World = nullptr;
+	FSceneView* SceneView = nullptr;
+
+	bool bOk = InitCapture(_this, size, &Viewport, &PlayerController, &World, &SceneView);
+	if(!bOk) {
+		return false;
+	}
+	const FCaptureRayGrid& Grid = GetCaptureRayGrid(SceneView, size, stride);
+	const FCaptureLabelMap& LabelMap = GetCaptureLabelMap(objects, nObjects);
+
+	bool bTraceComplex = false;
+	int* seg_values = (int*) seg_data;
+
+	if(verbose) {
+		for(int i = 0; i < nObjects; i++) {
+			printf("Object %d: %p\n", i, objects[i]);
+		}
+	}
+
+	// Iterate over pixels
+	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
+	ForEachCapturePixel(size, stride, verbose, [&](int x, int y, int index) {
+		FHitResult HitResult;
+		bool bHit = TraceCapturePixel(World, Grid, index, CollisionQueryParams, HitResult);
+		seg_values[index] = GetSegmentationLabel(HitResult, bHit, LabelMap);
+
+		if(verbose) {
+			printf("(%d, %d) Actor: %p Seg: %d bHit: %d\n",
+				x, y, bHit ? HitResult.GetActor() : NULL, seg_values[index], bHit);
+		}
+	});
+	CountCapture((int64) Grid.NX * Grid.NY, (int64) Grid.NX * Grid.NY * sizeof(int));
+	return true;
+}
+
+/**
+ * Like CaptureSegmentation, except that occluded objects are captured as well
+ *
+ * @param _this the TorchPluginComponent
+ * @param size the size of the viewport.
+ * @param seg_data an int array of size->Y/stride * size->X/stride * nObjects elements.
+ *                 This array is filled with the segmentation data in [Y,X,object] order.
+ *                 Each value (y,x,i) is 1 if object i is at pixel (y,x) (even if occluded), 0 otherwise.
+ * @param stride stride in pixels at which to compute the optical flow.
+ * @param objects array of nObjects Actor* pointers which will be recorded in the segmentation mask
+ * @param nObjects size of the objects array
+ * @param verbose verbose output
+ * @returns true if the optical flow capture was successful
+ */
+extern "C" UETORCH_API bool CaptureMasks(UObject* _this, const IntSize* size, void* seg_data, int stride, const AActor** objects, int nObjects, bool verbose)
+{
+	TORCH_PROFILE_SCOPE("CaptureMasks", STAT_TorchCapture);
+	FViewport* Viewport = nullptr;
+	APlayerController* PlayerController = nullptr;
+	UWorld* World = nullptr;
+	FSceneView* SceneView = nullptr;
+
+	bool bOk = InitCapture(_this, size, &Viewport, &PlayerController, &World, &SceneView);
+	if(!bOk) {
+		return false;
+	}
+	const FCaptureRayGrid& Grid = GetCaptureRayGrid(SceneView, size, stride);
+	const FCaptureLabelMap& LabelMap = GetCaptureLabelMap(objects, nObjects);
+
+	bool bTraceComplex = false;
+	char* seg_values = (char*) seg_data;
 
-	float HitResultTraceDistance = 100000.f;
-
-	ECollisionChannel TraceChannel = ECollisionChannel::ECC_Visibility;
-	bool bTraceComplex = false;
-	FHitResult HitResult;
-	int* seg_values = (int*) seg_data;
-
 	if(verbose) {
 		for(int i = 0; i < nObjects; i++) {
 			printf("Object %d: %p\n", i, objects[i]);
 		}
 	}
 
-	// Iterate over pixels
-	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
-	for (int y = 0; y < size->Y; y+=stride) {
-		for (int x = 0; x < size->X; x+=stride) {
-
-			FVector2D ScreenPosition(x, y);
-			FVector WorldOrigin, WorldDirection;
-			FSceneView__SafeDeprojectFVector2D(SceneView, ScreenPosition, WorldOrigin, WorldDirection);
-			// Cast ray from pixel to find intersecting object
-			bool bHit = World->LineTraceSingleByChannel(HitResult, WorldOrigin, WorldOrigin + WorldDirection * HitResultTraceDistance, TraceChannel, CollisionQueryParams);
-			AActor* Actor = NULL;
-			*seg_values = 0; // no foreground object
-			if(bHit) {
-				Actor = HitResult.GetActor();
-				if(Actor != NULL)
-				{
-					for (int i = 0; i < nObjects; i++) {
-						if (objects[i] == Actor) {
-							*seg_values = i+1;
-							break;
-						}
-					}
-				}
-			}
+	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
+	ForEachCapturePixel(size, stride, verbose, [&](int x, int y, int index) {
+		TraceCaptureMasks(World, Grid, x, y, index, CollisionQueryParams, LabelMap, seg_values + (size_t) index * nObjects, verbose);
+	});
+	CountCapture((int64) Grid.NX * Grid.NY, (int64) Grid.NX * Grid.NY * nObjects);
+	return true;
+}
+
+/**
+ * Like CaptureMasks, but with the masks packed as bits: 64 objects per
+ * 64-bit word.
+ *
+ * @param _this the TorchPluginComponent
+ * @param size the size of the viewport.
+ * @param mask_data a uint64 array of size->Y/stride * size->X/stride * nWords elements,
+ *                  with nWords = ceil(nObjects / 64), in [Y,X,word] order.
+ *                  Bit i % 64 of word i / 64 of pixel (y,x) is 1 if object i is
+ *                  at pixel (y,x) (even if occluded), 0 otherwise.
+ * @param stride stride in pixels at which to compute the masks.
+ * @param objects array of nObjects Actor* pointers which will be recorded in the masks
+ * @param nObjects size of the objects array
+ * @param verbose verbose output
+ * @returns true if the capture was successful
+ */
+extern "C" UETORCH_API bool CaptureMasksPacked(UObject* _this, const IntSize* size, void* mask_data, int stride, const AActor** objects, int nObjects, bool verbose)
+{
+	TORCH_PROFILE_SCOPE("CaptureMasksPacked", STAT_TorchCapture);
+	FViewport* Viewport = nullptr;
+	APlayerController* PlayerController = nullptr;
+	UWorld* World = nullptr;
+	FSceneView* SceneView = nullptr;
+
+	bool bOk = InitCapture(_this, size, &Viewport, &PlayerController, &World, &SceneView);
+	if(!bOk) {
+		return false;
+	}
+	const FCaptureRayGrid& Grid = GetCaptureRayGrid(SceneView, size, stride);
+	const FCaptureLabelMap& LabelMap = GetCaptureLabelMap(objects, nObjects);
+
+	const int32 nWords = (nObjects + 63) / 64;
+	uint64* words = (uint64*) mask_data;
+	bool bTraceComplex = false;
+	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
+	ForEachCapturePixel(size, stride, verbose, [&](int x, int y, int index) {
+		uint64* pixel_words = words + (size_t) index * nWords;
+		FMemory::Memzero(pixel_words, nWords * sizeof(uint64));
+		ForEachCaptureMaskHit(World, Grid, x, y, index, CollisionQueryParams, LabelMap, verbose, [&](int32 i) {
+			pixel_words[i / 64] |= ((uint64) 1) << (i % 64);
+		});
+	});
+	CountCapture((int64) Grid.NX * Grid.NY, (int64) Grid.NX * Grid.NY * nWords * sizeof(uint64));
+	return true;
+}
+
+// The runs of the last CaptureMasksRLE, see GetMaskRuns()
+static TArray<int32> GCaptureMaskRuns;
+
+/**
+ * Like CaptureMasks, but with the mask of each object run-length encoded.
+ * Pixels are numbered in [Y,X] order (i.e. index = y * X + x on the strided
+ * grid), and the mask of each object is a list of runs of consecutive pixels
+ * where the object is present. The runs are built row by row during the trace.
+ * They are kept until the next call; fetch them with GetMaskRuns.
+ *
+ * The encoding is an int array which, for each object i in order, has the
+ * number of runs n_i, followed by n_i pairs (first pixel, run length).
+ *
+ * @param _this the TorchPluginComponent
+ * @param size the size of the viewport.
+ * @param stride stride in pixels at which to compute the masks.
+ * @param objects array of nObjects Actor* pointers which will be recorded in the masks
+ * @param nObjects size of the objects array
+ * @param verbose verbose output
+ * @returns the number of ints in the encoding, or -1 on failure
+ */
+extern "C" UETORCH_API int CaptureMasksRLE(UObject* _this, const IntSize* size, int stride, const AActor** objects, int nObjects, bool verbose)
+{
+	TORCH_PROFILE_SCOPE("CaptureMasksRLE", STAT_TorchCapture);
+	FViewport* Viewport = nullptr;
+	APlayerController* PlayerController = nullptr;
+	UWorld* World = nullptr;
+	FSceneView* SceneView = nullptr;
+
+	bool bOk = InitCapture(_this, size, &Viewport, &PlayerController, &World, &SceneView);
+	if(!bOk) {
+		return -1;
+	}
+	const FCaptureRayGrid& Grid = GetCaptureRayGrid(SceneView, size, stride);
+	const FCaptureLabelMap& LabelMap = GetCaptureLabelMap(objects, nObjects);
+
+	// RowRuns[iy * nObjects + i] holds the (start, length) pairs of object i in row iy
+	TArray<TArray<int32>> RowRuns;
+	RowRuns.SetNum(Grid.NY * nObjects);
+
+	bool bTraceComplex = false;
+	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
+	ParallelFor(Grid.NY, [&](int32 iy) {
+		TArray<int32>* Runs = RowRuns.GetData() + iy * nObjects;
+		// the last pixel where each object was present, to extend its current run
+		TArray<int32> Last;
+		Last.Init(INDEX_NONE, nObjects);
+		for (int32 ix = 0; ix < Grid.NX; ix++) {
+			const int32 index = iy * Grid.NX + ix;
+			ForEachCaptureMaskHit(World, Grid, ix * stride, iy * stride, index, CollisionQueryParams, LabelMap, verbose, [&](int32 i) {
+				if (Last[i] == index) {
+					return; // the same actor was hit twice
+				}
+				if (Last[i] != INDEX_NONE && Last[i] == index - 1) {
+					Runs[i].Last()++;
+				} else {
+					Runs[i].Add(index);
+					Runs[i].Add(1);
+				}
+				Last[i] = index;
+			});
+		}
+	}, verbose || !GParallelCapture);
+
+	// concatenate the rows, merging runs that continue from one row to the next
+	GCaptureMaskRuns.Reset();
+	for (int32 i = 0; i < nObjects; i++) {
+		const int32 CountIndex = GCaptureMaskRuns.Add(0);
+		for (int32 iy = 0; iy < Grid.NY; iy++) {
+			const TArray<int32>& Runs = RowRuns[iy * nObjects + i];
+			for (int32 r = 0; r < Runs.Num(); r += 2) {
+				const int32 nRuns = GCaptureMaskRuns[CountIndex];
+				if (nRuns > 0 && GCaptureMaskRuns.Last(1) + GCaptureMaskRuns.Last() == Runs[r]) {
+					GCaptureMaskRuns.Last() += Runs[r + 1];
+				} else {
+					GCaptureMaskRuns.Add(Runs[r]);
+					GCaptureMaskRuns.Add(Runs[r + 1]);
+					GCaptureMaskRuns[CountIndex]++;
+				}
+			}
+		}
+	}
+	CountCapture((int64) Grid.NX * Grid.NY, GCaptureMaskRuns.Num() * sizeof(int32));
+	return GCaptureMaskRuns.Num();
+}
+
+/**
+ * Copy the runs of the last CaptureMasksRLE.
+ *
+ * @param runs an int array of n elements
+ * @param n the number of elements returned by CaptureMasksRLE
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool GetMaskRuns(int* runs, int n)
+{
+	if (n != GCaptureMaskRuns.Num()) {
+		printf("GetMaskRuns: expected %d elements, got %d\n", GCaptureMaskRuns.Num(), n);
+		return false;
+	}
+	FMemory::Memcpy(runs, GCaptureMaskRuns.GetData(), n * sizeof(int32));
+	return true;
+}
+
+/**
+ * Decode masks captured by CaptureMasksPacked.
+ *
+ * @param mask_data the packed masks of nPixels pixels
+ * @param nPixels the number of pixels
+ * @param nObjects the number of objects
+ * @param masks a byte array of nObjects * nPixels elements, filled in [object,pixel] order
+ */
+extern "C" UETORCH_API void UnpackMasks(const void* mask_data, int nPixels, int nObjects, void* masks)
+{
+	const int32 nWords = (nObjects + 63) / 64;
+	const uint64* words = (const uint64*) mask_data;
+	uint8* values = (uint8*) masks;
+	ParallelFor(nObjects, [&](int32 i) {
+		const uint64* word = words + i / 64;
+		const uint64 bit = ((uint64) 1) << (i % 64);
+		uint8* mask = values + (size_t) i * nPixels;
+		for (int32 p = 0; p < nPixels; p++) {
+			mask[p] = (word[(size_t) p * nWords] & bit) ? 1 : 0;
+		}
+	}, !GParallelCapture);
+}
+
+/**
+ * Decode masks captured by CaptureMasksRLE.
+ *
+ * @param runs the encoded runs, see CaptureMasksRLE
+ * @param n the number of elements in runs
+ * @param nPixels the number of pixels
+ * @param nObjects the number of objects
+ * @param masks a byte array of nObjects * nPixels elements, filled in [object,pixel] order
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool DecodeMaskRuns(const int* runs, int n, int nPixels, int nObjects, void* masks)
+{
+	uint8* values = (uint8*) masks;
+	FMemory::Memzero(values, (size_t) nObjects * nPixels);
+	int32 r = 0;
+	for (int32 i = 0; i < nObjects; i++) {
+		if (r >= n) {
+			printf("DecodeMaskRuns: truncated runs\n");
+			return false;
+		}
+		const int32 nRuns = runs[r++];
+		if (r + 2 * nRuns > n) {
+			printf("DecodeMaskRuns: truncated runs\n");
+			return false;
+		}
+		uint8* mask = values + (size_t) i * nPixels;
+		for (int32 k = 0; k < nRuns; k++, r += 2) {
+			const int32 Start = runs[r];
+			const int32 Length = runs[r + 1];
+			if (Start < 0 || Length < 0 || Start + Length > nPixels) {
+				printf("DecodeMaskRuns: bad run (%d, %d)\n", Start, Length);
+				return false;
+			}
+			FMemory::Memset(mask + Start, 1, Length);
+		}
+	}
+	return true;
+}
+
+/**
+ * Calculate the optical flow at each pixel in the viewport, in pixels per
+ * second. The camera moves with the velocity of the player character
+ * (its movement component), and turns as the view rotation.
+ *
+ * Note that before the flow was computed from the projection Jacobian, it
+ * was measured in pixels per second divided by the near clip plane distance
+ * (10 by default), i.e. about 10 times smaller, and the camera velocity was
+ * the velocity of the player's physics body.
+ *
+ * @param _this the TorchPluginComponent
+ * @param size the size of the viewport.
+ * @param flow_data a float array of size->Y/stride * size->X/stride * 2 elements.
+ *                  This array is filled with optical flow vectors (of dim 2) in [Y,X] order.
+ * @param rgb_data a float array of size->Y/stride * size->X/stride * 3 elements.
+ *                  This array is filled with the optical flow RGB data in [Y,X,color] order.
+ * @param maxFlow the scale for the RGB flow data, in pixels per second. At flow=maxFlow, the RGB output is saturated at 1.
+ * @param stride stride in pixels at which to compute the optical flow.
+ * @param verbose verbose output
+ * @returns true if the optical flow capture was successful
+ */
+extern "C" UETORCH_API bool CaptureOpticalFlow(UObject* _this, const IntSize* size, void* flow_data, void* rgb_data, float maxFlow, int stride, bool verbose)
+{
+	TORCH_PROFILE_SCOPE("CaptureOpticalFlow", STAT_TorchCapture);
+	FViewport* Viewport = nullptr;
+	APlayerController* PlayerController = nullptr;
+	UWorld* World = nullptr;
+	FSceneView* SceneView = nullptr;
 
-			if(verbose) {
-				printf("(%d, %d) Actor: %p Seg: %d bHit: %d\n",
-					x, y, Actor, *seg_values, bHit);
-			}
-			seg_values++;
-		}
+	bool bOk = InitCapture(_this, size, &Viewport, &PlayerController, &World, &SceneView);
+	if(!bOk) {
+		return false;
+	}
+	const FCaptureRayGrid& Grid = GetCaptureRayGrid(SceneView, size, stride, true);
+
+	// 1. Get player/camera info
+	FCaptureCamera Camera;
+	if(!InitCaptureCamera(_this, PlayerController, World, SceneView, &Camera)) {
+		return false;
 	}
+
+	// 2. Iterate over pixels
+	bool bTraceComplex = false; // FIXME?
+	float* flow_values = (float*) flow_data;
+	float* rgb_values  = (float*) rgb_data;
+	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
+	ForEachCapturePixel(size, stride, verbose, [&](int x, int y, int index) {
+		// 3. Cast ray from pixel to find intersecting object
+		FHitResult HitResult;
+		bool bHit = TraceCapturePixel(World, Grid, index, CollisionQueryParams, HitResult);
+
+		// 4. calculate the optical flow
+		FVector2D Flow = GetCaptureOpticalFlow(HitResult, bHit, Camera, Grid, x, y, index, verbose);
+		flow_values[2 * index]     = Flow.X;
+		flow_values[2 * index + 1] = Flow.Y;
+
+		// 5. Convert flow to RGB optical flow
+		FLinearColor color = OpticalFlowToRGB(Flow, maxFlow);
+		rgb_values[3 * index]     = color.R;
+		rgb_values[3 * index + 1] = color.G;
+		rgb_values[3 * index + 2] = color.B;
+	});
+	CountCapture((int64) Grid.NX * Grid.NY, (int64) Grid.NX * Grid.NY * 5 * sizeof(float));
 	return true;
 }
 
+
 /**
- * Like CaptureSegmentation, except that occluded objects are captured as well
+ * Calculate the depth field.
  *
  * @param _this the TorchPluginComponent
  * @param size the size of the viewport.
- * @param seg_data an int array of size->Y/stride * size->X/stride * nObjects elements.
- *                 This array is filled with the segmentation data in [Y,X,object] order.
- *                 Each value (y,x,i) is 1 if object i is at pixel (y,x) (even if occluded), 0 otherwise.
+ * @param data a float array of size->Y/stride * size->X/stride
+ *             This array is filled with depth information.
  * @param stride stride in pixels at which to compute the optical flow.
- * @param objects array of nObjects Actor* pointers which will be recorded in the segmentation mask
- * @param nObjects size of the objects array
  * @param verbose verbose output
  * @returns true if the optical flow capture was successful
  */
-extern "C" UETORCH_API bool CaptureMasks(UObject* _this, const IntSize* size, void* seg_data, int stride, const AActor** objects, int nObjects, bool verbose)
+extern "C" UETORCH_API bool CaptureDepthField(UObject* _this, const IntSize* size, void* data, int stride, bool verbose)
 {
+	TORCH_PROFILE_SCOPE("CaptureDepthField", STAT_TorchCapture);
 	FViewport* Viewport = nullptr;
 	APlayerController* PlayerController = nullptr;
 	UWorld* World = nullptr;
@@ -419,113 +2238,357 @@ extern "C" UETORCH_API bool CaptureMasks(UObject* _this, const IntSize* size, vo
 	if(!bOk) {
 		return false;
 	}
+	const FCaptureRayGrid& Grid = GetCaptureRayGrid(SceneView, size, stride);
 
-	float HitResultTraceDistance = 100000.f;
+	FCaptureCamera Camera;
+	if(!InitCaptureCamera(_this, PlayerController, World, SceneView, &Camera)) {
+		return false;
+	}
 
-	ECollisionChannel TraceChannel = ECollisionChannel::ECC_Visibility;
-	bool bTraceComplex = false;
-	TArray<struct FHitResult> HitResults;
-	char* seg_values = (char*) seg_data;
+	bool bTraceComplex = false; // FIXME?
+	float* values = (float*) data;
+	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
+	ForEachCapturePixel(size, stride, false, [&](int x, int y, int index) {
+		FHitResult HitResult;
+		bool bHit = TraceCapturePixel(World, Grid, index, CollisionQueryParams, HitResult);
+		values[index] = GetCaptureDepth(HitResult, bHit, Camera);
+	});
+	CountCapture((int64) Grid.NX * Grid.NY, (int64) Grid.NX * Grid.NY * sizeof(float));
+	return true;
+}
 
-	if(verbose) {
-		for(int i = 0; i < nObjects; i++) {
-			printf("Object %d: %p\n", i, objects[i]);
+// A traced (or interpolated) pixel of an adaptive capture
+struct FAdaptiveCaptureSample {
+	int32 Label;
+	float Depth;
+};
+
+// Whether the four corners of a cell are close enough to fill the cell without tracing
+static bool IsAdaptiveCaptureCellUniform(const FAdaptiveCaptureSample* Corners[4], bool bSegmentation, bool bDepth, float depthTolerance)
+{
+	float MinDepth = Corners[0]->Depth;
+	float MaxDepth = Corners[0]->Depth;
+	for (int i = 1; i < 4; i++) {
+		if (bSegmentation && Corners[i]->Label != Corners[0]->Label) {
+			return false;
 		}
+		MinDepth = FMath::Min(MinDepth, Corners[i]->Depth);
+		MaxDepth = FMath::Max(MaxDepth, Corners[i]->Depth);
+	}
+	// either all rays missed, or all hit at similar depths
+	return !bDepth || MaxDepth == 0 || (MinDepth > 0 && MaxDepth <= MinDepth * (1 + depthTolerance));
+}
+
+/**
+ * Calculate the segmentation and/or depth field at full resolution with
+ * adaptive sampling.
+ * The viewport is traced on a coarse grid of baseStride pixels, and each
+ * coarse cell is recursively split into quadrants until the labels and the
+ * depths at its four corners agree. Cells whose corners agree are filled
+ * without tracing: with the corner label, and with the depth interpolated
+ * bilinearly in 1/depth, which is exact for planar surfaces.
+ * Objects smaller than baseStride may be missed if they fall between the
+ * corners of a cell.
+ *
+ * @param _this the TorchPluginComponent
+ * @param size the size of the viewport.
+ * @param baseStride the spacing of the coarse grid, in pixels
+ * @param objects array of nObjects Actor* pointers which will be recorded in the segmentation
+ * @param nObjects size of the objects array
+ * @param seg_data NULL, or an int array of size->Y * size->X elements,
+ *                 filled like the seg_data of CaptureSegmentation with stride 1
+ * @param depth_data NULL, or a float array of size->Y * size->X elements,
+ *                   filled like the data of CaptureDepthField with stride 1
+ * @param depthTolerance the maximum relative difference between the corner
+ *                       depths of a cell that is filled without tracing
+ * @param nRays if not NULL, filled with the number of rays that were traced
+ * @param verbose verbose output
+ * @returns true if the capture was successful
+ */
+extern "C" UETORCH_API bool CaptureAdaptive(UObject* _this, const IntSize* size, int baseStride, const AActor** objects, int nObjects, void* seg_data, void* depth_data, float depthTolerance, int* nRays, bool verbose)
+{
+	TORCH_PROFILE_SCOPE("CaptureAdaptive", STAT_TorchCapture);
+	FViewport* Viewport = nullptr;
+	APlayerController* PlayerController = nullptr;
+	UWorld* World = nullptr;
+	FSceneView* SceneView = nullptr;
+
+	bool bOk = InitCapture(_this, size, &Viewport, &PlayerController, &World, &SceneView);
+	if(!bOk) {
+		return false;
+	}
+	const FCaptureRayGrid& Grid = GetCaptureRayGrid(SceneView, size, 1);
+	const FCaptureLabelMap& LabelMap = GetCaptureLabelMap(objects, nObjects);
+
+	FCaptureCamera Camera;
+	if(!InitCaptureCamera(_this, PlayerController, World, SceneView, &Camera)) {
+		return false;
+	}
+
+	const bool bSegmentation = seg_data != NULL;
+	const bool bDepth = depth_data != NULL;
+	const int32 W = size->X;
+	const int32 H = size->Y;
+	baseStride = FMath::Max(baseStride, 1);
+
+	// the coarse grid lines, always including the last row and column
+	TArray<int32> XS, YS;
+	for (int32 x = 0; x < W - 1; x += baseStride) {
+		XS.Add(x);
+	}
+	XS.Add(W - 1);
+	for (int32 y = 0; y < H - 1; y += baseStride) {
+		YS.Add(y);
 	}
+	YS.Add(H - 1);
+	const int32 NCX = FMath::Max(XS.Num() - 1, 1);
+	const int32 NCY = FMath::Max(YS.Num() - 1, 1);
 
-	AActor* Actor = nullptr;
+	TArray<FAdaptiveCaptureSample> Samples;
+	Samples.SetNumUninitialized(W * H);
+	TArray<uint8> Traced;
+	Traced.SetNumZeroed(W * H);
+	FThreadSafeCounter RayCount;
+
+	bool bTraceComplex = false;
 	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
-	for (int y = 0; y < size->Y; y+=stride) {
-		for (int x = 0; x < size->X; x+=stride) {
-
-			FVector2D ScreenPosition(x, y);
-
-			FVector WorldOrigin, WorldDirection;
-			FSceneView__SafeDeprojectFVector2D(SceneView, ScreenPosition, WorldOrigin, WorldDirection);
-
-			HitResults.Reset();
-
-			// LineTraceMultiByChannel stops recording hits after it sees a blocking hit in the trace channel,
-			// so we don't want any objects to generate blocking hits.
-			//
-			// By setting collision channel to 0 (default) and CollisionResponseParams to ECR_Overlap,
-			// I cause all objects to generate non-blocking (Overlap) hit events
-			//
-			// Note: bHit is true only if a blocking hit is generated, so it should always be false here
-			bool bHit = World->LineTraceMultiByChannel(HitResults, WorldOrigin, WorldOrigin + WorldDirection * HitResultTraceDistance, (ECollisionChannel) 0, CollisionQueryParams, FCollisionResponseParams(ECR_Overlap));
-
-			for (int i = 0; i < nObjects; i++) {
-				*seg_values = 0;
-				for(int h = 0; h < HitResults.Num(); h++) {
-					Actor = HitResults[h].GetActor();
-					if (Actor == objects[i]) {
-						if(verbose) {
-							printf("  >> %d %d %d %d %p %p\n", x, y, i, h, Actor, objects[i]);
+	auto Trace = [&](int32 x, int32 y) {
+		FHitResult HitResult;
+		bool bHit = TraceCapturePixel(World, Grid, y * W + x, CollisionQueryParams, HitResult);
+		RayCount.Increment();
+		FAdaptiveCaptureSample Sample;
+		Sample.Label = GetSegmentationLabel(HitResult, bHit, LabelMap);
+		Sample.Depth = GetCaptureDepth(HitResult, bHit, Camera);
+		return Sample;
+	};
+
+	const bool bForceSerial = verbose || !GParallelCapture;
+
+	// trace the coarse grid
+	ParallelFor(XS.Num() * YS.Num(), [&](int32 i) {
+		const int32 x = XS[i % XS.Num()];
+		const int32 y = YS[i / XS.Num()];
+		Samples[y * W + x] = Trace(x, y);
+		Traced[y * W + x] = 1;
+	}, bForceSerial);
+
+	// refine each coarse cell. A cell owns its pixels except for its right and
+	// bottom edges, which belong to the next cells; it only writes the pixels
+	// it owns, so that cells can be refined in parallel. Pixels on the edges
+	// it doesn't own are traced into a local map if the refinement needs them.
+	ParallelFor(NCX * NCY, [&](int32 CellIndex) {
+		const int32 cx = CellIndex % NCX;
+		const int32 cy = CellIndex / NCX;
+		const int32 CX0 = XS[cx];
+		const int32 CY0 = YS[cy];
+		const int32 CX1 = XS[FMath::Min(cx + 1, XS.Num() - 1)];
+		const int32 CY1 = YS[FMath::Min(cy + 1, YS.Num() - 1)];
+		const int32 OwnX1 = (cx == NCX - 1) ? CX1 : CX1 - 1;
+		const int32 OwnY1 = (cy == NCY - 1) ? CY1 : CY1 - 1;
+
+		TMap<int32, FAdaptiveCaptureSample> Borrowed;
+		auto Sample = [&](int32 x, int32 y) -> const FAdaptiveCaptureSample& {
+			const int32 index = y * W + x;
+			const bool bCoarse = (x == CX0 || x == CX1) && (y == CY0 || y == CY1);
+			if (bCoarse || (x <= OwnX1 && y <= OwnY1)) {
+				if (!Traced[index]) {
+					Samples[index] = Trace(x, y);
+					Traced[index] = 1;
+				}
+				return Samples[index];
+			}
+			FAdaptiveCaptureSample* Found = Borrowed.Find(index);
+			return Found ? *Found : Borrowed.Add(index, Trace(x, y));
+		};
+
+		TArray<FIntRect> Stack;
+		Stack.Add(FIntRect(CX0, CY0, CX1, CY1));
+		while (Stack.Num() > 0) {
+			const FIntRect Cell = Stack.Pop(false);
+			const int32 X0 = Cell.Min.X, Y0 = Cell.Min.Y, X1 = Cell.Max.X, Y1 = Cell.Max.Y;
+			// copies, since adding to Borrowed may move its elements
+			const FAdaptiveCaptureSample S00 = Sample(X0, Y0);
+			const FAdaptiveCaptureSample S10 = Sample(X1, Y0);
+			const FAdaptiveCaptureSample S01 = Sample(X0, Y1);
+			const FAdaptiveCaptureSample S11 = Sample(X1, Y1);
+			if (X1 - X0 <= 1 && Y1 - Y0 <= 1) {
+				continue;
+			}
+
+			const FAdaptiveCaptureSample* Corners[4] = { &S00, &S10, &S01, &S11 };
+			if (IsAdaptiveCaptureCellUniform(Corners, bSegmentation, bDepth, depthTolerance)) {
+				const bool bHit = S00.Depth > 0;
+				for (int32 y = Y0; y <= FMath::Min(Y1, OwnY1); y++) {
+					const float v = (Y1 > Y0) ? (y - Y0) / (float) (Y1 - Y0) : 0.0f;
+					for (int32 x = X0; x <= FMath::Min(X1, OwnX1); x++) {
+						const int32 index = y * W + x;
+						if (Traced[index]) {
+							continue;
+						}
+						const float u = (X1 > X0) ? (x - X0) / (float) (X1 - X0) : 0.0f;
+						Samples[index].Label = S00.Label;
+						Samples[index].Depth = 0;
+						if (bHit) {
+							const float InvDepth = FMath::BiLerp(1 / S00.Depth, 1 / S10.Depth, 1 / S01.Depth, 1 / S11.Depth, u, v);
+							Samples[index].Depth = 1 / InvDepth;
 						}
-						*seg_values = 1;
-						break;
 					}
 				}
-				seg_values++;
+				continue;
 			}
+
+			// split into (up to) four quadrants, along the axes that are more than one pixel wide
+			const int32 MX = (X1 - X0 > 1) ? (X0 + X1) / 2 : X1;
+			const int32 MY = (Y1 - Y0 > 1) ? (Y0 + Y1) / 2 : Y1;
+			Stack.Add(FIntRect(X0, Y0, MX, MY));
+			if (MX < X1) {
+				Stack.Add(FIntRect(MX, Y0, X1, MY));
+			}
+			if (MY < Y1) {
+				Stack.Add(FIntRect(X0, MY, MX, Y1));
+			}
+			if (MX < X1 && MY < Y1) {
+				Stack.Add(FIntRect(MX, MY, X1, Y1));
+			}
+		}
+	}, bForceSerial);
+
+	int* seg_values = (int*) seg_data;
+	float* depth_values = (float*) depth_data;
+	for (int32 index = 0; index < W * H; index++) {
+		if (bSegmentation) {
+			seg_values[index] = Samples[index].Label;
+		}
+		if (bDepth) {
+			depth_values[index] = Samples[index].Depth;
 		}
 	}
+
+	if (verbose) {
+		printf("Adaptive capture: %d rays for %d pixels\n", RayCount.GetValue(), W * H);
+	}
+	if (nRays != NULL) {
+		*nRays = RayCount.GetValue();
+	}
+	CountCapture(RayCount.GetValue(), (int64) W * H * ((bSegmentation ? sizeof(int) : 0) + (bDepth ? sizeof(float) : 0)));
 	return true;
 }
 
 /**
- * Helper function for optical flow
- * Calculate dPixel / dScreen, i.e. how much the pixel coordinates change in dimension dim
- * per change in coordinates on the camera near plane (the 'screen')
- *
- * FIXME:
- * Figuring out the ScreenDx and ScreenDy vectors with projective geometry is 'tricky'
- * so I do numerical differentiation instead.
- * I'm a bit worried about float precision here.
+ * Projects the corners of a world-space box with ViewProj (the view matrix
+ * times the projection matrix), and returns the enclosing rectangle in
+ * viewport pixels, clamped to the viewport.
+ * Returns false if the box is entirely behind the camera or outside the
+ * viewport. If the box crosses the camera plane, its projection is unbounded
+ * and the whole viewport is returned.
  */
-FVector getDPixelDScreen(const FVector2D &ScreenPosition, const int dim, const FSceneView *SceneView) {
-	// centered difference
-	FVector2D ScreenPositionP = ScreenPosition;
-	ScreenPositionP[dim] += 1;
-	FVector WorldOriginP, WorldDirectionP;
-	FSceneView__SafeDeprojectFVector2D(SceneView, ScreenPositionP, WorldOriginP, WorldDirectionP);
+bool ProjectBoundsToScreen(const FMatrix& ViewProj, const FIntRect& ViewRect, const IntSize* size, const FBox& Bounds, FBox2D& ScreenBox)
+{
+	const FBox2D Viewport(FVector2D(0, 0), FVector2D(size->X - 1, size->Y - 1));
+
+	ScreenBox.Init();
+	int32 nBehind = 0;
+	for (int i = 0; i < 8; i++) {
+		const FVector Corner(
+			(i & 1) ? Bounds.Max.X : Bounds.Min.X,
+			(i & 2) ? Bounds.Max.Y : Bounds.Min.Y,
+			(i & 4) ? Bounds.Max.Z : Bounds.Min.Z);
+		const FVector4 Clip = ViewProj.TransformFVector4(FVector4(Corner, 1.0f));
+		if (Clip.W <= KINDA_SMALL_NUMBER) {
+			nBehind++;
+			continue;
+		}
+		// same as FSceneView::ProjectWorldToScreen
+		const float NdcX = Clip.X / Clip.W;
+		const float NdcY = Clip.Y / Clip.W;
+		ScreenBox += FVector2D(
+			ViewRect.Min.X + (0.5f + NdcX * 0.5f) * ViewRect.Width(),
+			ViewRect.Min.Y + (0.5f - NdcY * 0.5f) * ViewRect.Height());
+	}
+	if (nBehind == 8) {
+		return false;
+	}
+	if (nBehind > 0) {
+		ScreenBox = Viewport;
+		return true;
+	}
+	if (!ScreenBox.Intersect(Viewport)) {
+		return false;
+	}
+	ScreenBox.Min = FVector2D(FMath::Max(ScreenBox.Min.X, 0.0f), FMath::Max(ScreenBox.Min.Y, 0.0f));
+	ScreenBox.Max = FVector2D(FMath::Min(ScreenBox.Max.X, Viewport.Max.X), FMath::Min(ScreenBox.Max.Y, Viewport.Max.Y));
+	return true;
+}
 
-	// centered difference
-	FVector2D ScreenPositionM = ScreenPosition;
-	ScreenPositionM[dim] -= 1;
-	FVector WorldOriginM, WorldDirectionM;
-	FSceneView__SafeDeprojectFVector2D(SceneView, ScreenPositionM, WorldOriginM, WorldDirectionM);
+/**
+ * State for CaptureSegmentationIncremental: the last labels and depths, the
+ * view and parameters they were captured with, and the transform and bounds
+ * of every actor in the world at that time.
+ */
+struct FIncrementalCapture {
+	struct FActorState {
+		FTransform Transform;
+		FBox Bounds;
+		bool bHidden;
+		uint32 Stamp;
+	};
+
+	bool bValid;
+	FMatrix ViewMatrix;
+	FMatrix ProjMatrix;
+	int32 SizeX;
+	int32 SizeY;
+	int32 Stride;
+	bool bDepth;
+	TArray<const AActor*> Objects;
+	TWeakObjectPtr<UWorld> World;
+	TArray<int32> Labels;
+	TArray<float> Depths;
+	TMap<TWeakObjectPtr<AActor>, FActorState> Actors;
+	uint32 Stamp;
+
+	FIncrementalCapture() : bValid(false), Stamp(0) {}
+};
 
-	FVector DScreenDPixel = (WorldOriginP - WorldOriginM) / 2.0f;
-	FVector DPixelDScreen = DScreenDPixel / DScreenDPixel.SizeSquared();
-	return DPixelDScreen;
-}
+static FIncrementalCapture GIncrementalCapture;
 
-FBodyInstance* GetBodyInstance(AActor* Actor) {
-	auto SceneComponent = Actor->GetRootComponent();
-	if(SceneComponent == NULL) return NULL;
-	auto PrimitiveComponent = Cast<UPrimitiveComponent>(SceneComponent);
-	if (PrimitiveComponent == NULL) return NULL;
-	FBodyInstance* BodyInst = PrimitiveComponent->GetBodyInstance();
-	return BodyInst;
+/**
+ * Forget the state of CaptureSegmentationIncremental, so that the next call
+ * traces the whole viewport.
+ */
+extern "C" UETORCH_API void ResetIncrementalCapture()
+{
+	GIncrementalCapture = FIncrementalCapture();
 }
 
 /**
- * Calculate the optical flow at each pixel in the viewport.
+ * Like CaptureSegmentation, but only re-traces the parts of the viewport
+ * that may have changed since the last call.
+ * The labels (and depths) of the last call are kept. On each call, the
+ * actors whose transform or visibility changed, as well as the actors that
+ * were spawned or destroyed, are found, and the screen-space rectangles of
+ * their old and new bounds (see GetActorBounds) are re-traced.
+ * Everything is re-traced if the camera, the viewport size, the stride, the
+ * objects array or the world change, or after ResetIncrementalCapture.
+ * Changes that don't move an actor or change its visibility (e.g. a
+ * material or mesh change) are not detected.
  *
  * @param _this the TorchPluginComponent
  * @param size the size of the viewport.
- * @param flow_data a float array of size->Y/stride * size->X/stride * 2 elements.
- *                  This array is filled with optical flow vectors (of dim 2) in [Y,X] order.
- * @param rgb_data a float array of size->Y/stride * size->X/stride * 3 elements.
- *                  This array is filled with the optical flow RGB data in [Y,X,color] order.
- * @param maxFlow the scale for the RGB flow data. At flow=maxFlow, the RGB output is saturated at 1.
- * @param stride stride in pixels at which to compute the optical flow.
+ * @param seg_data an int array of size->Y/stride * size->X/stride elements,
+ *                 filled like the seg_data of CaptureSegmentation
+ * @param depth_data NULL, or a float array of size->Y/stride * size->X/stride
+ *                   elements, filled like the data of CaptureDepthField
+ * @param stride stride in pixels at which to compute the segmentation.
+ * @param objects array of nObjects Actor* pointers which will be recorded in the segmentation
+ * @param nObjects size of the objects array
+ * @param nRays if not NULL, filled with the number of rays that were traced
  * @param verbose verbose output
- * @returns true if the optical flow capture was successful
+ * @returns true if the capture was successful
  */
-extern "C" UETORCH_API bool CaptureOpticalFlow(UObject* _this, const IntSize* size, void* flow_data, void* rgb_data, float maxFlow, int stride, bool verbose)
+extern "C" UETORCH_API bool CaptureSegmentationIncremental(UObject* _this, const IntSize* size, void* seg_data, void* depth_data, int stride, const AActor** objects, int nObjects, int* nRays, bool verbose)
 {
+	TORCH_PROFILE_SCOPE("CaptureSegmentationIncremental", STAT_TorchCapture);
 	FViewport* Viewport = nullptr;
 	APlayerController* PlayerController = nullptr;
 	UWorld* World = nullptr;
@@ -535,134 +2598,274 @@ extern "C" UETORCH_API bool CaptureOpticalFlow(UObject* _this, const IntSize* si
 	if(!bOk) {
 		return false;
 	}
+	const FCaptureRayGrid& Grid = GetCaptureRayGrid(SceneView, size, stride);
+	const FCaptureLabelMap& LabelMap = GetCaptureLabelMap(objects, nObjects);
 
-	ACharacter* PlayerCharacter = UGameplayStatics::GetPlayerCharacter(_this, 0);
-	if(PlayerCharacter == NULL) {
-		printf("PlayerCharacter null\n");
+	FCaptureCamera Camera;
+	if(!InitCaptureCamera(_this, PlayerController, World, SceneView, &Camera)) {
 		return false;
 	}
 
-	float HitResultTraceDistance = 100000.f;
-
-	// 1. Get player/camera info
-	FVector PlayerLoc  = PlayerCharacter->GetActorLocation();
-	FRotator PlayerRot = PlayerController->GetControlRotation();
-	FVector PlayerVel = PlayerCharacter->GetVelocity();
-	FRotationMatrix PlayerRotMat(PlayerRot);
-
-	FVector PlayerF = PlayerRotMat.GetScaledAxis( EAxis::X );
-	PlayerF.Normalize();
+	FIncrementalCapture& State = GIncrementalCapture;
+	const bool bDepth = depth_data != NULL;
+	const bool bFull = !State.bValid ||
+		State.World.Get() != World ||
+		State.SizeX != size->X || State.SizeY != size->Y || State.Stride != stride ||
+		State.bDepth != bDepth ||
+		!(State.ViewMatrix == Grid.ViewMatrix) || !(State.ProjMatrix == Grid.ProjMatrix) ||
+		State.Objects.Num() != nObjects ||
+		(nObjects > 0 && FMemory::Memcmp(State.Objects.GetData(), objects, nObjects * sizeof(AActor*)) != 0);
+
+	if (bFull) {
+		State.bValid = true;
+		State.World = World;
+		State.SizeX = size->X;
+		State.SizeY = size->Y;
+		State.Stride = stride;
+		State.bDepth = bDepth;
+		State.ViewMatrix = Grid.ViewMatrix;
+		State.ProjMatrix = Grid.ProjMatrix;
+		State.Objects.Reset();
+		State.Objects.Append(objects, nObjects);
+		State.Labels.SetNumUninitialized(Grid.NX * Grid.NY);
+		State.Depths.SetNumUninitialized(bDepth ? Grid.NX * Grid.NY : 0);
+		State.Actors.Reset();
+	}
+
+	// find the actors that moved, and mark their old and new bounds as dirty
+	const FMatrix ViewProj = Grid.ViewMatrix * Grid.ProjMatrix;
+	TArray<uint8> Dirty;
+	Dirty.SetNumZeroed(Grid.NX * Grid.NY);
+	auto MarkDirty = [&](const FBox& Bounds) {
+		FBox2D ScreenBox;
+		if (!ProjectBoundsToScreen(ViewProj, Grid.ViewRect, size, Bounds, ScreenBox)) {
+			return;
+		}
+		const int32 IX0 = FMath::Clamp(FMath::FloorToInt(ScreenBox.Min.X / stride), 0, Grid.NX - 1);
+		const int32 IY0 = FMath::Clamp(FMath::FloorToInt(ScreenBox.Min.Y / stride), 0, Grid.NY - 1);
+		const int32 IX1 = FMath::Clamp(FMath::CeilToInt(ScreenBox.Max.X / stride), 0, Grid.NX - 1);
+		const int32 IY1 = FMath::Clamp(FMath::CeilToInt(ScreenBox.Max.Y / stride), 0, Grid.NY - 1);
+		for (int32 iy = IY0; iy <= IY1; iy++) {
+			FMemory::Memset(&Dirty[iy * Grid.NX + IX0], 1, IX1 - IX0 + 1);
+		}
+	};
+
+	State.Stamp++;
+	for (TActorIterator<AActor> It(World); It; ++It) {
+		AActor* Actor = *It;
+		const FTransform Transform = Actor->GetActorTransform();
+		const bool bHidden = Actor->bHidden;
+		FIncrementalCapture::FActorState* Old = State.Actors.Find(Actor);
+		if (Old != NULL && Old->bHidden == bHidden && Old->Transform.Equals(Transform)) {
+			Old->Stamp = State.Stamp;
+			continue;
+		}
 
-	FBodyInstance* PlayerBodyInst = GetBodyInstance(PlayerCharacter);
-	PlayerBodyInst->SetAngularVelocity(FVector(0,0,0), false); // FIXME
+		FVector Origin, BoxExtent;
+		Actor->GetActorBounds(false, Origin, BoxExtent);
+		const FBox Bounds(Origin - BoxExtent, Origin + BoxExtent);
+		if (!bFull) {
+			if (Old != NULL) {
+				MarkDirty(Old->Bounds);
+			}
+			MarkDirty(Bounds);
+		}
+		FIncrementalCapture::FActorState& New = Old ? *Old : State.Actors.Add(Actor);
+		New.Transform = Transform;
+		New.Bounds = Bounds;
+		New.bHidden = bHidden;
+		New.Stamp = State.Stamp;
+	}
+	// destroyed actors
+	for (auto It = State.Actors.CreateIterator(); It; ++It) {
+		if (It.Value().Stamp != State.Stamp) {
+			MarkDirty(It.Value().Bounds);
+			It.RemoveCurrent();
+		}
+	}
 
-	// 2. Iterate over pixels
-	ECollisionChannel TraceChannel = ECollisionChannel::ECC_Visibility; // FIXME?
-	bool bTraceComplex = false; // FIXME?
-	FHitResult HitResult;
-	float* flow_values = (float*) flow_data;
-	float* rgb_values  = (float*) rgb_data;
+	FThreadSafeCounter RayCount;
+	bool bTraceComplex = false;
 	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
-	for (int y = 0; y < size->Y; y+=stride) {
-		for (int x = 0; x < size->X; x+=stride) {
-
-			FVector2D ScreenPosition(x, y);
-
-
-			FVector WorldOrigin, WorldDirection;
-			FSceneView__SafeDeprojectFVector2D(SceneView, ScreenPosition, WorldOrigin, WorldDirection);
-
-			// 3. Calculate dPixel / dScreen, i.e. the pixel movement resulting from a movement in camera near plane
-			FVector ScreenDx = getDPixelDScreen(ScreenPosition, 0, SceneView);
-			FVector ScreenDy = getDPixelDScreen(ScreenPosition, 1, SceneView);
-
-			// 4. Cast ray from pixel to find intersecting object
-			bool bHit = World->LineTraceSingleByChannel(
-				HitResult,
-				WorldOrigin,
-				WorldOrigin + WorldDirection * HitResultTraceDistance,
-				TraceChannel,
-				CollisionQueryParams);
-
-			AActor* Actor = NULL;
-			FVector CamVel, PointVel, Flow;
-
-			if(bHit) {
-				// 5. Get the location and velocity of the camera and the hit object
-				const auto &HitLoc = HitResult.Location;
-				Actor = HitResult.GetActor();
-				FBodyInstance* ActorBodyInst = GetBodyInstance(Actor);
-				if(ActorBodyInst != NULL)
-				{
-					PointVel = ActorBodyInst->GetUnrealWorldVelocityAtPoint(HitLoc);
-				} else {
-					printf("BodyInst null\n");
-					PointVel = Actor->GetVelocity();
-				}
-				CamVel = PlayerBodyInst->GetUnrealWorldVelocityAtPoint(HitLoc);
-				FVector RelVel = PointVel - CamVel;
+	ForEachCapturePixel(size, stride, verbose, [&](int x, int y, int index) {
+		if (!bFull && !Dirty[index]) {
+			return;
+		}
+		FHitResult HitResult;
+		bool bHit = TraceCapturePixel(World, Grid, index, CollisionQueryParams, HitResult);
+		RayCount.Increment();
+		State.Labels[index] = GetSegmentationLabel(HitResult, bHit, LabelMap);
+		if (bDepth) {
+			State.Depths[index] = GetCaptureDepth(HitResult, bHit, Camera);
+		}
+	});
 
-				// 6. calculate the optical flow
-				FVector HitLocRel = HitLoc - PlayerLoc;
-				float DistToHit = FVector::DotProduct(HitLoc - PlayerLoc, PlayerF);
-				FVector RelVelInCameraPlane = (RelVel - RelVel.ProjectOnTo(PlayerF)) / DistToHit;
-				Flow.X = FVector::DotProduct(RelVelInCameraPlane, ScreenDx);
-				Flow.Y = FVector::DotProduct(RelVelInCameraPlane, ScreenDy);
-			} else {
-				Flow.X  = 0;
-				Flow.Y  = 0;
-			}
+	FMemory::Memcpy(seg_data, State.Labels.GetData(), State.Labels.Num() * sizeof(int32));
+	if (bDepth) {
+		FMemory::Memcpy(depth_data, State.Depths.GetData(), State.Depths.Num() * sizeof(float));
+	}
 
-			*flow_values++ = Flow.X;
-			*flow_values++ = Flow.Y;
+	if (verbose) {
+		printf("Incremental segmentation: %d rays for %d pixels%s\n", RayCount.GetValue(), Grid.NX * Grid.NY, bFull ? " (full)" : "");
+	}
+	if (nRays != NULL) {
+		*nRays = RayCount.GetValue();
+	}
+	CountCapture(RayCount.GetValue(), State.Labels.Num() * sizeof(int32) + (bDepth ? State.Depths.Num() * sizeof(float) : 0));
+	return true;
+}
 
-			// 7. Convert flow to RGB optical flow
+/**
+ * Calculate the 2D bounding boxes and the visible fraction of a set of
+ * objects, without tracing the whole viewport.
+ * The box of each object is the screen-space rectangle enclosing the
+ * projection of its bounds (see GetActorBounds). The visible fraction is
+ * estimated on a samples x samples grid of rays inside the box: it is the
+ * fraction of the rays that go through the object which hit the object first.
+ *
+ * @param _this the TorchPluginComponent
+ * @param size the size of the viewport.
+ * @param objects array of nObjects Actor* pointers
+ * @param nObjects size of the objects array
+ * @param samples the number of rays per box is samples * samples
+ * @param boxes a float array of nObjects * 4 elements, filled with the
+ *              (xmin, ymin, xmax, ymax) box of each object in viewport pixels,
+ *              or -1s if the object is not on screen
+ * @param visibility a float array of nObjects elements, filled with the
+ *                   visible fraction in [0,1] of each object,
+ *                   or -1 if the object is not on screen
+ * @param verbose verbose output
+ * @returns true if the capture was successful
+ */
+extern "C" UETORCH_API bool CaptureBoundingBoxes(UObject* _this, const IntSize* size, const AActor** objects, int nObjects, int samples, float* boxes, float* visibility, bool verbose)
+{
+	TORCH_PROFILE_SCOPE("CaptureBoundingBoxes", STAT_TorchCapture);
+	FViewport* Viewport = nullptr;
+	APlayerController* PlayerController = nullptr;
+	UWorld* World = nullptr;
+	FSceneView* SceneView = nullptr;
 
-			FVector PolarFlow;
-			FMath::CartesianToPolar(Flow.X, Flow.Y, PolarFlow.X, PolarFlow.Y);
-			float Hue = FMath::RadiansToDegrees(PolarFlow.Y);
-			if(Hue < 0) Hue = Hue + 360.f;
-			float Sat = FMath::Clamp(PolarFlow.X / maxFlow, 0.f, 1.f);
+	bool bOk = InitCapture(_this, size, &Viewport, &PlayerController, &World, &SceneView);
+	if(!bOk) {
+		return false;
+	}
 
-			FLinearColor HSV(Hue, Sat, 1);
-			auto color = HSV.HSVToLinearRGB();
+	const FMatrix& ViewMatrix = SceneView->ViewMatrices.ViewMatrix;
+	const FMatrix ViewProj = ViewMatrix * SceneView->ViewMatrices.ProjMatrix;
+	const FMatrix InvViewMatrix = ViewMatrix.Inverse();
+	const FMatrix InvProjMatrix = SceneView->ViewMatrices.GetInvProjMatrix();
+	const FIntRect& ViewRect = SceneView->UnscaledViewRect;
+	samples = FMath::Max(samples, 1);
 
-			*rgb_values++ = color.R;
-			*rgb_values++ = color.G;
-			*rgb_values++ = color.B;
+	FThreadSafeCounter RayCount;
+	bool bTraceComplex = false;
+	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
+	ParallelFor(nObjects, [&](int32 i) {
+		float* box = boxes + 4 * i;
+		box[0] = box[1] = box[2] = box[3] = -1;
+		visibility[i] = -1;
+
+		const AActor* Actor = objects[i];
+		if (!FActorRegistry::Get().IsValid(Actor)) {
+			return;
+		}
+		FVector Origin, BoxExtent;
+		Actor->GetActorBounds(false, Origin, BoxExtent);
+		FBox2D ScreenBox;
+		if (!ProjectBoundsToScreen(ViewProj, ViewRect, size, FBox(Origin - BoxExtent, Origin + BoxExtent), ScreenBox)) {
+			return;
+		}
+		box[0] = ScreenBox.Min.X;
+		box[1] = ScreenBox.Min.Y;
+		box[2] = ScreenBox.Max.X;
+		box[3] = ScreenBox.Max.Y;
+
+		TInlineComponentArray<UPrimitiveComponent*> Primitives;
+		Actor->GetComponents(Primitives);
+
+		int32 nCovered = 0;
+		int32 nVisible = 0;
+		for (int32 sy = 0; sy < samples; sy++) {
+			for (int32 sx = 0; sx < samples; sx++) {
+				const FVector2D ScreenPos(
+					FMath::Lerp(ScreenBox.Min.X, ScreenBox.Max.X, (sx + 0.5f) / samples),
+					FMath::Lerp(ScreenBox.Min.Y, ScreenBox.Max.Y, (sy + 0.5f) / samples));
+				FVector WorldOrigin, WorldDirection;
+				FSceneView::DeprojectScreenToWorld(ScreenPos, ViewRect, InvViewMatrix, InvProjMatrix, WorldOrigin, WorldDirection);
+				const FVector WorldEnd = WorldOrigin + WorldDirection * HitResultTraceDistance;
+
+				// does the ray go through the object at all?
+				bool bCovered = false;
+				for (UPrimitiveComponent* Primitive : Primitives) {
+					if (!Primitive->IsCollisionEnabled()) {
+						continue;
+					}
+					FHitResult ComponentHit;
+					RayCount.Increment();
+					if (Primitive->LineTraceComponent(ComponentHit, WorldOrigin, WorldEnd, CollisionQueryParams)) {
+						bCovered = true;
+						break;
+					}
+				}
+				if (!bCovered) {
+					continue;
+				}
+				nCovered++;
+				RayCount.Increment();
 
-			if(verbose) {
-				printf("(%d, %d) PlayerRot: (%g, %g, %g) PointVel: (%g, %g, %g), CamVel: (%g, %g, %g) ScreenDx: (%g, %g, %g) ScreenDy: (%g, %g, %g) Flow: (%g, %g) PolarFlow: (%g, %g) HSV: (%g, %g, %g) RGB: (%g, %g, %g)\n",
-					x, y,
-					PlayerRot.Pitch, PlayerRot.Yaw, PlayerRot.Roll,
-					PointVel.X, PointVel.Y, PointVel.Z,
-					CamVel.X, CamVel.Y, CamVel.Z,
-					ScreenDx.X, ScreenDx.Y, ScreenDx.Z,
-					ScreenDy.X, ScreenDy.Y, ScreenDy.Z,
-					Flow.X, Flow.Y,
-					PolarFlow.X, PolarFlow.Y,
-					HSV.R, HSV.G, HSV.B,
-					color.R, color.G, color.B);
+				FHitResult HitResult;
+				bool bHit = World->LineTraceSingleByChannel(HitResult, WorldOrigin, WorldEnd, ECollisionChannel::ECC_Visibility, CollisionQueryParams);
+				if (bHit && HitResult.GetActor() == Actor) {
+					nVisible++;
+				}
 			}
 		}
-	}
+		visibility[i] = nCovered > 0 ? nVisible / (float) nCovered : 0.0f;
+
+		if (verbose) {
+			printf("Object %d: %p box (%.1f, %.1f, %.1f, %.1f) visible %d / %d\n",
+				i, Actor, box[0], box[1], box[2], box[3], nVisible, nCovered);
+		}
+	}, verbose || !GParallelCapture);
+	CountCapture(RayCount.GetValue(), nObjects * 5 * sizeof(float));
 	return true;
 }
 
+// Flags for the modalities argument of CaptureModalities
+enum ECaptureModality {
+	CAPTURE_SEGMENTATION = 1,
+	CAPTURE_MASKS        = 2,
+	CAPTURE_DEPTH        = 4,
+	CAPTURE_FLOW         = 8,
+};
 
 /**
- * Calculate the depth field.
+ * Capture several modalities in a single sweep over the viewport.
+ * Segmentation, depth and optical flow are all computed from the same
+ * ray cast per pixel, and the scene view and camera state are set up once.
+ * Masks need a separate (non-blocking) multi-hit trace, which is done in the
+ * same sweep when requested.
+ * The output arrays have the same layout as in the corresponding single
+ * modality capture functions, and may be NULL if not requested.
  *
  * @param _this the TorchPluginComponent
  * @param size the size of the viewport.
- * @param data a float array of size->Y/stride * size->X/stride
- *             This array is filled with depth information.
- * @param stride stride in pixels at which to compute the optical flow.
+ * @param modalities bitwise OR of the CAPTURE_* flags to compute
+ * @param stride stride in pixels at which to compute the outputs.
+ * @param objects array of nObjects Actor* pointers used for segmentation and masks
+ * @param nObjects size of the objects array
+ * @param seg_data int array of segmentation labels (see CaptureSegmentation)
+ * @param mask_data byte array of object masks (see CaptureMasks)
+ * @param depth_data float array of depths (see CaptureDepthField)
+ * @param flow_data float array of optical flow vectors (see CaptureOpticalFlow)
+ * @param flow_rgb_data float array of optical flow RGB data, or NULL to skip it
+ * @param maxFlow the scale for the RGB flow data, in pixels per second (see CaptureOpticalFlow)
  * @param verbose verbose output
- * @returns true if the optical flow capture was successful
+ * @returns true if the capture was successful
  */
-extern "C" UETORCH_API bool CaptureDepthField(UObject* _this, const IntSize* size, void* data, int stride, bool verbose)
+extern "C" UETORCH_API bool CaptureModalities(UObject* _this, const IntSize* size, int modalities, int stride, const AActor** objects, int nObjects, void* seg_data, void* mask_data, void* depth_data, void* flow_data, void* flow_rgb_data, float maxFlow, bool verbose)
 {
+	TORCH_PROFILE_SCOPE("CaptureModalities", STAT_TorchCapture);
 	FViewport* Viewport = nullptr;
 	APlayerController* PlayerController = nullptr;
 	UWorld* World = nullptr;
@@ -672,63 +2875,168 @@ extern "C" UETORCH_API bool CaptureDepthField(UObject* _this, const IntSize* siz
 	if(!bOk) {
 		return false;
 	}
+	const FCaptureRayGrid& Grid = GetCaptureRayGrid(SceneView, size, stride, (modalities & CAPTURE_FLOW) != 0);
+	const FCaptureLabelMap& LabelMap = GetCaptureLabelMap(objects, nObjects);
 
-	ACharacter* PlayerCharacter = UGameplayStatics::GetPlayerCharacter(_this, 0);
-	if(PlayerCharacter == NULL) {
-		printf("PlayerCharacter null\n");
+	const bool bSeg   = (modalities & CAPTURE_SEGMENTATION) && seg_data != NULL;
+	const bool bMasks = (modalities & CAPTURE_MASKS) && mask_data != NULL;
+	const bool bDepth = (modalities & CAPTURE_DEPTH) && depth_data != NULL;
+	const bool bFlow  = (modalities & CAPTURE_FLOW) && flow_data != NULL;
+
+	FCaptureCamera Camera;
+	if((bDepth || bFlow) && !InitCaptureCamera(_this, PlayerController, World, SceneView, &Camera)) {
 		return false;
 	}
 
-	float HitResultTraceDistance = 100000.f;
-
-	FVector PlayerLoc  = PlayerCharacter->GetActorLocation();
-	FRotator PlayerRot = PlayerController->GetControlRotation();
-	FRotationMatrix PlayerRotMat(PlayerRot);
-
-	FVector PlayerF = PlayerRotMat.GetScaledAxis( EAxis::X );
-	PlayerF.Normalize();
+	bool bTraceComplex = false;
+	int*   seg_values      = (int*) seg_data;
+	char*  mask_values     = (char*) mask_data;
+	float* depth_values    = (float*) depth_data;
+	float* flow_values     = (float*) flow_data;
+	float* flow_rgb_values = (float*) flow_rgb_data;
+	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
+	ForEachCapturePixel(size, stride, verbose, [&](int x, int y, int index) {
+		if(bSeg || bDepth || bFlow) {
+			FHitResult HitResult;
+			bool bHit = TraceCapturePixel(World, Grid, index, CollisionQueryParams, HitResult);
 
-	FBodyInstance* PlayerBodyInst = GetBodyInstance(PlayerCharacter);
-	PlayerBodyInst->SetAngularVelocity(FVector(0,0,0), false); // FIXME
+			if(bSeg) {
+				seg_values[index] = GetSegmentationLabel(HitResult, bHit, LabelMap);
+			}
+			if(bDepth) {
+				depth_values[index] = GetCaptureDepth(HitResult, bHit, Camera);
+			}
+			if(bFlow) {
+				FVector2D Flow = GetCaptureOpticalFlow(HitResult, bHit, Camera, Grid, x, y, index, verbose);
+				flow_values[2 * index]     = Flow.X;
+				flow_values[2 * index + 1] = Flow.Y;
+				if(flow_rgb_values) {
+					FLinearColor color = OpticalFlowToRGB(Flow, maxFlow);
+					flow_rgb_values[3 * index]     = color.R;
+					flow_rgb_values[3 * index + 1] = color.G;
+					flow_rgb_values[3 * index + 2] = color.B;
+				}
+			}
+		}
+		if(bMasks) {
+			TraceCaptureMasks(World, Grid, x, y, index, CollisionQueryParams, LabelMap, mask_values + (size_t) index * nObjects, verbose);
+		}
+	});
+	// the masks are traced separately from the other modalities
+	const int64 RaysPerPixel = ((bSeg || bDepth || bFlow) ? 1 : 0) + (bMasks ? 1 : 0);
+	CountCapture((int64) Grid.NX * Grid.NY * RaysPerPixel, (int64) Grid.NX * Grid.NY * ((bSeg ? sizeof(int) : 0) + (bMasks ? nObjects : 0) + (bDepth ? sizeof(float) : 0) + (bFlow ? (flow_rgb_values ? 5 : 2) * sizeof(float) : 0)));
+	return true;
+}
 
-	ECollisionChannel TraceChannel = ECollisionChannel::ECC_Visibility; // FIXME?
-	bool bTraceComplex = false; // FIXME?
-	FHitResult HitResult;
-	float* values = (float*) data;
-	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
-	for (int y = 0; y < size->Y; y+=stride) {
-		for (int x = 0; x < size->X; x+=stride) {
+/**
+ * Stable instance IDs for CaptureInstanceSegmentation.
+ * Each actor gets the next ID (1, 2, ...) the first time it is seen in a
+ * capture, and keeps it until ResetInstanceIds() is called.
+ */
+struct FCaptureInstanceIds {
+	TMap<TWeakObjectPtr<AActor>, int32> Ids;
+	// actor names, indexed by ID - 1
+	TArray<FString> Names;
+};
 
-			FVector2D ScreenPosition(x, y);
+static FCaptureInstanceIds GCaptureInstanceIds;
 
-			FVector WorldOrigin, WorldDirection;
-			FSceneView__SafeDeprojectFVector2D(SceneView, ScreenPosition, WorldOrigin, WorldDirection);
+/**
+ * Calculate the instance segmentation of the viewport image.
+ * Unlike CaptureSegmentation, every actor in the scene is labeled, with a
+ * stable instance ID. Use GetInstanceName() to map IDs back to actors.
+ *
+ * @param _this the TorchPluginComponent
+ * @param size the size of the viewport.
+ * @param seg_data an int array of size->Y/stride * size->X/stride elements.
+ *                 This array is filled with the instance ID of the foreground actor
+ *                 at each pixel in [Y,X] order, or 0 if nothing was hit.
+ * @param stride stride in pixels at which to compute the segmentation.
+ * @param verbose verbose output
+ * @returns the number of instance IDs assigned so far, or -1 if the capture failed
+ */
+extern "C" UETORCH_API int CaptureInstanceSegmentation(UObject* _this, const IntSize* size, void* seg_data, int stride, bool verbose)
+{
+	TORCH_PROFILE_SCOPE("CaptureInstanceSegmentation", STAT_TorchCapture);
+	FViewport* Viewport = nullptr;
+	APlayerController* PlayerController = nullptr;
+	UWorld* World = nullptr;
+	FSceneView* SceneView = nullptr;
 
-			bool bHit = World->LineTraceSingleByChannel(
-				HitResult,
-				WorldOrigin,
-				WorldOrigin + WorldDirection * HitResultTraceDistance,
-				TraceChannel,
-				CollisionQueryParams);
+	bool bOk = InitCapture(_this, size, &Viewport, &PlayerController, &World, &SceneView);
+	if(!bOk) {
+		return -1;
+	}
+	const FCaptureRayGrid& Grid = GetCaptureRayGrid(SceneView, size, stride);
 
-			AActor* Actor = NULL;
-			FVector CamVel, PointVel, Flow;
+	// Trace (possibly in parallel) first, then assign IDs in scan order, so
+	// that new IDs are deterministic whether or not the trace was parallel.
+	TArray<AActor*> HitActors;
+	HitActors.SetNumUninitialized(Grid.NX * Grid.NY);
 
-			if(bHit) {
-				const auto &HitLoc = HitResult.Location;
-				Actor = HitResult.GetActor();
+	bool bTraceComplex = false;
+	FCollisionQueryParams CollisionQueryParams( "ClickableTrace", bTraceComplex );
+	ForEachCapturePixel(size, stride, false, [&](int x, int y, int index) {
+		FHitResult HitResult;
+		bool bHit = TraceCapturePixel(World, Grid, index, CollisionQueryParams, HitResult);
+		HitActors[index] = bHit ? HitResult.GetActor() : NULL;
+	});
 
-				FVector HitLocRel = HitLoc - PlayerLoc;
-				float DistToHit = FVector::DotProduct(HitLoc - PlayerLoc, PlayerF);
-				*values++ = DistToHit;
-			} else {
-				*values++ = 0;
+	FCaptureInstanceIds& Instances = GCaptureInstanceIds;
+	int* seg_values = (int*) seg_data;
+	AActor* LastActor = NULL;
+	int LastId = 0;
+	for (int index = 0; index < HitActors.Num(); index++) {
+		AActor* Actor = HitActors[index];
+		if (Actor != LastActor) {
+			LastActor = Actor;
+			LastId = 0;
+			if (Actor != NULL) {
+				int32* Id = Instances.Ids.Find(Actor);
+				if (Id != NULL) {
+					LastId = *Id;
+				} else {
+					LastId = Instances.Names.Add(Actor->GetName()) + 1;
+					Instances.Ids.Add(Actor, LastId);
+					if(verbose) {
+						printf("Instance %d: %s %p\n", LastId, TCHAR_TO_UTF8(*Instances.Names.Last()), Actor);
+					}
+				}
 			}
 		}
+		seg_values[index] = LastId;
+	}
+	CountCapture((int64) Grid.NX * Grid.NY, (int64) Grid.NX * Grid.NY * sizeof(int));
+	return Instances.Names.Num();
+}
+
+/**
+ * Get the name of the actor with an instance ID from CaptureInstanceSegmentation.
+ *
+ * @param id the instance ID (1..number of instances)
+ * @param name a char array of at least len elements, filled with the actor's ID name
+ * @param len the size of the name array
+ * @returns true if id is a valid instance ID
+ */
+extern "C" UETORCH_API bool GetInstanceName(int id, char* name, int len)
+{
+	FCaptureInstanceIds& Instances = GCaptureInstanceIds;
+	if (id < 1 || id > Instances.Names.Num() || len < 1) {
+		return false;
 	}
+	FCStringAnsi::Strncpy(name, TCHAR_TO_UTF8(*Instances.Names[id - 1]), len);
 	return true;
 }
 
+/**
+ * Forget all instance IDs, e.g. after loading a new level.
+ */
+extern "C" UETORCH_API void ResetInstanceIds()
+{
+	GCaptureInstanceIds.Ids.Reset();
+	GCaptureInstanceIds.Names.Reset();
+}
+
 /**
  * Getters and setters for Actor properties.
  */
@@ -777,6 +3085,9 @@ extern "C" UETORCH_API bool GetActorVelocity(AActor* object, float* x, float* y,
 		return false;
 	}
 	FVector actorLinVel = component->GetPhysicsLinearVelocity();
+	*x = actorLinVel.X;
+	*y = actorLinVel.Y;
+	*z = actorLinVel.Z;
 	return true;
 }
 
@@ -825,11 +3136,441 @@ extern "C" UETORCH_API bool GetActorBounds(AActor* object, float* x, float* y, f
 	return true;
 }
 
+/**
+ * Cached component lookups for the bulk actor functions, so that
+ * FindComponentByClass only runs once per actor.
+ */
+struct FActorComponentCache {
+	TWeakObjectPtr<AActor> Actor;
+	TWeakObjectPtr<UStaticMeshComponent> Mesh;
+	TWeakObjectPtr<UPrimitiveComponent> Root;
+};
+
+static TMap<const AActor*, FActorComponentCache> GActorComponentCache;
+
+// Returns the cached components of Actor, refreshing them if Actor was not
+// seen before or if it was destroyed and another actor reused its address
+const FActorComponentCache& GetActorComponents(AActor* Actor)
+{
+	FActorComponentCache* Entry = GActorComponentCache.Find(Actor);
+	if (Entry != NULL && Entry->Actor.Get() == Actor && !Entry->Mesh.IsStale() && !Entry->Root.IsStale()) {
+		return *Entry;
+	}
+	if (Entry == NULL && GActorComponentCache.Num() >= 4096) {
+		// drop the entries of destroyed actors
+		for (auto It = GActorComponentCache.CreateIterator(); It; ++It) {
+			if (!It.Value().Actor.IsValid()) {
+				It.RemoveCurrent();
+			}
+		}
+	}
+	FActorComponentCache& New = GActorComponentCache.FindOrAdd(Actor);
+	New.Actor = Actor;
+	New.Mesh = Actor->FindComponentByClass<UStaticMeshComponent>();
+	New.Root = Cast<UPrimitiveComponent>(Actor->GetRootComponent());
+	return New;
+}
+
+// Status codes of the bulk actor functions
+enum EActorStateStatus {
+	ACTOR_STATE_OK = 0,
+	ACTOR_STATE_NULL_ACTOR = 1,        // NULL, or destroyed (see IsActorValid)
+	ACTOR_STATE_NO_MESH = 2,
+	ACTOR_STATE_NO_BODY = 3,
+	ACTOR_STATE_NOT_SIMULATING = 4,
+};
+
+// Flags for the fields argument of GetActorsState, in the order they are written
+enum EActorStateField {
+	ACTOR_STATE_LOCATION = 1,          // x, y, z
+	ACTOR_STATE_ROTATION = 2,          // pitch, yaw, roll
+	ACTOR_STATE_SCALE = 4,             // x, y, z
+	ACTOR_STATE_VELOCITY = 8,          // x, y, z
+	ACTOR_STATE_ANGULAR_VELOCITY = 16, // x, y, z
+	ACTOR_STATE_BOUNDS = 32,           // origin x, y, z, extent x, y, z (read only)
+	ACTOR_STATE_FORCE = 64,            // x, y, z (write only, see AddForce)
+};
+
+static const float ActorStateNaN = std::numeric_limits<float>::quiet_NaN();
+
+// Returns the number of floats per actor for the given fields
+int GetActorStateWidth(int fields)
+{
+	int width = 0;
+	width += (fields & ACTOR_STATE_LOCATION) ? 3 : 0;
+	width += (fields & ACTOR_STATE_ROTATION) ? 3 : 0;
+	width += (fields & ACTOR_STATE_SCALE) ? 3 : 0;
+	width += (fields & ACTOR_STATE_VELOCITY) ? 3 : 0;
+	width += (fields & ACTOR_STATE_ANGULAR_VELOCITY) ? 3 : 0;
+	width += (fields & ACTOR_STATE_BOUNDS) ? 6 : 0;
+	width += (fields & ACTOR_STATE_FORCE) ? 3 : 0;
+	return width;
+}
+
+/**
+ * Read the state of several actors at once.
+ *
+ * @param objects array of nObjects Actor* pointers
+ * @param nObjects size of the objects array
+ * @param fields a combination of EActorStateField flags
+ * @param data a float array of nObjects * F elements, where F is the total
+ *             width of the requested fields, filled in [actor,field] order.
+ *             Fields that can't be read (e.g. velocities of an actor without
+ *             a StaticMeshComponent) are filled with NaN.
+ * @param status NULL, or a byte array of nObjects elements, filled with the
+ *               EActorStateStatus of each actor
+ * @returns the number of actors whose fields were all read
+ */
+extern "C" UETORCH_API int GetActorsState(AActor** objects, int nObjects, int fields, float* data, uint8* status)
+{
+	fields &= ~ACTOR_STATE_FORCE;
+	const int width = GetActorStateWidth(fields);
+	int nOk = 0;
+	for (int i = 0; i < nObjects; i++) {
+		float* out = data + (size_t) i * width;
+		uint8 code = ACTOR_STATE_OK;
+		AActor* Actor = objects[i];
+		if (!FActorRegistry::Get().IsValid(Actor)) {
+			for (int k = 0; k < width; k++) {
+				out[k] = ActorStateNaN;
+			}
+			if (status != NULL) {
+				status[i] = ACTOR_STATE_NULL_ACTOR;
+			}
+			continue;
+		}
+		auto Write = [&](const FVector& V) {
+			*out++ = V.X;
+			*out++ = V.Y;
+			*out++ = V.Z;
+		};
+
+		if (fields & ACTOR_STATE_LOCATION) {
+			Write(Actor->GetActorLocation());
+		}
+		if (fields & ACTOR_STATE_ROTATION) {
+			const FRotator Rotation = Actor->GetActorRotation();
+			Write(FVector(Rotation.Pitch, Rotation.Yaw, Rotation.Roll));
+		}
+		if (fields & ACTOR_STATE_SCALE) {
+			Write(Actor->GetActorScale3D());
+		}
+		if (fields & (ACTOR_STATE_VELOCITY | ACTOR_STATE_ANGULAR_VELOCITY)) {
+			UStaticMeshComponent* Mesh = GetActorComponents(Actor).Mesh.Get();
+			if (Mesh == NULL) {
+				code = ACTOR_STATE_NO_MESH;
+			}
+			if (fields & ACTOR_STATE_VELOCITY) {
+				Write(Mesh ? Mesh->GetPhysicsLinearVelocity() : FVector(ActorStateNaN, ActorStateNaN, ActorStateNaN));
+			}
+			if (fields & ACTOR_STATE_ANGULAR_VELOCITY) {
+				Write(Mesh ? Mesh->GetPhysicsAngularVelocity() : FVector(ActorStateNaN, ActorStateNaN, ActorStateNaN));
+			}
+		}
+		if (fields & ACTOR_STATE_BOUNDS) {
+			FVector Origin, BoxExtent;
+			Actor->GetActorBounds(false, Origin, BoxExtent);
+			Write(Origin);
+			Write(BoxExtent);
+		}
+
+		if (status != NULL) {
+			status[i] = code;
+		}
+		nOk += (code == ACTOR_STATE_OK);
+	}
+	return nOk;
+}
+
+/**
+ * Set the state of several actors at once.
+ * Velocities and forces are only applied to actors with a StaticMeshComponent
+ * that simulates physics, like SetActorVelocity and AddForce; the other fields
+ * are applied regardless.
+ *
+ * @param objects array of nObjects Actor* pointers
+ * @param nObjects size of the objects array
+ * @param fields a combination of EActorStateField flags, except ACTOR_STATE_BOUNDS
+ * @param data a float array of nObjects * F elements in the same layout as GetActorsState
+ *             (with ACTOR_STATE_FORCE last)
+ * @param status NULL, or a byte array of nObjects elements, filled with the
+ *               EActorStateStatus of each actor
+ * @returns the number of actors whose fields were all set
+ */
+extern "C" UETORCH_API int SetActorsState(AActor** objects, int nObjects, int fields, const float* data, uint8* status)
+{
+	fields &= ~ACTOR_STATE_BOUNDS;
+	const int width = GetActorStateWidth(fields);
+	const int physicsFields = ACTOR_STATE_VELOCITY | ACTOR_STATE_ANGULAR_VELOCITY | ACTOR_STATE_FORCE;
+	int nOk = 0;
+	for (int i = 0; i < nObjects; i++) {
+		const float* in = data + (size_t) i * width;
+		uint8 code = ACTOR_STATE_OK;
+		AActor* Actor = objects[i];
+		if (!FActorRegistry::Get().IsValid(Actor)) {
+			if (status != NULL) {
+				status[i] = ACTOR_STATE_NULL_ACTOR;
+			}
+			continue;
+		}
+		if (FTorchRecorder::Get().IsRecording()) {
+			FTorchRecorder::Get().RecordActorOp(ETorchActorOp::State, Actor, fields, in, width);
+		}
+		auto Read = [&]() {
+			const FVector V(in[0], in[1], in[2]);
+			in += 3;
+			return V;
+		};
+
+		const FVector Location = (fields & ACTOR_STATE_LOCATION) ? Read() : FVector::ZeroVector;
+		const FVector Rotation = (fields & ACTOR_STATE_ROTATION) ? Read() : FVector::ZeroVector;
+		const FRotator Rotator(Rotation.X, Rotation.Y, Rotation.Z);
+		if ((fields & ACTOR_STATE_LOCATION) && (fields & ACTOR_STATE_ROTATION)) {
+			Actor->SetActorLocationAndRotation(Location, Rotator, false);
+		} else if (fields & ACTOR_STATE_LOCATION) {
+			Actor->SetActorLocation(Location, false);
+		} else if (fields & ACTOR_STATE_ROTATION) {
+			Actor->SetActorRotation(Rotator);
+		}
+		if (fields & ACTOR_STATE_SCALE) {
+			Actor->SetActorScale3D(Read());
+		}
+
+		if (fields & physicsFields) {
+			const FActorComponentCache& Components = GetActorComponents(Actor);
+			UStaticMeshComponent* Mesh = Components.Mesh.Get();
+			UPrimitiveComponent* Root = Components.Root.Get();
+			FBodyInstance* BodyInst = Root ? Root->GetBodyInstance() : NULL;
+			if (Mesh == NULL) {
+				code = ACTOR_STATE_NO_MESH;
+			} else if (BodyInst == NULL) {
+				code = ACTOR_STATE_NO_BODY;
+			} else if (!BodyInst->bSimulatePhysics) {
+				code = ACTOR_STATE_NOT_SIMULATING;
+			}
+			const bool bPhysics = (code == ACTOR_STATE_OK);
+			if (fields & ACTOR_STATE_VELOCITY) {
+				const FVector Velocity = Read();
+				if (bPhysics) {
+					Mesh->SetPhysicsLinearVelocity(Velocity);
+				}
+			}
+			if (fields & ACTOR_STATE_ANGULAR_VELOCITY) {
+				const FVector AngularVelocity = Read();
+				if (bPhysics) {
+					Mesh->SetPhysicsAngularVelocity(AngularVelocity);
+				}
+			}
+			if (fields & ACTOR_STATE_FORCE) {
+				const FVector Force = Read();
+				if (bPhysics) {
+					Mesh->AddForce(Force);
+				}
+			}
+		}
+
+		if (status != NULL) {
+			status[i] = code;
+		}
+		nOk += (code == ACTOR_STATE_OK);
+	}
+	return nOk;
+}
+
+/*************************************************************************
+ * World snapshots
+ * A snapshot records the state of a set of actors, so that it can be
+ * restored in one call, e.g. to reset an episode without reloading the
+ * level, or to branch several rollouts from the same state.
+ *************************************************************************/
+
+// The state of an actor in a snapshot
+struct FActorSnapshot {
+	TWeakObjectPtr<AActor> Actor;
+	FTransform Transform;
+	FVector LinearVelocity;
+	FVector AngularVelocity;
+	// the velocity of the movement component (e.g. of a character), if any
+	FVector MovementVelocity;
+	// the materials of the StaticMeshComponent, in FWorldSnapshot::Materials
+	int32 FirstMaterial;
+	int32 NumMaterials;
+	uint8 bHidden : 1;
+	uint8 bSimulating : 1;
+	uint8 bAwake : 1;
+};
+
+struct FWorldSnapshot {
+	TWeakObjectPtr<UWorld> World;
+	TArray<FActorSnapshot> Actors;
+	TArray<TWeakObjectPtr<UMaterialInterface>> Materials;
+};
+
+static void RecordActorSnapshot(FWorldSnapshot* Snapshot, AActor* Actor)
+{
+	if (Actor->GetRootComponent() == NULL) {
+		return;
+	}
+	FActorSnapshot State;
+	State.Actor = Actor;
+	State.Transform = Actor->GetTransform();
+	State.LinearVelocity = FVector::ZeroVector;
+	State.AngularVelocity = FVector::ZeroVector;
+	State.MovementVelocity = FVector::ZeroVector;
+	State.FirstMaterial = Snapshot->Materials.Num();
+	State.NumMaterials = 0;
+	State.bHidden = Actor->bHidden;
+	State.bSimulating = false;
+	State.bAwake = false;
+
+	const FActorComponentCache& Components = GetActorComponents(Actor);
+	UStaticMeshComponent* Mesh = Components.Mesh.Get();
+	if (Mesh != NULL) {
+		State.NumMaterials = Mesh->GetNumMaterials();
+		for (int32 i = 0; i < State.NumMaterials; i++) {
+			Snapshot->Materials.Add(Mesh->GetMaterial(i));
+		}
+		UPrimitiveComponent* Root = Components.Root.Get();
+		FBodyInstance* BodyInst = Root ? Root->GetBodyInstance() : NULL;
+		if (BodyInst != NULL && BodyInst->bSimulatePhysics) {
+			State.bSimulating = true;
+			State.bAwake = Mesh->RigidBodyIsAwake();
+			State.LinearVelocity = Mesh->GetPhysicsLinearVelocity();
+			State.AngularVelocity = Mesh->GetPhysicsAngularVelocity();
+		}
+	}
+	if (UMovementComponent* Movement = Actor->FindComponentByClass<UMovementComponent>()) {
+		State.MovementVelocity = Movement->Velocity;
+	}
+	Snapshot->Actors.Add(State);
+}
+
+/**
+ * Record a snapshot of the state of a set of actors: their transforms,
+ * visibility, materials, the velocity of their movement component, and for
+ * the actors that simulate physics, their linear and angular velocities and
+ * sleep state.
+ *
+ * @param _this the TorchPluginComponent
+ * @param objects an array of nObjects Actor* pointers, or NULL for all the
+ *                actors of the world
+ * @param nObjects the number of actors
+ * @returns the snapshot, to be freed with FreeSnapshot, or NULL on failure
+ */
+extern "C" UETORCH_API FWorldSnapshot* CreateSnapshot(UObject* _this, AActor** objects, int nObjects)
+{
+	UWorld* World = GEngine->GetWorldFromContextObject(_this);
+	if (World == NULL) {
+		printf("World null\n");
+		return NULL;
+	}
+
+	FWorldSnapshot* Snapshot = new FWorldSnapshot();
+	Snapshot->World = World;
+	if (objects == NULL) {
+		for (TActorIterator<AActor> It(World); It; ++It) {
+			RecordActorSnapshot(Snapshot, *It);
+		}
+	} else {
+		Snapshot->Actors.Reserve(nObjects);
+		for (int i = 0; i < nObjects; i++) {
+			if (FActorRegistry::Get().IsValid(objects[i])) {
+				RecordActorSnapshot(Snapshot, objects[i]);
+			}
+		}
+	}
+	Snapshot->Actors.Shrink();
+	Snapshot->Materials.Shrink();
+	return Snapshot;
+}
+
+/**
+ * Restore a snapshot. Actors are teleported, so that the physics engine
+ * doesn't infer velocities from the move. Actors that were destroyed since
+ * the snapshot are skipped, and actors spawned since are left as they are.
+ *
+ * @param _this the TorchPluginComponent
+ * @param snapshot a snapshot created by CreateSnapshot
+ * @returns the number of actors restored, or -1 if the snapshot belongs to
+ *          another world
+ */
+extern "C" UETORCH_API int RestoreSnapshot(UObject* _this, FWorldSnapshot* snapshot)
+{
+	UWorld* World = GEngine->GetWorldFromContextObject(_this);
+	if (snapshot == NULL || World == NULL || snapshot->World.Get() != World) {
+		printf("Snapshot is not from this world\n");
+		return -1;
+	}
+
+	int nRestored = 0;
+	for (const FActorSnapshot& State : snapshot->Actors) {
+		AActor* Actor = State.Actor.Get();
+		if (Actor == NULL || Actor->IsPendingKill()) {
+			continue;
+		}
+		USceneComponent* RootComponent = Actor->GetRootComponent();
+		if (RootComponent && RootComponent->Mobility == EComponentMobility::Movable && !Actor->GetTransform().Equals(State.Transform, 0.f)) {
+			Actor->SetActorTransform(State.Transform, false, nullptr, ETeleportType::TeleportPhysics);
+		}
+		if (Actor->bHidden != State.bHidden) {
+			Actor->SetActorHiddenInGame(State.bHidden);
+		}
+
+		const FActorComponentCache& Components = GetActorComponents(Actor);
+		UStaticMeshComponent* Mesh = Components.Mesh.Get();
+		if (Mesh != NULL) {
+			for (int32 i = 0; i < State.NumMaterials; i++) {
+				UMaterialInterface* Material = snapshot->Materials[State.FirstMaterial + i].Get();
+				if (Material != NULL && Mesh->GetMaterial(i) != Material) {
+					Mesh->SetMaterial(i, Material);
+				}
+			}
+			if (State.bSimulating) {
+				Mesh->SetPhysicsLinearVelocity(State.LinearVelocity);
+				Mesh->SetPhysicsAngularVelocity(State.AngularVelocity);
+				if (State.bAwake) {
+					Mesh->WakeRigidBody();
+				} else {
+					Mesh->PutRigidBodyToSleep();
+				}
+			} else if (Mesh->IsSimulatingPhysics()) {
+				// the actor started simulating since the snapshot: it was at rest
+				Mesh->SetPhysicsLinearVelocity(FVector::ZeroVector);
+				Mesh->SetPhysicsAngularVelocity(FVector::ZeroVector);
+			}
+		}
+		// e.g. a character, which would otherwise keep moving after the reset
+		if (UMovementComponent* Movement = Actor->FindComponentByClass<UMovementComponent>()) {
+			Movement->Velocity = State.MovementVelocity;
+			Movement->UpdateComponentVelocity();
+		}
+		nRestored++;
+	}
+	return nRestored;
+}
+
+/**
+ * @returns the number of actors in a snapshot
+ */
+extern "C" UETORCH_API int GetSnapshotNumActors(const FWorldSnapshot* snapshot)
+{
+	return snapshot ? snapshot->Actors.Num() : 0;
+}
+
+/**
+ * Free a snapshot created by CreateSnapshot.
+ */
+extern "C" UETORCH_API void FreeSnapshot(FWorldSnapshot* snapshot)
+{
+	delete snapshot;
+}
+
 extern "C" UETORCH_API bool SetActorLocation(AActor* object, float x, float y, float z) {
 	if(object == NULL) {
 		printf("Object is null\n");
 		return false;
 	}
+	RecordActorOp(ETorchActorOp::Location, object, {x, y, z});
 	return object->SetActorLocation(FVector(x,y,z), false);
 }
 
@@ -838,6 +3579,7 @@ extern "C" UETORCH_API bool SetActorRotation(AActor* object, float pitch, float
 		printf("Object is null\n");
 		return false;
 	}
+	RecordActorOp(ETorchActorOp::Rotation, object, {pitch, yaw, roll});
 	return object->SetActorRotation(FRotator(pitch,yaw,roll));
 }
 
@@ -846,6 +3588,7 @@ extern "C" UETORCH_API bool SetActorLocationAndRotation(AActor* object, float x,
 		printf("Object is null\n");
 		return false;
 	}
+	RecordActorOp(ETorchActorOp::LocationAndRotation, object, {x, y, z, pitch, yaw, roll});
 	return object->SetActorLocationAndRotation(FVector(x,y,z), FRotator(pitch,yaw,roll), false);
 }
 
@@ -854,6 +3597,7 @@ extern "C" UETORCH_API bool SetActorVisible(AActor* object, bool visible) {
 		printf("Object is null\n");
 		return false;
 	}
+	RecordActorOp(ETorchActorOp::Visible, object, {visible ? 1.f : 0.f});
 	object->SetActorHiddenInGame(!visible);
 	return true;
 }
@@ -863,6 +3607,7 @@ extern "C" UETORCH_API bool SetActorVelocity(AActor* object, float x, float y, f
 		printf("Object is null\n");
 		return false;
 	}
+	RecordActorOp(ETorchActorOp::Velocity, object, {x, y, z});
 	UStaticMeshComponent *component = object->FindComponentByClass<UStaticMeshComponent>();
 	if(component == NULL) {
 		printf("Object doesn't have an StaticMeshComponent\n");
@@ -886,6 +3631,7 @@ extern "C" UETORCH_API bool SetActorAngularVelocity(AActor* object, float x, flo
 		printf("Object is null\n");
 		return false;
 	}
+	RecordActorOp(ETorchActorOp::AngularVelocity, object, {x, y, z});
 	UStaticMeshComponent *component = object->FindComponentByClass<UStaticMeshComponent>();
 	if(component == NULL) {
 		printf("Object doesn't have an StaticMeshComponent\n");
@@ -909,6 +3655,7 @@ extern "C" UETORCH_API bool SetActorScale3D(AActor* object, float x, float y, fl
 		printf("Object is null\n");
 		return false;
 	}
+	RecordActorOp(ETorchActorOp::Scale, object, {x, y, z});
 	object->SetActorScale3D(FVector(x,y,z));
 	return true;
 }
@@ -927,6 +3674,9 @@ extern "C" UETORCH_API bool SetMaterial(AActor* object, UMaterial* material) {
 		printf("Object doesn't have an StaticMeshComponent\n");
 		return false;
 	}
+	if (FTorchRecorder::Get().IsRecording()) {
+		FTorchRecorder::Get().RecordMaterial(object, material);
+	}
 	component->SetMaterial(0, material);
 	return true;
 }
@@ -936,6 +3686,7 @@ extern "C" UETORCH_API bool AddForce(AActor* object, float x, float y, float z)
 		printf("Object is null\n");
 		return false;
 	}
+	RecordActorOp(ETorchActorOp::Force, object, {x, y, z});
 	UStaticMeshComponent *component = object->FindComponentByClass<UStaticMeshComponent>();
 	if(component == NULL) {
 		printf("Object doesn't have an StaticMeshComponent\n");
@@ -954,6 +3705,79 @@ extern "C" UETORCH_API bool AddForce(AActor* object, float x, float y, float z)
 	return true;
 }
 
+/**
+ * Spawn a movable StaticMeshActor, e.g. to build a test scene procedurally.
+ *
+ * @param _this the TorchPluginComponent
+ * @param meshPath the path of the static mesh asset, e.g. /Engine/BasicShapes/Cube.Cube
+ * @param relative if true, the pose is relative to the player's camera;
+ *                 otherwise it is in world space
+ * @param scale the uniform scale of the actor
+ * @param simulatePhysics whether the actor simulates physics
+ * @returns the new actor, or NULL on failure
+ */
+extern "C" UETORCH_API AActor* SpawnStaticMeshActor(UObject* _this, const char* meshPath, bool relative, float x, float y, float z, float pitch, float yaw, float roll, float scale, bool simulatePhysics)
+{
+	UWorld* World = GEngine->GetWorldFromContextObject(_this);
+	if (World == NULL) {
+		printf("World null\n");
+		return NULL;
+	}
+	UStaticMesh* Mesh = LoadObject<UStaticMesh>(NULL, ANSI_TO_TCHAR(meshPath));
+	if (Mesh == NULL) {
+		printf("Static mesh %s not found\n", meshPath);
+		return NULL;
+	}
+
+	FTransform Pose(FRotator(pitch, yaw, roll), FVector(x, y, z));
+	if (relative) {
+		APlayerController* PlayerController = UGameplayStatics::GetPlayerController(_this, 0);
+		if (PlayerController == NULL || PlayerController->PlayerCameraManager == NULL) {
+			printf("PlayerCameraManager null\n");
+			return NULL;
+		}
+		FTransform View(PlayerController->PlayerCameraManager->GetCameraRotation(), PlayerController->PlayerCameraManager->GetCameraLocation());
+		Pose = Pose * View;
+	}
+	Pose.SetScale3D(FVector(scale));
+
+	FActorSpawnParameters SpawnParameters;
+	SpawnParameters.SpawnCollisionHandlingOverride = ESpawnActorCollisionHandlingMethod::AlwaysSpawn;
+	AStaticMeshActor* Actor = World->SpawnActor<AStaticMeshActor>(AStaticMeshActor::StaticClass(), Pose, SpawnParameters);
+	if (Actor == NULL) {
+		printf("Unable to spawn StaticMeshActor\n");
+		return NULL;
+	}
+	UStaticMeshComponent* Component = Actor->GetStaticMeshComponent();
+	Component->SetMobility(EComponentMobility::Movable);
+	Component->SetStaticMesh(Mesh);
+	Component->SetCollisionProfileName(UCollisionProfile::BlockAll_ProfileName);
+	Component->SetSimulatePhysics(simulatePhysics);
+
+	if (FTorchRecorder::Get().IsRecording()) {
+		const float Values[] = { x, y, z, pitch, yaw, roll, scale };
+		FTorchRecorder::Get().RecordSpawn(Actor, meshPath, (relative ? 1 : 0) | (simulatePhysics ? 2 : 0), Values, ARRAY_COUNT(Values));
+	}
+	return Actor;
+}
+
+/**
+ * Destroy an actor, e.g. one created by SpawnStaticMeshActor.
+ *
+ * @returns true if the actor was destroyed
+ */
+extern "C" UETORCH_API bool DestroyActor(AActor* object)
+{
+	if (!FActorRegistry::Get().IsValid(object)) {
+		printf("Object is null\n");
+		return false;
+	}
+	if (FTorchRecorder::Get().IsRecording()) {
+		FTorchRecorder::Get().RecordDestroy(object);
+	}
+	return object->Destroy();
+}
+
 extern "C" UETORCH_API bool SetResolution(int x, int y) {
 	if(GEngine && GEngine->GameViewport && GEngine->GameViewport->ViewportFrame) {
 		int32 WindowModeInt = GSystemResolution.WindowMode;
@@ -966,5 +3790,241 @@ extern "C" UETORCH_API bool SetResolution(int x, int y) {
 }
 
 extern "C" UETORCH_API void ExecuteConsoleCommand(UObject* _this, char* command) {
+	if (FTorchRecorder::Get().IsRecording()) {
+		FTorchRecorder::Get().RecordConsoleCommand(command);
+	}
 	UKismetSystemLibrary::ExecuteConsoleCommand(_this, command, NULL);
 }
+
+/*************************************************************************
+ * Recording and replay
+ * The inputs and actor mutations made through the plugin are logged per
+ * tick, so that an episode can be replayed for debugging or to regenerate
+ * its observations without rerunning the agent.
+ *************************************************************************/
+
+// The recorder is shared by all the TorchContexts, so it advances once per
+// engine frame (see TickRecorder); the status of that frame is returned to
+// the other contexts ticking in the same frame
+static uint64 GRecorderFrame = 0;
+static int GRecorderStatus = 0;
+
+/**
+ * Record the inputs (keys, mouse, console commands) and the actor mutations
+ * (Set*, AddForce, SetMaterial, SetActorsState, SpawnStaticMeshActor,
+ * DestroyActor) made through the plugin to a binary log, one group of
+ * records per tick, until StopRecording is called.
+ *
+ * @param path the log file
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool StartRecording(const char* path)
+{
+	if (!FTorchRecorder::Get().StartRecording(ANSI_TO_TCHAR(path), FApp::GetDeltaTime())) {
+		return false;
+	}
+	// the current frame is the first tick of the log
+	GRecorderFrame = GFrameCounter;
+	GRecorderStatus = 1;
+	return true;
+}
+
+/** Stop recording, and flush the log to disk. */
+extern "C" UETORCH_API void StopRecording()
+{
+	FTorchRecorder::Get().StopRecording();
+}
+
+// Returns the actor of an actor name id during a replay
+static AActor* ResolveReplayActor(UObject* _this, int32 Id)
+{
+	FTorchRecorder& Recorder = FTorchRecorder::Get();
+	AActor* Actor = Recorder.GetReplayActor(Id);
+	if (Actor == NULL) {
+		// names of streamed level actors are qualified with their level package
+		FString LevelPackage, Name = Recorder.GetReplayString(Id);
+		const ULevel* Level = NULL;
+		UWorld* World = GEngine->GetWorldFromContextObject(_this);
+		if (World != NULL && Name.Split(TEXT(":"), &LevelPackage, &Name)) {
+			for (const ULevel* StreamedLevel : World->GetLevels()) {
+				if (StreamedLevel != NULL && StreamedLevel->GetOutermost()->GetName() == LevelPackage) {
+					Level = StreamedLevel;
+					break;
+				}
+			}
+			if (Level == NULL) {
+				printf("Replay: level %s not loaded\n", TCHAR_TO_ANSI(*LevelPackage));
+				return NULL;
+			}
+		}
+		FActorRegistry* Registry = GetActorRegistry(_this);
+		Actor = Registry ? Registry->FindByName(FName(*Name), Level) : NULL;
+		if (Actor == NULL) {
+			printf("Replay: actor %s not found\n", TCHAR_TO_ANSI(*Recorder.GetReplayString(Id)));
+		}
+	}
+	return Actor;
+}
+
+// Applies a record of a replay log through the same functions that recorded it
+static void ApplyReplayEvent(UObject* _this, const FTorchReplayEvent& Event)
+{
+	FTorchRecorder& Recorder = FTorchRecorder::Get();
+	const TArray<float>& V = Event.Values;
+	switch (Event.Type) {
+	case ETorchRecord::Key:
+		PressKey(_this, TCHAR_TO_ANSI(*Event.String), Event.ControllerId, Event.EventType);
+		break;
+	case ETorchRecord::Mouse:
+		SetMouse(Event.X, Event.Y);
+		break;
+	case ETorchRecord::Console:
+		ExecuteConsoleCommand(_this, TCHAR_TO_ANSI(*Event.String));
+		break;
+	case ETorchRecord::Spawn:
+		if (V.Num() == 7) {
+			AActor* Actor = SpawnStaticMeshActor(_this, TCHAR_TO_ANSI(*Event.String), (Event.Arg & 1) != 0, V[0], V[1], V[2], V[3], V[4], V[5], V[6], (Event.Arg & 2) != 0);
+			Recorder.SetReplayActor(Event.Actor, Actor);
+		}
+		break;
+	case ETorchRecord::Destroy:
+		if (AActor* Actor = ResolveReplayActor(_this, Event.Actor)) {
+			DestroyActor(Actor);
+		}
+		break;
+	case ETorchRecord::ActorOp:
+	{
+		AActor* Actor = ResolveReplayActor(_this, Event.Actor);
+		if (Actor == NULL) {
+			break;
+		}
+		switch (Event.Op) {
+		case ETorchActorOp::Location:
+			SetActorLocation(Actor, V[0], V[1], V[2]);
+			break;
+		case ETorchActorOp::Rotation:
+			SetActorRotation(Actor, V[0], V[1], V[2]);
+			break;
+		case ETorchActorOp::LocationAndRotation:
+			SetActorLocationAndRotation(Actor, V[0], V[1], V[2], V[3], V[4], V[5]);
+			break;
+		case ETorchActorOp::Visible:
+			SetActorVisible(Actor, V[0] != 0);
+			break;
+		case ETorchActorOp::Velocity:
+			SetActorVelocity(Actor, V[0], V[1], V[2]);
+			break;
+		case ETorchActorOp::AngularVelocity:
+			SetActorAngularVelocity(Actor, V[0], V[1], V[2]);
+			break;
+		case ETorchActorOp::Scale:
+			SetActorScale3D(Actor, V[0], V[1], V[2]);
+			break;
+		case ETorchActorOp::Force:
+			AddForce(Actor, V[0], V[1], V[2]);
+			break;
+		case ETorchActorOp::Material:
+			SetMaterial(Actor, LoadObject<UMaterial>(NULL, *Recorder.GetReplayString(Event.Arg)));
+			break;
+		case ETorchActorOp::State:
+			SetActorsState(&Actor, 1, Event.Arg, V.GetData(), NULL);
+			break;
+		default:
+			printf("Replay: unknown actor op %d\n", (int) Event.Op);
+			break;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+/**
+ * Replay a log written by StartRecording. The game runs in lockstep with the
+ * recorded tick lengths, and the records of each tick are applied by
+ * TickRecorder at the start of the tick.
+ *
+ * @param _this the TorchPluginComponent
+ * @param path the log file
+ * @returns true if successful
+ */
+extern "C" UETORCH_API bool StartReplay(UObject* _this, const char* path)
+{
+	FTorchRecorder& Recorder = FTorchRecorder::Get();
+	if (!Recorder.StartReplay(ANSI_TO_TCHAR(path))) {
+		return false;
+	}
+	const float DeltaTime = Recorder.PeekTickDeltaTime();
+	if (DeltaTime <= 0 || !SetLockstep(_this, true, DeltaTime)) {
+		printf("Replay: log %s has no ticks\n", path);
+		Recorder.StopReplay();
+		return false;
+	}
+	// the first tick is replayed from the next frame
+	GRecorderFrame = GFrameCounter;
+	GRecorderStatus = 1;
+	return true;
+}
+
+/** Stop a replay, and restore the tick settings. */
+extern "C" UETORCH_API void StopReplay(UObject* _this)
+{
+	FTorchRecorder& Recorder = FTorchRecorder::Get();
+	if (Recorder.IsReplaying()) {
+		Recorder.StopReplay();
+		SetLockstep(_this, false, 0);
+	}
+}
+
+extern "C" UETORCH_API bool IsReplaying()
+{
+	return FTorchRecorder::Get().IsReplaying();
+}
+
+/**
+ * Advance the recording or the replay by one tick. Must be called at the
+ * start of every tick, before any input or actor mutation of the tick.
+ * Each TorchContext calls it, but only the first call of an engine frame
+ * advances the recorder.
+ *
+ * @param _this the TorchPluginComponent
+ * @param dt the length of the tick
+ * @returns 1 if recording or replaying, 0 if idle, and -1 if the replay
+ *          just reached the end of the log (it is then stopped)
+ */
+extern "C" UETORCH_API int TickRecorder(UObject* _this, float dt)
+{
+	if (GRecorderFrame == GFrameCounter) {
+		return GRecorderStatus;
+	}
+	GRecorderFrame = GFrameCounter;
+	GRecorderStatus = 0;
+
+	FTorchRecorder& Recorder = FTorchRecorder::Get();
+	if (Recorder.IsRecording()) {
+		Recorder.RecordTick(dt);
+		GRecorderStatus = 1;
+		return 1;
+	}
+	if (!Recorder.IsReplaying()) {
+		return 0;
+	}
+
+	FTorchReplayEvent Event;
+	if (!Recorder.ReadEvent(Event) || Event.Type != ETorchRecord::Tick) {
+		StopReplay(_this);
+		GRecorderStatus = -1;
+		return -1;
+	}
+	GRecorderStatus = 1;
+	while (!Recorder.IsAtTick() && Recorder.ReadEvent(Event)) {
+		ApplyReplayEvent(_this, Event);
+	}
+
+	const float NextDeltaTime = Recorder.PeekTickDeltaTime();
+	if (NextDeltaTime > 0) {
+		SetLockstep(_this, true, NextDeltaTime);
+	}
+	return 1;
+}